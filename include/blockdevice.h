@@ -0,0 +1,44 @@
+#ifndef BLOCKDEVICE_H
+#define BLOCKDEVICE_H
+#include <stdint.h>
+#include <sys/uio.h>
+
+//One transfer in a batch, scattered across or gathered from a list of buffers
+struct BlockRequest
+{
+    uint64_t position; //Offset into the device
+    struct iovec *vectors; //Buffers to fill or write out in order
+    uint32_t vectorCount;
+};
+
+//A backing store for the filesystem
+class BlockDevice
+{
+public:
+    virtual ~BlockDevice() {}
+
+    //Size of the device in bytes
+    virtual uint64_t getSize() = 0;
+
+    //View of the whole device which can be accessed directly, or NULL if it can only be accessed through read and write
+    virtual uint8_t *getMapping() = 0;
+
+    //Copy bytes between the device and a buffer. Returns 0 on failure
+    virtual uint8_t read(uint64_t position, uint8_t *buffer, uint64_t length) = 0;
+    virtual uint8_t write(uint64_t position, const uint8_t *buffer, uint64_t length) = 0;
+
+    //Carry out a batch of transfers which don't overlap, in any order. Devices which can have several transfers in flight
+    //at once override these, otherwise each request is done in turn. Returns 0 if any transfer failed
+    virtual uint8_t readBatch(BlockRequest *requests, uint32_t count);
+    virtual uint8_t writeBatch(BlockRequest *requests, uint32_t count);
+
+    //Make sure everything written so far has reached stable storage. Returns 0 on failure
+    virtual uint8_t sync() = 0;
+};
+
+BlockDevice *fs_createRamDevice(uint64_t size);
+BlockDevice *fs_openMmapDevice(const char *path, uint64_t minimumSize);
+BlockDevice *fs_openFileDevice(const char *path, uint64_t minimumSize);
+BlockDevice *fs_openUringDevice(const char *path, uint64_t minimumSize);
+
+#endif // BLOCKDEVICE_H
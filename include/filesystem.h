@@ -1,7 +1,13 @@
 #ifndef FILESYSTEM_H
 #define FILESYSTEM_H
 #include <stdint.h>
+#include <stdio.h>
 #include <iostream>
+#include <string.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <vector>
+#include "blockdevice.h"
 enum NodeType
 {
     NODE_FILE = 0x0,
@@ -18,17 +24,76 @@ enum ClusterState
 struct NodeHeader
 {
     uint8_t type; //NodeType. Type of node.
+    uint8_t flags; //Combination of the NODE_ flags, stored alongside the type
     uint32_t permissions; //Access permissions
     uint16_t nameLength; //Length of object name
+    uint64_t size; //Number of bytes of data stored in the object, which for a compressed file is its compressed chunks
+    uint32_t tailCluster; //Index of the last cluster in the object
+    uint32_t indexCluster; //First cluster of a directory's hashed index, 0 if it has none and must be searched linearly
     uint8_t *nameData; //Array of characters containing name
 };
 
+struct NodeHeaderView
+{
+    uint8_t type; //NodeType. Type of node.
+    uint8_t flags; //Combination of the NODE_ flags, stored alongside the type
+    uint32_t permissions; //Access permissions
+    uint16_t nameLength; //Length of object name, including the null character
+    uint64_t size; //Number of bytes of data stored in the object, which for a compressed file is its compressed chunks
+    uint32_t tailCluster; //Index of the last cluster in the object
+    uint32_t indexCluster; //First cluster of a directory's hashed index, 0 if it has none
+    const uint8_t *nameData; //Null terminated name, pointing into the disk
+};
+
 struct ClusterHeader
 {
     uint32_t clusterLength; //Actual length of node, is all of it being used?
     uint32_t next; //Index of next node in object
 };
 
+struct ClusterSpanIterator
+{
+    uint32_t clusterIndex; //Index of the next cluster to visit, 0 once finished
+    uint32_t headerSize; //Number of bytes before the data starts in the next cluster
+    uint32_t mapCluster; //Cluster of a mapped file's map listing the cluster after the next one, 0 if they're linked instead
+    uint32_t mapOffset; //Position of that entry within mapCluster
+};
+
+struct FileHandle
+{
+    uint32_t objectIndex; //Index of the file's first cluster
+    uint64_t position; //Offset used by fs_readHandle and fs_writeHandle, moved with fs_seek
+    uint32_t cursorCluster; //Cluster most recently accessed through the handle
+    uint64_t cursorOffset; //Offset within the file that the cursor cluster's data starts at
+    uint32_t headerSize; //Number of bytes before the data starts in the file's first cluster
+    uint8_t hasClusterTable; //Set once clusterTable has been built
+    uint8_t compressed; //Set if the file's data is stored in compressed chunks
+    uint32_t generation; //Chain generation the cursor and tables were found in, they're thrown away once it moves on
+    std::vector<uint32_t> clusterTable; //Every cluster of the file in order, built on the first backwards access
+    std::vector<uint64_t> chunkTable; //Stored offset of each compressed chunk's frame, ~0 for those not found yet
+    uint64_t chunkScan; //Stored offset the handle has read frame headers up to looking for chunks
+    std::vector<uint64_t> freeFrames; //Stored offset of each free frame the handle has come across
+    uint64_t cachedChunk; //Number of the chunk held in chunkData, ~0 if there isn't one
+    std::vector<uint8_t> chunkData; //The chunk most recently decompressed through the handle
+};
+
+struct AllocationGroupInfo
+{
+    uint32_t firstCluster; //Index of the first cluster in the group
+    uint32_t clusterCount; //Number of clusters in the group, only the last group can be short
+    uint32_t freeClusters; //Number of clusters in the group which aren't in use
+};
+
+struct FilesystemStats
+{
+    uint32_t clusterSize; //Number of bytes in a cluster
+    uint32_t totalClusters; //Number of clusters which can hold data, leaving out the superblock and allocation table
+    uint32_t freeClusters; //Number of those clusters not in use
+    uint32_t usedClusters; //Number of those clusters in use
+    uint32_t objectCount; //Number of files and directories
+    uint32_t largestFreeRun; //Length of the longest run of free clusters
+};
+
 struct FilepathClusterInfo
 {
     uint32_t objectIndex; //Index of the object itself
@@ -46,80 +111,435 @@ inline uint32_t intConcatL(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
     return (d << 24) | (c << 16) | (b << 8) | a;
 }
 
-const uint64_t DISK_SIZE = 819200000; //800MB
-const uint16_t CLUSTER_SIZE = 512;
-const uint32_t CLUSTER_COUNT = DISK_SIZE / CLUSTER_SIZE;
-static uint8_t disk[DISK_SIZE];
-#define FIRST_ALLOCATION_POSITION (CLUSTER_COUNT / CLUSTER_SIZE)+1
-#define HEADER_SIZE (uint16_t)280 //16 bytes to take into account the cluster and node headers and 264 byte name limit
+struct Superblock
+{
+    uint32_t magic; //Always SUPERBLOCK_MAGIC on a formatted disk
+    uint32_t version; //Format version the disk was created with
+    uint32_t clusterSize; //Number of bytes in a cluster, a power of 2
+    uint32_t clusterCount; //Number of clusters on the disk
+    uint32_t allocationTableCluster; //First cluster of the allocation table
+    uint32_t allocationTableLength; //Number of clusters in the allocation table
+    uint32_t firstDataCluster; //First cluster which can be allocated
+    uint32_t rootDirectory; //Index of the root directory
+    uint32_t freeClusters; //Number of clusters not in use, as of the last sync
+    uint32_t objectCount; //Number of files and directories, as of the last sync
+    uint32_t features; //Optional parts of the format in use, a combination of the FEATURE_ flags
+    uint32_t checksumTableCluster; //First cluster of the checksum table, if FEATURE_CHECKSUMS is set
+    uint32_t checksumTableLength; //Number of clusters in the checksum table
+    uint32_t journalCluster; //First cluster of the journal, if FEATURE_JOURNAL is set
+    uint32_t journalLength; //Number of clusters in the journal
+    uint32_t referenceTableCluster; //First cluster of the reference table, if FEATURE_CLONES is set
+    uint32_t referenceTableLength; //Number of clusters in the reference table
+
+    //Worked out from the above when the disk is mounted
+    uint32_t clusterShift; //log2 of clusterSize
+    uint32_t allocationWordCount; //The allocation table is a bitmap, one bit per cluster, scanned in 64bit words
+};
+
+const uint64_t DEFAULT_DISK_SIZE = 819200000; //800MB
+const uint32_t DEFAULT_CLUSTER_SIZE = 512;
+#define MIN_CLUSTER_SIZE 512 //Smallest cluster which can hold a node header
+#define MAX_CLUSTER_SIZE (1 << 20)
+#define SUPERBLOCK_MAGIC 0x53465246 //"FRFS"
+#define FORMAT_VERSION 4 //Version 2 added the free cluster and object counts to the superblock, version 3 packed node headers, version 4 optional features
+#define PACKED_HEADER_VERSION 3 //First format version where node headers are only as long as the name needs
+#define FEATURES_VERSION 4 //First format version with the features and checksum table in the superblock
+#define FEATURE_CHECKSUMS 0x1 //Every cluster's contents are checksummed, in a table following the allocation table
+#define FEATURE_JOURNAL 0x2 //Changes made through the block cache go through a write-ahead journal, following the checksum table
+#define FEATURE_CLONES 0x4 //Files can share clusters, with a count of the extra references to each in a table following the checksum table
+#define FEATURE_COMPRESSION 0x8 //Files can be created with NODE_COMPRESSED, storing their data in compressed chunks
+#define KNOWN_FEATURES (FEATURE_CHECKSUMS | FEATURE_JOURNAL | FEATURE_CLONES | FEATURE_COMPRESSION)
+#define JOURNAL_FRACTION 32 //The journal takes up this fraction of the disk, within the limits below
+#define JOURNAL_MIN_LENGTH 64 //Fewest clusters in a journal
+#define JOURNAL_MAX_SIZE (256ULL << 20) //Most bytes in a journal
+#define SUPERBLOCK_SIZE 68 //Bytes of the superblock stored on disk
+extern Superblock superblock; //Geometry of the mounted disk, all offsets are worked out from this
+extern uint8_t *disk; //Mapping of the mounted block device
+#define CLUSTER_SIZE superblock.clusterSize
+#define CLUSTER_COUNT superblock.clusterCount
+#define HEADER_SIZE (uint16_t)296 //32 bytes to take into account the cluster and node headers and 264 byte name limit, the most a node header can take
+#define NODE_SIZE_OFFSET (uint8_t)15 //Position of the object's size in bytes within its first cluster
+#define NODE_TAIL_OFFSET (uint8_t)23 //Position of the index of the object's last cluster within its first cluster
+#define NODE_INDEX_OFFSET (uint8_t)27 //Position of a directory's index cluster within its first cluster
+#define NODE_NAME_OFFSET (uint8_t)31 //Position of the object's name within its first cluster
+#define NODE_TYPE_MASK 0x0F //Bits of the type byte holding the NodeType, the rest hold NODE_ flags
+#define NODE_MAPPED 0x80 //The file's clusters are listed in a map, as it's been cloned and some of them may be shared with other files
+#define NODE_COMPRESSED 0x40 //The file's data is stored in compressed chunks, which can be asked for when it's created
+#define NODE_COMPRESSION_INFO_LENGTH 16 //Bytes at the end of a compressed file's header, its uncompressed size then where its last chunk is stored
 #define CLUSTER_HEADER_SIZE (uint8_t)8 //Reserved number of bytes at the start of each cluster
 #define DIRECTORY_ENTRY_SIZE (uint8_t)4 //Each directory entry is 4 bytes
-static uint32_t lastAllocationPosition = FIRST_ALLOCATION_POSITION;
+#define ALLOCATION_GROUP_SIZE 32768 //Number of clusters in each allocation group, a multiple of 64
+#define ALLOCATION_GROUP_WORDS (ALLOCATION_GROUP_SIZE / 64) //Number of allocation table words covering an allocation group
+#define FREE_RUN_SEARCH_WORDS ALLOCATION_GROUP_WORDS //Most allocation words with free clusters searched for a run before settling for a shorter one
+
+//Concurrency model. The allocation table is updated with atomic operations, so clusters can be allocated and freed from
+//any thread without locking. Each object has a reader/writer lock, see objectlock.cpp, which the functions operating on a
+//whole object take for themselves: directory changes and lookups, fs_getFileSize, fs_write, fs_read and the handle
+//functions. The raw accessors (fs_read32, fs_getNodeHeader, fs_getTailCluster, spans and so on) don't lock, so while other
+//threads may change an object the caller must hold its lock around them with fs_lockObject. A FileHandle must only be used
+//by one thread at a time, and an object must be removed from its directory and closed everywhere before it's freed.
+//Mounting, formatting and unmounting mustn't overlap with anything else.
 
 void fs_writeClusterHeader(uint32_t index, ClusterHeader *header);
 void fs_writeNodeHeader(uint32_t index, NodeHeader *header);
 ClusterHeader *fs_readClusterHeader(uint32_t index);
 NodeHeader *fs_readNodeHeader(uint32_t index);
-void fs_formatDisk();
+ClusterHeader fs_getClusterHeader(uint32_t index);
+NodeHeaderView fs_getNodeHeader(uint32_t index);
+uint8_t fs_mount(BlockDevice *device);
+BlockDevice *fs_unmount();
+uint8_t fs_sync();
+void fs_recordCounts();
+uint8_t fs_formatDisk(BlockDevice *device, uint32_t clusterSize, uint32_t clusterCount);
+uint8_t fs_formatDiskWithFeatures(BlockDevice *device, uint32_t clusterSize, uint32_t clusterCount, uint32_t features);
+uint32_t fs_getRootDirectory();
+uint32_t fs_getHighestUsedCluster();
 uint32_t fs_allocateCluster();
+uint32_t fs_allocateClusterNear(uint32_t goal);
+uint32_t fs_allocateRun(uint32_t count, uint32_t *first);
+uint32_t fs_allocateRunNear(uint32_t count, uint32_t *first, uint32_t goal);
+uint32_t fs_getPreferredGroup();
+uint32_t fs_getAllocationGroupCount();
+AllocationGroupInfo fs_getAllocationGroupInfo(uint32_t group);
+FilesystemStats fs_statfs();
+void fs_freeCluster(uint32_t index);
+uint8_t fs_getClusterState(uint32_t index);
 uint32_t fs_createObject(uint8_t type, uint32_t permissions, uint16_t nameLength, uint8_t *name);
+uint32_t fs_createObjectNear(uint32_t nearIndex, uint8_t type, uint32_t permissions, uint16_t nameLength, uint8_t *name);
 uint8_t fs_getDirectoryClusterFromObjectIndex(uint32_t *directoryIndex, uint32_t *objectIndex, uint32_t *clusterSize);
 uint32_t fs_getDirectoryObject(uint32_t directoryIndex, uint32_t objectIndex);
-uint32_t fs_extendCluster(uint32_t clusterIndex);
+uint32_t fs_extendCluster(uint32_t objectIndex);
+uint32_t fs_extendClusterRun(uint32_t objectIndex, uint32_t count);
 void fs_addObjectToDirectory(uint32_t directoryIndex, uint32_t objectIndex);
 uint8_t fs_removeObjectFromDirectory(uint32_t directoryIndex, uint32_t objectIndex);
+uint8_t fs_unlistObject(uint32_t directoryIndex, uint32_t objectIndex);
 uint64_t fs_getFileSize(uint32_t index);
 uint32_t fs_getClusterHead(uint32_t clusterIndex);
-void fs_write(uint32_t clusterIndex, uint8_t *data, uint32_t dataLength);
+void fs_write(uint32_t clusterIndex, uint8_t *data, uint64_t dataLength);
+uint8_t fs_writev(uint32_t objectIndex, const struct iovec *vectors, uint32_t vectorCount);
 uint8_t *fs_read(uint32_t clusterIndex, uint32_t length);
+uint64_t fs_readInto(uint32_t clusterIndex, uint64_t offset, uint8_t *buffer, uint64_t length);
+void fs_beginSpans(uint32_t clusterIndex, ClusterSpanIterator *iterator);
+uint8_t fs_nextSpan(ClusterSpanIterator *iterator, const uint8_t **data, uint32_t *length);
+FileHandle *fs_open(uint32_t objectIndex);
+void fs_close(FileHandle *handle);
+uint64_t fs_seek(FileHandle *handle, int64_t offset, uint8_t whence);
+uint64_t fs_pread(FileHandle *handle, uint64_t offset, uint8_t *buffer, uint64_t length);
+uint64_t fs_pwrite(FileHandle *handle, uint64_t offset, const uint8_t *data, uint64_t length);
+uint64_t fs_readHandle(FileHandle *handle, uint8_t *buffer, uint64_t length);
+uint64_t fs_writeHandle(FileHandle *handle, const uint8_t *data, uint64_t length);
+void fs_refreshHandle(FileHandle *handle);
+uint8_t fs_unshareHandle(FileHandle *handle, uint32_t first, uint32_t last);
+uint64_t fs_readAt(FileHandle *handle, uint64_t offset, uint8_t *buffer, uint64_t length);
+uint64_t fs_writeAt(FileHandle *handle, uint64_t offset, const uint8_t *data, uint64_t length);
+uint8_t fs_truncateAt(FileHandle *handle, uint64_t size);
 void fs_freeObject(uint32_t index);
+uint64_t fs_removeTree(uint32_t objectIndex);
+void fs_freeRun(uint32_t first, uint32_t count);
 uint8_t *fs_getDisk(); //Temporary RAM disk stuff
+
+//Per object reader/writer locks, see objectlock.cpp
+void fs_lockObject(uint32_t objectIndex, uint8_t exclusive);
+void fs_unlockObject(uint32_t objectIndex, uint8_t exclusive);
+uint32_t fs_getChainGeneration(uint32_t objectIndex);
+uint32_t fs_moveChainGeneration(uint32_t objectIndex);
+
+//Write-back cluster cache for devices which can't be mapped, see blockcache.cpp
+#define DEFAULT_CACHE_BUDGET (64ULL << 20) //Bytes of cluster data the cache may hold
+#define BLOCK_CACHE_MIN_CLUSTERS 64 //The cache always has room for at least this many clusters
+#define BLOCK_CACHE_PINS 4 //Number of pointers into the cache each thread can hold at once
+#define BLOCK_CACHE_READAHEAD_START 16 //Clusters read ahead when a walk along a chain starts, doubling each time the walk catches up
+#define BLOCK_CACHE_PREFETCH_THREADS 2 //Threads reading ahead in the background
+#define BLOCK_CACHE_PREFETCH_QUEUE 64 //Most requests to read ahead waiting at once, more are dropped
+#define BLOCK_CACHE_NO_CLUSTER 0xFFFFFFFF //Cluster index of an empty cache slot
+#define BLOCK_CACHE_MAX_RUN IOV_MAX //Most consecutive clusters joined into a single transfer, the most buffers a transfer can take
+struct BlockCacheStats
+{
+    uint64_t hits; //Accesses to a cluster already in the cache
+    uint64_t misses; //Accesses which read a cluster in from the device
+    uint64_t prefetched; //Clusters read in ahead of being accessed
+    uint64_t evictions; //Clusters dropped to make room
+    uint64_t writebacks; //Dirty clusters written to the device
+    uint32_t capacity; //Number of clusters the cache can hold
+    uint32_t resident; //Number of clusters in the cache
+};
+void fs_openCache(BlockDevice *device);
+void fs_closeCache();
+uint8_t fs_flushCache();
+void fs_setCacheBudget(uint64_t bytes);
+BlockCacheStats fs_getCacheStats();
+void fs_cacheRead(uint64_t writePos, uint8_t *data, uint64_t length);
+void fs_cacheWrite(uint64_t writePos, const uint8_t *data, uint64_t length);
+void fs_cacheMove(uint64_t destination, uint64_t source, uint64_t length);
+const uint8_t *fs_cachePointer(uint64_t writePos);
+uint32_t fs_cachePrefetch(uint32_t clusterIndex, uint32_t count);
+uint8_t fs_takeCacheError();
+void fs_collectCacheChanges(uint64_t sequence, std::vector<uint32_t> *clusters, std::vector<uint8_t> *images);
+void fs_finishCacheCheckpoint(uint64_t sequence, const std::vector<uint32_t> &clusters);
+uint32_t fs_getCacheModifiedCount();
+
+//Write-ahead journal for disks accessed through the block cache, see journal.cpp
+uint8_t fs_replayJournal(BlockDevice *device, const Superblock *header);
+void fs_openJournal(BlockDevice *device);
+uint8_t fs_emptyJournal();
+void fs_stopJournal();
+uint8_t fs_isJournalActive();
+void fs_beginOperation();
+void fs_endOperation();
+uint64_t fs_getOperationLimit();
+uint8_t fs_commit();
+uint8_t fs_checkpoint();
+uint64_t fs_getDurableSequence();
+void fs_journalClaimed(uint32_t firstCluster, uint64_t mask);
+void fs_journalReleased(uint32_t firstCluster, uint64_t mask);
+uint8_t fs_claimEarlyWrite(uint32_t clusterIndex);
+
+//Cluster checksums and consistency checking, see checksum.cpp
+struct ScrubReport
+{
+    uint32_t objects; //Objects reached from the root directory
+    uint32_t expectedObjects; //Number of objects the filesystem thinks there are
+    uint64_t clustersVerified; //Clusters in use whose checksums were checked
+    uint32_t checksumErrors; //Clusters whose contents don't match their checksum, or couldn't be read
+    uint32_t brokenObjects; //Objects whose header, chain or index doesn't make sense, or disagrees with their size or tail
+    uint32_t crossLinkedClusters; //Clusters reached from more than one chain
+    uint32_t unallocatedClusters; //Clusters reached from a chain but marked as free
+    uint32_t leakedClusters; //Clusters marked as used which nothing refers to
+    uint32_t miscountedClusters; //Shared clusters whose reference count doesn't match the number of chains reaching them
+};
+uint32_t fs_crc32c(uint32_t crc, const uint8_t *data, uint64_t length);
+uint8_t fs_openChecksums(BlockDevice *device, uint8_t loadTable);
+uint8_t fs_syncChecksums();
+void fs_collectChecksumChanges(std::vector<uint32_t> *clusters, std::vector<uint8_t> *images);
+void fs_collectChecksumWrites(const std::vector<uint32_t> &written, std::vector<uint32_t> *clusters, std::vector<uint8_t> *images);
+void fs_restoreChecksumWrites(const std::vector<uint32_t> &clusters);
+void fs_markChecksumsDirty(uint32_t firstCluster, uint32_t lastCluster);
+void fs_forgetChecksums(uint32_t firstCluster, uint64_t mask);
+void fs_sealCluster(uint32_t clusterIndex, const uint8_t *data);
+uint8_t fs_verifyCluster(uint32_t clusterIndex, const uint8_t *data);
+uint32_t fs_getChecksumFailures();
+uint8_t fs_scrub(uint32_t threadCount, ScrubReport *report);
+
+//Copy-on-write clones of files and directory trees, see clone.cpp
+uint8_t fs_openReferences(BlockDevice *device, uint8_t loadTable);
+uint8_t fs_syncReferences();
+void fs_collectReferenceChanges(std::vector<uint32_t> *clusters, std::vector<uint8_t> *images);
+uint32_t fs_getSharedReferences(uint32_t clusterIndex);
+uint32_t fs_nextMapEntry(uint32_t *mapCluster, uint32_t *entryOffset);
+void fs_readClusterMap(uint32_t objectIndex, std::vector<uint32_t> *clusters);
+uint8_t fs_extendClusterMap(uint32_t objectIndex, uint32_t clusterIndex);
+void fs_truncateClusterMap(uint32_t objectIndex, uint32_t count);
+void fs_releaseClusterMap(uint32_t objectIndex, std::vector<uint32_t> *clusters);
+uint8_t fs_unshareClusters(uint32_t objectIndex, uint32_t first, uint32_t last, std::vector<uint32_t> *clusterTable);
+uint32_t fs_clone(uint32_t objectIndex);
+uint32_t fs_snapshot(uint32_t directoryIndex, uint32_t parentIndex, uint16_t nameLength, uint8_t *name);
+
+//Compressed files, see compression.cpp
+#define COMPRESSION_CHUNK_SIZE 16384 //Bytes of a compressed file's data in each chunk, which is compressed on its own
+#define COMPRESSION_FRAME_HEADER_SIZE 12 //Bytes in front of each stored chunk giving its room, stored length and chunk number
+uint32_t fs_compressChunk(const uint8_t *source, uint32_t length, uint8_t *destination, uint32_t capacity);
+uint8_t fs_decompressChunk(const uint8_t *source, uint32_t length, uint8_t *destination, uint32_t expectedLength);
+uint64_t fs_readCompressed(FileHandle *handle, uint64_t offset, uint8_t *buffer, uint64_t length);
+uint64_t fs_writeCompressed(FileHandle *handle, uint64_t offset, const uint8_t *data, uint64_t length);
+uint8_t fs_appendCompressed(uint32_t objectIndex, const struct iovec *vectors, uint32_t vectorCount);
+uint8_t fs_checkCompressedFile(uint32_t objectIndex);
+
+//Hashed directory indexes, see directoryindex.cpp
+uint32_t fs_hashName(const char *name, uint32_t nameLength);
+uint32_t fs_getIndexCluster(uint32_t directoryIndex);
+uint8_t fs_buildDirectoryIndex(uint32_t directoryIndex);
+void fs_freeDirectoryIndex(uint32_t directoryIndex);
+void fs_collectAllocationChanges(std::vector<uint32_t> *clusters, std::vector<uint8_t> *images);
+void fs_collectIndexClusters(uint32_t directoryIndex, std::vector<uint32_t> *clusters);
+uint8_t fs_getIndexLayout(uint32_t directoryIndex, uint32_t *tableLength, std::vector<uint32_t> *bucketHeads);
+void fs_addIndexEntry(uint32_t directoryIndex, uint32_t objectIndex, uint32_t relativeIndex);
+void fs_removeIndexEntry(uint32_t directoryIndex, uint32_t objectIndex, uint32_t relativeIndex);
+void fs_moveIndexEntry(uint32_t directoryIndex, uint32_t objectIndex, uint32_t oldRelativeIndex, uint32_t newRelativeIndex);
+uint8_t fs_findIndexEntry(uint32_t directoryIndex, const char *name, uint32_t nameLength, uint32_t *objectIndex, uint32_t *relativeIndex);
+
+//Directory entry cache for path lookups, see dentrycache.cpp
+uint8_t fs_lookupDentry(uint32_t directoryIndex, const char *name, uint32_t nameLength, uint32_t *objectIndex, uint32_t *relativeIndex);
+void fs_insertDentry(uint32_t directoryIndex, const char *name, uint32_t nameLength, uint32_t objectIndex, uint32_t relativeIndex);
+void fs_invalidateDentry(uint32_t directoryIndex, const char *name, uint32_t nameLength);
+void fs_invalidateDentries();
 FilepathClusterInfo fs_getClusterFromFilepath(uint32_t rootDirectory, uint32_t currentDirectory, uint8_t *path, uint32_t pathLength);
 
 //Converts a cluster index and cluster offset into actual disk index. Must be used to get the value to pass to the read/write functions
 inline uint64_t fs_getWritePosition(uint32_t clusterIndex)
 {
-    return clusterIndex * CLUSTER_SIZE;
+    return (uint64_t)clusterIndex << superblock.clusterShift;
+}
+
+//Notes that bytes of a mapped disk have changed, so the checksums of the clusters they're in are brought up to date on the next sync
+inline void fs_touchClusters(uint64_t writePos, uint64_t length)
+{
+    if((superblock.features & FEATURE_CHECKSUMS) && length != 0)
+        fs_markChecksumsDirty(writePos >> superblock.clusterShift, (writePos + length - 1) >> superblock.clusterShift);
+}
+
+//Copy a block of bytes to disk. When the device isn't mapped, every access goes through the block cache instead
+inline void fs_writeBytes(uint64_t writePos, const uint8_t *data, uint64_t length)
+{
+    if(disk == NULL)
+    {
+        fs_cacheWrite(writePos, data, length);
+        return;
+    }
+    memcpy(&disk[writePos], data, length);
+    fs_touchClusters(writePos, length);
+}
+
+//Copy a block of bytes from disk
+inline void fs_readBytes(uint64_t writePos, uint8_t *data, uint64_t length)
+{
+    if(disk == NULL)
+    {
+        fs_cacheRead(writePos, data, length);
+        return;
+    }
+    memcpy(data, &disk[writePos], length);
+}
+
+//Move a block of bytes within a cluster, the source and destination may overlap
+inline void fs_moveBytes(uint64_t destination, uint64_t source, uint64_t length)
+{
+    if(disk == NULL)
+    {
+        fs_cacheMove(destination, source, length);
+        return;
+    }
+    memmove(&disk[destination], &disk[source], length);
+    fs_touchClusters(destination, length);
+}
+
+//Get a pointer to a disk index, valid for the rest of the cluster it falls in. With the block cache, it only stays valid
+//until the calling thread has taken another BLOCK_CACHE_PINS pointers
+inline const uint8_t *fs_getDataPointer(uint64_t writePos)
+{
+    if(disk == NULL)
+        return fs_cachePointer(writePos);
+    return &disk[writePos];
 }
 
 //Write a byte to disk index
 inline void fs_write8(uint64_t writePos, uint8_t byte)
 {
+    if(disk == NULL)
+    {
+        fs_cacheWrite(writePos, &byte, 1);
+        return;
+    }
     disk[writePos] = byte;
+    fs_touchClusters(writePos, 1);
 }
 
 //Read byte from disk index
 inline uint8_t fs_read8(uint64_t writePos)
 {
+    uint8_t byte;
+    if(disk == NULL)
+    {
+        fs_cacheRead(writePos, &byte, 1);
+        return byte;
+    }
     return disk[writePos];
 }
 
 //Write a 16bit integer to disk
 inline void fs_write16(uint64_t writePos, uint16_t data)
 {
-    disk[writePos] = data;
-    disk[writePos + 1] = data >> 8;
+    uint8_t bytes[2] = {(uint8_t)data, (uint8_t)(data >> 8)};
+    fs_writeBytes(writePos, bytes, 2);
 }
 
 //Read a 16bit integer from disk
 inline uint16_t fs_read16(uint64_t writePos)
 {
-    return intConcat(disk[writePos], disk[writePos + 1]);
+    uint8_t bytes[2];
+    fs_readBytes(writePos, bytes, 2);
+    return intConcat(bytes[0], bytes[1]);
 }
 
 //Write a 32bit integer to disk
 inline void fs_write32(uint64_t writePos, uint32_t data)
 {
-    disk[writePos] = data;
-    disk[writePos + 1] = data >> 8;
-    disk[writePos + 2] = data >> 16;
-    disk[writePos + 3] = data >> 24;
+    uint8_t bytes[4] = {(uint8_t)data, (uint8_t)(data >> 8), (uint8_t)(data >> 16), (uint8_t)(data >> 24)};
+    fs_writeBytes(writePos, bytes, 4);
 }
 
 //Read a 32bit integer from disk
 inline uint32_t fs_read32(uint64_t writePos)
 {
-    return intConcatL(disk[writePos], disk[writePos + 1], disk[writePos + 2], disk[writePos + 3]);
+    uint8_t bytes[4];
+    fs_readBytes(writePos, bytes, 4);
+    return intConcatL(bytes[0], bytes[1], bytes[2], bytes[3]);
+}
+
+//Write a 64bit integer to disk
+inline void fs_write64(uint64_t writePos, uint64_t data)
+{
+    uint8_t bytes[8];
+    for(uint32_t a = 0; a < 8; a++)
+        bytes[a] = data >> (a * 8);
+    fs_writeBytes(writePos, bytes, 8);
+}
+
+//Read a 64bit integer from disk
+inline uint64_t fs_read64(uint64_t writePos)
+{
+    uint8_t bytes[8];
+    fs_readBytes(writePos, bytes, 8);
+    return intConcatL(bytes[0], bytes[1], bytes[2], bytes[3]) | ((uint64_t)intConcatL(bytes[4], bytes[5], bytes[6], bytes[7]) << 32);
+}
+
+//Return the index of the last cluster in an object
+inline uint32_t fs_getTailCluster(uint32_t index)
+{
+    return fs_read32(fs_getWritePosition(index) + NODE_TAIL_OFFSET);
+}
+
+//Returns the position in a file's chain of the cluster holding offset, counting the first cluster as 0. Every cluster of a
+//file but the last is full, so it follows from the offset
+inline uint32_t fs_getClusterPosition(const FileHandle *handle, uint64_t offset)
+{
+    uint32_t headCapacity = CLUSTER_SIZE - handle->headerSize;
+    return offset < headCapacity ? 0 : 1 + ((offset - headCapacity) / (CLUSTER_SIZE - CLUSTER_HEADER_SIZE));
+}
+
+//Returns the number of bytes a node header takes up with a name of nameLength bytes, including its null terminator.
+//It's rounded up so directory entries stay aligned and a full cluster holds a whole number of them
+inline uint32_t fs_getPackedHeaderSize(uint32_t nameLength)
+{
+    return (NODE_NAME_OFFSET + nameLength + DIRECTORY_ENTRY_SIZE - 1) & ~(uint32_t)(DIRECTORY_ENTRY_SIZE - 1);
+}
+
+//Returns 1 if an object is a file whose data is stored in compressed chunks
+inline uint8_t fs_isCompressed(uint32_t index)
+{
+    return (superblock.features & FEATURE_COMPRESSION) && (fs_read8(fs_getWritePosition(index) + 8) & NODE_COMPRESSED);
+}
+
+//Returns 1 if an object is a file whose clusters after the first are listed in a map rather than linked through each other
+inline uint8_t fs_isMapped(uint32_t index)
+{
+    return (superblock.features & FEATURE_CLONES) && (fs_read8(fs_getWritePosition(index) + 8) & NODE_MAPPED);
+}
+
+//Returns the number of bytes before the data starts in an object's first cluster. Older disks always leave room for the
+//longest name, and compressed files follow the name with their uncompressed size and where their last chunk is
+inline uint32_t fs_getHeaderSize(uint32_t index)
+{
+    if(superblock.version < PACKED_HEADER_VERSION)
+        return HEADER_SIZE;
+    uint32_t headerSize = fs_getPackedHeaderSize(fs_read16(fs_getWritePosition(index) + 13));
+    return fs_isCompressed(index) ? headerSize + NODE_COMPRESSION_INFO_LENGTH : headerSize;
+}
+
+//Returns 1 if an object is called name, which doesn't need to be null terminated
+inline uint8_t fs_isNamed(uint32_t index, const char *name, uint32_t nameLength)
+{
+    uint64_t writePos = fs_getWritePosition(index);
+    return fs_read16(writePos + 13) == nameLength + 1 && memcmp(fs_getDataPointer(writePos + NODE_NAME_OFFSET), name, nameLength) == 0;
 }
 
 //Delete all dynamically allocated NodeHeader memory
@@ -132,14 +552,17 @@ inline void fs_freeNodeHeader(NodeHeader *header)
 //Return the number of objects in a directory
 inline uint32_t fs_getDirectorySize(uint32_t index)
 {
-    return fs_getFileSize(index) / DIRECTORY_ENTRY_SIZE;
+    return fs_read64(fs_getWritePosition(index) + NODE_SIZE_OFFSET) / DIRECTORY_ENTRY_SIZE;
 }
 
 //Create a new directory and insert parent object
 inline uint32_t fs_createDirectory(uint32_t parent, uint32_t permissions, uint16_t nameLength, uint8_t *name)
 {
-    uint32_t obj = fs_createObject(NODE_DIRECTORY, permissions, nameLength, name);
-    fs_addObjectToDirectory(obj, parent);
+    fs_beginOperation();
+    uint32_t obj = fs_createObjectNear(parent, NODE_DIRECTORY, permissions, nameLength, name);
+    if(obj != 0)
+        fs_addObjectToDirectory(obj, parent);
+    fs_endOperation();
     return obj;
 }
 
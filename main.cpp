@@ -2,139 +2,491 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <limits>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <fstream>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "filesystem.h"
 
-int isDirectory(const std::string &path) {
-   struct stat statbuf;
-   if (stat(path.c_str(), &statbuf) != 0)
-       return 0;
-   return S_ISDIR(statbuf.st_mode);
-}
+//A host directory or chunk of a host file waiting to be packed. Jobs are created by the walker in the order they're created
+//on the disk, with every chunk of a file queued one after the other
+struct PackJob
+{
+    std::string path; //Path on the host
+    std::string name; //Name of the object on the disk
+    uint8_t isDirectory;
+    uint32_t parentId; //Directory the object goes in, directories are numbered in the order they're walked with the root as 0
+    uint64_t offset; //Position of the chunk within the host file, the object is created by the chunk at offset 0
+    uint64_t length; //Size of the chunk
+    std::string data; //Contents of the chunk, filled in by a reader
+    uint8_t ready; //Set once the job can be written
+    uint8_t failed; //Set if the host file couldn't be read
+    uint32_t objectIndex; //File the chunk is appended to, filled in when it's handed to a writer
+};
 
-void packStructure(const std::string &filepath, uint32_t rootDirectory)
+//Work shared between the walker, the readers, the writers and the thread creating the objects
+struct PackQueue
 {
-    DIR *pdir = NULL;
-    pdir = opendir(filepath.c_str());
-    struct dirent *pent = NULL;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<PackJob*> pending; //Jobs which haven't been handed to a writer yet, in walk order
+    std::deque<PackJob*> unread; //Chunks which haven't been read yet
+    std::vector<std::deque<PackJob*>> writing; //Chunks handed to each writer, every chunk of a file going to the same one
+    std::vector<uint64_t> writingBytes; //Total size of the chunks handed to each writer
+    uint64_t queuedJobs = 0; //Jobs which have been queued but not finished with
+    uint64_t queuedBytes = 0; //Total size of their chunks
+    uint64_t chunkSize; //Largest amount of a file read in one go
+    uint8_t walkFinished = 0;
+    uint8_t createFinished = 0; //Set once every job has been handed out, so the writers stop once they run out
+    uint8_t diskFull = 0; //Set once the disk has filled up, after which everything else is skipped
+};
 
+//Limits on how far the walker and readers can get ahead of the writers. Memory use is bounded by the chunk size times the in flight chunks
+#define PACK_MAX_PENDING_JOBS 4096
+#define PACK_IN_FLIGHT_CHUNKS 64
+#define PACK_DEFAULT_CHUNK_SIZE (1ULL << 20)
+
+//Adds a job to the end of the queue, waiting for the writers to catch up if too much is queued
+static void queuePackJob(PackQueue *queue, PackJob *job)
+{
+    std::unique_lock<std::mutex> guard(queue->lock);
+    queue->changed.wait(guard, [queue] {
+        return queue->queuedJobs == 0 || (queue->queuedJobs < PACK_MAX_PENDING_JOBS && queue->queuedBytes < queue->chunkSize * PACK_IN_FLIGHT_CHUNKS);
+    });
+    queue->pending.push_back(job);
+    queue->queuedJobs++;
+    queue->queuedBytes += job->length;
+    if(!job->isDirectory)
+        queue->unread.push_back(job);
+    queue->changed.notify_all();
+}
+
+//Walks a host directory depth first, queueing its contents sorted by name so the disk layout doesn't depend on readdir order
+static void walkStructure(PackQueue *queue, const std::string &filepath, uint32_t directoryId, uint32_t *nextDirectoryId)
+{
+    DIR *pdir = opendir(filepath.c_str());
     if(pdir == NULL)
     {
         std::cout << "Couldn't initialise directory" << std::endl;
         return;
     }
 
+    std::vector<std::string> names;
+    struct dirent *pent = NULL;
     while((pent = readdir(pdir)))
     {
-        if(pent == NULL)
-        {
-            std::cout << "Couldn't read directory entry" << std::endl;
-        }
         std::string strName = pent->d_name;
         if(strName == ".." || strName == ".")
             continue;
-        if(isDirectory(filepath + "/" + strName)) //If object is directory
-        {
-            //Add object to disk
-            uint32_t newFile = fs_createDirectory(rootDirectory, 0, strName.size(), (uint8_t*)strName.c_str());
+        names.push_back(strName);
+    }
+    closedir(pdir);
+    std::sort(names.begin(), names.end());
 
-            //Add to current directory
-            fs_addObjectToDirectory(rootDirectory, newFile);
+    for(const std::string &strName : names)
+    {
+        struct stat statbuf;
+        std::string path = filepath + "/" + strName;
+        if(stat(path.c_str(), &statbuf) != 0)
+            continue;
 
-            //Now recursively search this directory, passing root as the newly created directory
-            packStructure(filepath + "/" + strName, newFile);
-        }
-        else //Else if object is file
+        //Files are split into chunks, always queueing at least one so that empty files are still created
+        uint8_t isDirectory = S_ISDIR(statbuf.st_mode);
+        uint64_t size = isDirectory ? 0 : statbuf.st_size;
+        uint64_t offset = 0;
+        do
         {
-            //Add object to disk
-            uint32_t newFile = fs_createObject(NODE_FILE, 0, strName.size(), (uint8_t*)strName.c_str());
+            PackJob *job = new PackJob;
+            job->path = path;
+            job->name = strName;
+            job->isDirectory = isDirectory;
+            job->parentId = directoryId;
+            job->offset = offset;
+            job->length = size - offset < queue->chunkSize ? size - offset : queue->chunkSize;
+            job->ready = isDirectory;
+            job->failed = 0;
+            queuePackJob(queue, job);
+            offset += job->length;
+        } while(offset < size);
 
-            //Add to current directory
-            fs_addObjectToDirectory(rootDirectory, newFile);
+        //Now recursively search this directory, its contents are written straight after it
+        if(isDirectory)
+            walkStructure(queue, path, (*nextDirectoryId)++, nextDirectoryId);
+    }
+}
 
-            //Read actual file data and copy into disk
-            std::ifstream file(filepath + "/" + strName);
-            if(!file.is_open())
+//Reads queued chunks of host files into memory until the walk is finished and nothing is left to read
+static void readStructure(PackQueue *queue)
+{
+    std::unique_lock<std::mutex> guard(queue->lock);
+    while(true)
+    {
+        queue->changed.wait(guard, [queue] { return !queue->unread.empty() || queue->walkFinished; });
+        if(queue->unread.empty())
+            return;
+        PackJob *job = queue->unread.front();
+        queue->unread.pop_front();
+        guard.unlock();
+
+        //Read actual file data. A file which shrinks after it was walked just gives a short chunk
+        int fd = open(job->path.c_str(), O_RDONLY);
+        if(fd >= 0)
+        {
+            job->data.resize(job->length);
+            uint64_t done = 0;
+            while(done < job->length)
             {
-                std::cout << "Failed to read: " << filepath + "/" + strName << std::endl;
-                return;
+                ssize_t got = pread(fd, &job->data[done], job->length - done, job->offset + done);
+                if(got <= 0)
+                {
+                    job->failed = got < 0;
+                    break;
+                }
+                done += got;
             }
-            std::string fileData;
+            job->data.resize(done);
+            close(fd);
+        }
+        else
+            job->failed = 1;
 
-            //Get file size
-            file.seekg(0, file.end);
-            uint32_t fileSize = file.tellg();
-            file.seekg(0, file.beg);
-            fileData.resize(fileSize);
+        guard.lock();
+        job->ready = 1;
+        queue->changed.notify_all();
+    }
+}
 
-            //Read in that many bytes into fileData
-            file.read(&fileData[0], fileSize);
+//Returns the type new files are created with, which compresses them if the disk supports it
+static uint8_t newFileType()
+{
+    return superblock.features & FEATURE_COMPRESSION ? NODE_FILE | NODE_COMPRESSED : NODE_FILE;
+}
 
-            //Write that many bytes to disk
-            fs_write(newFile, (uint8_t*)&fileData[0], fileSize);
+//Appends the chunks handed to writer number id onto their files until every job has been handed out and written
+static void writeStructure(PackQueue *queue, uint32_t id)
+{
+    std::deque<PackJob*> *writing = &queue->writing[id];
+    uint8_t currentFailed = 0; //Set once a chunk of the current file couldn't be read
+    std::unique_lock<std::mutex> guard(queue->lock);
+    while(true)
+    {
+        queue->changed.wait(guard, [queue, writing] { return !writing->empty() || queue->createFinished; });
+        if(writing->empty())
+            return;
+        PackJob *job = writing->front();
+        uint8_t diskFull = queue->diskFull;
+        guard.unlock();
 
-            fileData.clear();
-            file.close();
+        //Append the chunk onto the end of the file, the rest of the file is skipped once a chunk fails
+        if(job->offset == 0)
+            currentFailed = 0;
+        uint8_t reportFailure = job->failed && !currentFailed;
+        currentFailed |= job->failed;
+        uint8_t filled = 0;
+        if(!currentFailed && !diskFull)
+        {
+            struct iovec vector;
+            vector.iov_base = &job->data[0];
+            vector.iov_len = job->data.size();
+            filled = !fs_writev(job->objectIndex, &vector, 1);
         }
 
+        guard.lock();
+        if(reportFailure)
+            std::cout << "Failed to read: " << job->path << std::endl;
+        if(filled && !queue->diskFull)
+            std::cout << "Disk is full, stopped at: " << job->path << std::endl;
+        queue->diskFull |= filled;
+        writing->pop_front();
+        queue->writingBytes[id] -= job->length;
+        queue->queuedJobs--;
+        queue->queuedBytes -= job->length;
+        queue->changed.notify_all();
+        delete job;
     }
-    closedir (pdir);
 }
 
+//Copies a host directory tree onto the disk. The walk and the host reads run on their own threads while this thread
+//creates each object in walk order, so every directory lists its contents in the same order regardless of threadCount.
+//File data is appended by threadCount writers, each file by a single writer, so the files hold the same data however many
+//there are. With more than one writer their clusters can be placed differently from run to run, while a single writer
+//always produces the same disk from the same tree. Files are streamed through in chunks of chunkSize bytes, so no file is
+//ever held in memory whole
+void packStructure(const std::string &filepath, uint32_t rootDirectory, uint32_t threadCount, uint64_t chunkSize)
+{
+    PackQueue queue;
+    queue.chunkSize = chunkSize;
+    queue.writing.resize(threadCount);
+    queue.writingBytes.assign(threadCount, 0);
+    uint32_t nextDirectoryId = 1;
+    std::thread walker([&] {
+        walkStructure(&queue, filepath, 0, &nextDirectoryId);
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.walkFinished = 1;
+        queue.changed.notify_all();
+    });
+    std::vector<std::thread> readers;
+    std::vector<std::thread> writers;
+    for(uint32_t a = 0; a < threadCount; a++)
+    {
+        readers.push_back(std::thread(readStructure, &queue));
+        writers.push_back(std::thread(writeStructure, &queue, a));
+    }
+
+    //Disk objects of the walked directories, indexed by their id
+    std::vector<uint32_t> directories(1, rootDirectory);
+    uint32_t currentFile = 0; //Object the chunks of the current file are appended to
+    uint32_t currentWriter = 0; //Writer the chunks of the current file are handed to
+    std::unique_lock<std::mutex> guard(queue.lock);
+    while(true)
+    {
+        queue.changed.wait(guard, [&queue] { return (!queue.pending.empty() && queue.pending.front()->ready) || (queue.pending.empty() && queue.walkFinished); });
+        if(queue.pending.empty())
+            break;
+        PackJob *job = queue.pending.front();
+        queue.pending.pop_front();
+
+        //A file's first chunk goes to whichever writer has the least left to write, and the rest of it follows. With a single
+        //writer, objects are only created once it's caught up, so everything is allocated in walk order
+        if(job->isDirectory || job->offset == 0)
+        {
+            for(uint32_t a = 0; a < threadCount; a++)
+                if(queue.writingBytes[a] < queue.writingBytes[currentWriter])
+                    currentWriter = a;
+            if(threadCount == 1)
+                queue.changed.wait(guard, [&queue] { return queue.writing[0].empty(); });
+        }
+        uint8_t diskFull = queue.diskFull;
+        guard.unlock();
+
+        uint32_t parent = directories[job->parentId];
+        uint32_t created = 1;
+        if(diskFull)
+        {
+            //Keep the directory list lined up with the walk, nothing more will be written
+            if(job->isDirectory)
+                directories.push_back(0);
+        }
+        else if(job->isDirectory) //If object is directory
+        {
+            //Add object to disk and to current directory
+            fs_beginOperation();
+            created = fs_createDirectory(parent, 0, job->name.size(), (uint8_t*)job->name.c_str());
+            if(created != 0)
+                fs_addObjectToDirectory(parent, created);
+            fs_endOperation();
+            directories.push_back(created);
+        }
+        else if(job->offset == 0) //Else if object is file
+        {
+            //Add object to disk and to current directory when its first chunk comes through
+            fs_beginOperation();
+            currentFile = created = fs_createObjectNear(parent, newFileType(), 0, job->name.size(), (uint8_t*)job->name.c_str());
+            if(created != 0)
+                fs_addObjectToDirectory(parent, created);
+            fs_endOperation();
+        }
+
+        guard.lock();
+        if(created == 0 && !queue.diskFull)
+            std::cout << "Disk is full, stopped at: " << job->path << std::endl;
+        queue.diskFull |= created == 0;
+        if(job->isDirectory || queue.diskFull)
+        {
+            queue.queuedJobs--;
+            queue.queuedBytes -= job->length;
+            delete job;
+        }
+        else
+        {
+            job->objectIndex = currentFile;
+            queue.writing[currentWriter].push_back(job);
+            queue.writingBytes[currentWriter] += job->length;
+        }
+        queue.changed.notify_all();
+    }
+    queue.createFinished = 1;
+    queue.changed.notify_all();
+    guard.unlock();
 
-int main()
+    walker.join();
+    for(std::thread &reader : readers)
+        reader.join();
+    for(std::thread &writer : writers)
+        writer.join();
+}
+
+
+int main(int argc, char **argv)
 {
-    std::cout << "\nPreparing RAM disk... ";
-    //Install filesystem to ramdisk
-    fs_formatDisk();
-    std::cout << "Done. " << std::endl;
-    std::cout << "Disk size: " << DISK_SIZE
-              << "\nCluster size: " << CLUSTER_SIZE
-              << "\nUsable disk space: " << DISK_SIZE-(CLUSTER_SIZE * 4) << std::endl;
+    //-c sets the cluster size and -s the disk size of a newly created disk, -j the number of threads reading and writing files
+    //to pack and -b the size of the chunks files are read in. -m mounts an image through the block cache with the given budget in bytes,
+    //rather than mapping it, and -u has the cache use io_uring to access the image rather than pread and pwrite. -k gives a newly
+    //created disk checksums on every cluster, -w a write-ahead journal, and -r lets files share clusters, so they can be cloned.
+    //-z compresses every file created on the disk. Images with a journal are always mounted through the cache, as it's only
+    //used there
+    uint32_t clusterSize = DEFAULT_CLUSTER_SIZE;
+    uint64_t diskSize = DEFAULT_DISK_SIZE;
+    uint32_t threadCount = std::thread::hardware_concurrency();
+    uint64_t chunkSize = PACK_DEFAULT_CHUNK_SIZE;
+    uint64_t cacheBudget = 0;
+    uint8_t useUring = 0;
+    uint32_t features = 0;
+    int option;
+    while((option = getopt(argc, argv, "c:s:j:b:m:ukwrz")) != -1)
+    {
+        if(option == 'c')
+            clusterSize = strtoul(optarg, NULL, 0);
+        else if(option == 's')
+            diskSize = strtoull(optarg, NULL, 0);
+        else if(option == 'j')
+            threadCount = strtoul(optarg, NULL, 0);
+        else if(option == 'b')
+            chunkSize = strtoull(optarg, NULL, 0);
+        else if(option == 'm')
+            cacheBudget = strtoull(optarg, NULL, 0);
+        else if(option == 'u')
+            useUring = 1;
+        else if(option == 'k')
+            features |= FEATURE_CHECKSUMS;
+        else if(option == 'w')
+            features |= FEATURE_JOURNAL;
+        else if(option == 'r')
+            features |= FEATURE_CLONES;
+        else if(option == 'z')
+            features |= FEATURE_COMPRESSION;
+        else
+        {
+            std::cout << "Usage: " << argv[0] << " [-c clusterSize] [-s diskSize] [-j threads] [-b chunkSize] [-m cacheBudget [-u]] [-k] [-w] [-r] [-z] [image]" << std::endl;
+            return 1;
+        }
+    }
+
+    if(optind < argc)
+    {
+        //Mount an existing image in place, its pages are only read in as they're used. With a cache budget, only that much of it is held in memory
+        std::cout << "\nMounting " << argv[optind] << "... ";
+        BlockDevice *device;
+        if(cacheBudget != 0)
+        {
+            fs_setCacheBudget(cacheBudget);
+            device = useUring ? fs_openUringDevice(argv[optind], 0) : fs_openFileDevice(argv[optind], 0);
+        }
+        else
+            device = fs_openMmapDevice(argv[optind], 0);
+        if(device == NULL || !fs_mount(device))
+        {
+            std::cout << "Failed to mount " << argv[optind] << std::endl;
+            return 1;
+        }
 
+        //A mapped image is written in place as it's changed, which the journal can't protect, so one with a journal is mounted again through the cache
+        if(cacheBudget == 0 && (superblock.features & FEATURE_JOURNAL))
+        {
+            delete fs_unmount();
+            device = useUring ? fs_openUringDevice(argv[optind], 0) : fs_openFileDevice(argv[optind], 0);
+            if(device == NULL || !fs_mount(device))
+            {
+                std::cout << "Failed to mount " << argv[optind] << std::endl;
+                return 1;
+            }
+        }
+        std::cout << "Done. " << std::endl;
+    }
+    else
+    {
+        std::cout << "\nPreparing RAM disk... ";
+        //Install filesystem to ramdisk
+        BlockDevice *device = fs_createRamDevice(diskSize);
+        if(device == NULL || !fs_formatDiskWithFeatures(device, clusterSize, 0, features))
+        {
+            std::cout << "Failed to create RAM disk" << std::endl;
+            return 1;
+        }
+        std::cout << "Done. " << std::endl;
 
-    uint8_t rootName[] = "root";
-    uint32_t rootDirectory = fs_createObject(NODE_DIRECTORY, 0, 4, rootName);
-    fs_addObjectToDirectory(rootDirectory, rootDirectory);
-    uint32_t currentDirectory = rootDirectory;
+        packStructure(".", fs_getRootDirectory(), threadCount == 0 ? 1 : threadCount, chunkSize == 0 ? PACK_DEFAULT_CHUNK_SIZE : chunkSize);
 
-    packStructure(".", rootDirectory);
+        //Write out the disk up to the last cluster in use, it can be mounted again by passing it as an argument.
+        //Syncing first records the counts and checksums in the image
+        fs_sync();
+        uint64_t sz = fs_getWritePosition(fs_getHighestUsedCluster()) + CLUSTER_SIZE;
+        std::ofstream file("disk.ffs", std::ios::binary | std::ios::out);
+        if(!file.is_open())
+            return 1;
+        char *arr = (char*)fs_getDisk();
+        file.write(&arr[0], sz);
+        file.close();
 
-    uint32_t sz = fs_getWritePosition(lastAllocationPosition) + CLUSTER_SIZE;
-    std::ofstream file("disk.ffs", std::ios::binary | std::ios::out);
-    if(!file.is_open())
-        return 1;
-    char *arr = (char*)fs_getDisk();
-    file.write(&arr[0], sz);
-    file.close();
-   // return 0;
+        //Extend the image back to the full size of the disk, the unused tail is a hole which takes up no space
+        if(truncate("disk.ffs", fs_getWritePosition(CLUSTER_COUNT)) != 0)
+            return 1;
+    }
+    FilesystemStats stats = fs_statfs();
+    std::cout << "Disk size: " << fs_getWritePosition(CLUSTER_COUNT)
+              << "\nCluster size: " << CLUSTER_SIZE
+              << "\nUsable disk space: " << fs_getWritePosition(stats.totalClusters)
+              << "\nFree disk space: " << fs_getWritePosition(stats.freeClusters) << std::endl;
+    uint32_t rootDirectory = fs_getRootDirectory();
+    uint32_t currentDirectory = rootDirectory;
 
     while(true)
     {
         std::cout << "$: ";
         std::string command, args, args2;
-        std::cin >> command;
+        if(!(std::cin >> command))
+            break;
 
         if(command == "mkdir")
         {
             std::cin >> args;
-            fs_createDirectory(currentDirectory, 0, args.size(), (uint8_t*)&args[0]);
+            fs_beginOperation();
+            uint32_t obj = fs_createDirectory(currentDirectory, 0, args.size(), (uint8_t*)&args[0]);
+            if(obj != 0)
+                fs_addObjectToDirectory(currentDirectory, obj);
+            fs_endOperation();
+            if(obj == 0)
+                std::cout << "Disk is full" << std::endl;
         }
         else if(command == "rm")
         {
             std::cin >> args;
             FilepathClusterInfo info = fs_getClusterFromFilepath(rootDirectory, currentDirectory, (uint8_t*)&args[0], args.size());
-            if(info.objectIndex == currentDirectory)
+
+            //A path which doesn't fully resolve gives back the last directory found, so make sure the name matches
+            std::string name = args.substr(0, args.find_last_not_of('/') + 1);
+            name = name.substr(name.find_last_of('/') + 1);
+            if(!fs_isNamed(info.objectIndex, name.c_str(), name.size()))
             {
+                std::cout << args << " not found" << std::endl;
                 continue;
             }
-            fs_removeObjectFromDirectory(info.ownerIndex, info.relativeIndex);
-            fs_freeObject(info.objectIndex);
+
+            //Don't pull the current directory out from under the shell
+            uint32_t directory = currentDirectory;
+            while(directory != 0 && directory != rootDirectory && directory != info.objectIndex)
+                directory = fs_getDirectoryObject(directory, 0);
+            if(directory == info.objectIndex)
+            {
+                std::cout << "Can't remove a directory containing the current one" << std::endl;
+                continue;
+            }
+
+            //Unlisting fails for the parent entry
+            fs_beginOperation();
+            if(fs_removeObjectFromDirectory(info.ownerIndex, info.relativeIndex))
+                fs_removeTree(info.objectIndex);
+            fs_endOperation();
         }
         else if(command == "ls")
         {
@@ -143,11 +495,8 @@ int main()
             for(uint32_t a = 1; a < dirSize; a++)
             {
                 uint32_t node = fs_getDirectoryObject(currentDirectory, a);
-                NodeHeader *nodeData = fs_readNodeHeader(node);
-                for(uint16_t b = 0; b < nodeData->nameLength; b++)
-                    std::cout << nodeData->nameData[b];
-                std::cout << std::endl;
-                fs_freeNodeHeader(nodeData);
+                NodeHeaderView nodeData = fs_getNodeHeader(node);
+                std::cout << (const char*)nodeData.nameData << std::endl;
             }
         }
         else if(command == "cd")
@@ -159,14 +508,11 @@ int main()
                 std::cout << args << " not found" << std::endl;
                 continue;
             }
-            NodeHeader *node = fs_readNodeHeader(file);
-            if(node->type != NODE_DIRECTORY)
+            if(fs_getNodeHeader(file).type != NODE_DIRECTORY)
             {
-                fs_freeNodeHeader(node);
                 std::cout << args << " is not a directory" << std::endl;
                 continue;
             }
-            fs_freeNodeHeader(node);
             currentDirectory = file;
         }
         else if(command == "touch")
@@ -181,18 +527,27 @@ int main()
 
             char *last = strrchr(&args[0], '/');
             uint32_t obj = 0;
+            fs_beginOperation();
             if(last != NULL)
             {
-                obj = fs_createObject(NODE_FILE, 0, args.size(), (uint8_t*)last+1);
+                obj = fs_createObject(newFileType(), 0, args.size(), (uint8_t*)last+1);
                 uint32_t file = fs_getClusterFromFilepath(rootDirectory, currentDirectory, (uint8_t*)&args[0], args.size()).objectIndex;
-                fs_addObjectToDirectory(file, obj);
+                if(obj != 0)
+                    fs_addObjectToDirectory(file, obj);
             }
             else
             {
-                obj = fs_createObject(NODE_FILE, 0, args.size(), (uint8_t*)&args[0]);
-                fs_addObjectToDirectory(currentDirectory, obj);
+                obj = fs_createObjectNear(currentDirectory, newFileType(), 0, args.size(), (uint8_t*)&args[0]);
+                if(obj != 0)
+                    fs_addObjectToDirectory(currentDirectory, obj);
             }
-            fs_write(obj, (uint8_t*)&args2[0], args2.size());
+            struct iovec vector;
+            vector.iov_base = &args2[0];
+            vector.iov_len = args2.size();
+            uint8_t written = obj != 0 && fs_writev(obj, &vector, 1);
+            fs_endOperation();
+            if(!written)
+                std::cout << "Disk is full" << std::endl;
         }
         else if(command == "less")
         {
@@ -203,19 +558,36 @@ int main()
                 std::cout << args << " not found" << std::endl;
                 continue;
             }
-            NodeHeader *node = fs_readNodeHeader(file);
-            if(node->type != NODE_FILE)
+            if(fs_getNodeHeader(file).type != NODE_FILE)
             {
                 std::cout << args << " is not a file" << std::endl;
                 continue;
             }
-            delete node;
-            uint32_t fileSize = fs_getFileSize(file);
-            uint8_t *b = fs_read(file, fileSize);
-            for(uint32_t c = 0; c < fileSize; c++)
-                std::cout << b[c];
+
+            //A compressed file is printed a piece at a time as it's decompressed
+            uint64_t printed = 0;
+            if(fs_isCompressed(file))
+            {
+                std::vector<uint8_t> buffer(COMPRESSION_CHUNK_SIZE * 4);
+                uint64_t readLength;
+                for(; (readLength = fs_readInto(file, printed, buffer.data(), buffer.size())) != 0; printed += readLength)
+                    std::cout.write((const char*)buffer.data(), readLength);
+            }
+            else
+            {
+                //Print the file straight out of the disk, one cluster at a time
+                ClusterSpanIterator span;
+                fs_beginSpans(file, &span);
+                const uint8_t *data;
+                uint32_t length;
+                for(; fs_nextSpan(&span, &data, &length); printed += length)
+                    std::cout.write((const char*)data, length);
+            }
             std::cout << std::endl;
-            delete b;
+
+            //Reading stops short at a cluster which can't be read or fails its checksum
+            if(printed < fs_getFileSize(file))
+                std::cout << "Couldn't read " << args << " past byte " << printed << std::endl;
         }
         else if(command == "sizeof")
         {
@@ -226,13 +598,109 @@ int main()
                 std::cout << args << " not found" << std::endl;
                 continue;
             }
-            NodeHeader *node = fs_readNodeHeader(file);
-            if(node->type != NODE_FILE)
+            NodeHeaderView node = fs_getNodeHeader(file);
+            if(node.type != NODE_FILE)
             {
                 std::cout << args << " is not a file" << std::endl;
                 continue;
             }
-            std::cout << fs_getFileSize(file) << " bytes" << std::endl;
+            if(fs_isCompressed(file))
+                std::cout << fs_getFileSize(file) << " bytes, " << node.size << " stored" << std::endl;
+            else
+                std::cout << node.size << " bytes" << std::endl;
+        }
+        else if(command == "clone")
+        {
+            //Clone a file into a directory, sharing its clusters until either copy is written to
+            std::cin >> args >> args2;
+            FilepathClusterInfo info = fs_getClusterFromFilepath(rootDirectory, currentDirectory, (uint8_t*)&args[0], args.size());
+            uint32_t directory = fs_getClusterFromFilepath(rootDirectory, currentDirectory, (uint8_t*)&args2[0], args2.size()).objectIndex;
+            if(info.objectIndex == currentDirectory || fs_getNodeHeader(info.objectIndex).type != NODE_FILE)
+            {
+                std::cout << args << " is not a file" << std::endl;
+                continue;
+            }
+            if(fs_getNodeHeader(directory).type != NODE_DIRECTORY || (directory == currentDirectory && args2 != "."))
+            {
+                std::cout << args2 << " is not a directory" << std::endl;
+                continue;
+            }
+            NodeHeaderView node = fs_getNodeHeader(info.objectIndex);
+            std::string name((const char*)node.nameData);
+            if(fs_getClusterFromFilepath(rootDirectory, directory, (uint8_t*)&name[0], name.size()).objectIndex != directory)
+            {
+                std::cout << name << " already exists in " << args2 << std::endl;
+                continue;
+            }
+
+            fs_beginOperation();
+            uint32_t obj = fs_clone(info.objectIndex);
+            if(obj != 0)
+                fs_addObjectToDirectory(directory, obj);
+            fs_endOperation();
+            if(obj == 0)
+                std::cout << "Can't clone " << args << (superblock.features & FEATURE_CLONES ? ", the disk is full" : ", the disk wasn't created with -r") << std::endl;
+        }
+        else if(command == "snap")
+        {
+            //Copy a directory tree into the current directory under a new name, cloning every file in it
+            std::cin >> args >> args2;
+            uint32_t directory = fs_getClusterFromFilepath(rootDirectory, currentDirectory, (uint8_t*)&args[0], args.size()).objectIndex;
+            if(fs_getNodeHeader(directory).type != NODE_DIRECTORY || (directory == currentDirectory && args != "."))
+            {
+                std::cout << args << " is not a directory" << std::endl;
+                continue;
+            }
+            if(fs_getClusterFromFilepath(rootDirectory, currentDirectory, (uint8_t*)&args2[0], args2.size()).objectIndex != currentDirectory)
+            {
+                std::cout << args2 << " already exists" << std::endl;
+                continue;
+            }
+
+            if(fs_snapshot(directory, currentDirectory, args2.size(), (uint8_t*)&args2[0]) == 0)
+                std::cout << "Can't snapshot " << args << (superblock.features & FEATURE_CLONES ? ", the disk is full" : ", the disk wasn't created with -r") << std::endl;
+        }
+        else if(command == "df")
+        {
+            //Show how full the disk is
+            FilesystemStats stats = fs_statfs();
+            std::cout << "Clusters: " << stats.totalClusters << " of " << stats.clusterSize << " bytes"
+                      << "\nUsed: " << stats.usedClusters << " (" << (uint64_t)stats.usedClusters * 100 / stats.totalClusters << "%)"
+                      << "\nFree: " << stats.freeClusters << ", largest free run " << stats.largestFreeRun
+                      << "\nObjects: " << stats.objectCount << std::endl;
+        }
+        else if(command == "groups")
+        {
+            //Show how full each allocation group is
+            for(uint32_t a = 0; a < fs_getAllocationGroupCount(); a++)
+            {
+                AllocationGroupInfo group = fs_getAllocationGroupInfo(a);
+                uint32_t used = group.clusterCount - group.freeClusters;
+                std::cout << "Group " << a << ": clusters " << group.firstCluster << "-" << group.firstCluster + group.clusterCount - 1
+                          << ", " << used << "/" << group.clusterCount << " used (" << (uint64_t)used * 100 / group.clusterCount << "%)" << std::endl;
+            }
+        }
+        else if(command == "cache")
+        {
+            //Show how well the block cache is doing, it's only used for images mounted with -m
+            BlockCacheStats stats = fs_getCacheStats();
+            uint64_t accesses = stats.hits + stats.misses;
+            std::cout << "Clusters cached: " << stats.resident << "/" << stats.capacity
+                      << "\nHits: " << stats.hits << ", misses: " << stats.misses << " (" << (accesses == 0 ? 0 : stats.hits * 100 / accesses) << "% hit rate)"
+                      << "\nRead ahead: " << stats.prefetched
+                      << "\nEvictions: " << stats.evictions << ", write backs: " << stats.writebacks
+                      << "\nChecksum failures: " << fs_getChecksumFailures() << std::endl;
+        }
+        else if(command == "scrub")
+        {
+            //Check the whole disk for damage, using as many threads as packing does
+            ScrubReport report;
+            uint8_t clean = fs_scrub(threadCount == 0 ? 1 : threadCount, &report);
+            std::cout << "Objects: " << report.objects << " of " << report.expectedObjects << ", " << report.brokenObjects << " broken"
+                      << "\nClusters verified: " << report.clustersVerified << ", checksum errors: " << report.checksumErrors
+                      << "\nCross linked: " << report.crossLinkedClusters << ", in use but free: " << report.unallocatedClusters
+                      << ", leaked: " << report.leakedClusters << ", miscounted references: " << report.miscountedClusters
+                      << "\n" << (clean ? "No problems found" : "Problems found") << std::endl;
         }
         else
         {
@@ -241,6 +709,9 @@ int main()
 
         }
     }
+
+    //Flush any changes out to the image before exiting
+    delete fs_unmount();
     return 0;
 }
 
@@ -0,0 +1,679 @@
+#include "filesystem.h"
+#include <string.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
+
+//Write-back block cache, used in place of a mapping when the mounted device can only be accessed with read and write.
+//Whole clusters are read in on first access and kept until they're evicted by the CLOCK algorithm, which gives any cluster
+//touched since the hand last passed a second chance. Changes are only written back to the device when a dirty cluster is
+//evicted or the cache is flushed. Every access takes a single lock, which is only held for lookups and copies. A cluster
+//being read in has its slot marked as loading and the lock is dropped for the read, so other threads carry on, and any
+//which want that cluster wait for it to arrive rather than reading it again.
+//Reading ahead is done in the background by BLOCK_CACHE_PREFETCH_THREADS threads, which follow the chain being walked
+//through the cache and read in whatever of it is missing. Where the clusters needed are known, reading ahead and flushing
+//hand the device a whole batch of transfers at once, with consecutive clusters joined together, so devices which can
+//overlap transfers keep a deep queue.
+//Pointers into the cache pin their cluster so it can't be evicted while they're in use. Each thread keeps its last
+//BLOCK_CACHE_PINS pointers pinned, releasing the oldest each time it takes a new one.
+//On disks with checksums, each cluster is sealed as it's written back and verified as it's read in, see checksum.cpp.
+//A cluster which can't be read isn't cached. Accesses to it see zeros, which ends any walk along a chain there, writes to it
+//are dropped, and the accessing thread's cache error is set for fs_takeCacheError to report. A cluster which fails to verify
+//is cached but marked as damaged, and reads of it go the same way, while writes to it are kept and leave it as undamaged, as
+//it's sealed again when it's written back.
+//With the journal running, a changed cluster can't be written back until a copy of it has been committed, see journal.cpp.
+//Slots are put on lists as they're changed, so flushing and committing only look at the slots which may have changed rather
+//than the whole cache.
+struct CacheSlot
+{
+    uint32_t clusterIndex; //Cluster held in the slot
+    uint32_t pins; //Number of pointers into the slot in use, it can't be evicted while non zero
+    uint8_t referenced; //Set on each access and cleared as the clock hand passes
+    uint8_t dirty; //Set if the data has changed since it was read from the device
+    uint8_t modified; //Set if the data has changed since the journal last took a copy of it
+    uint8_t loading; //Set while the cluster is being read in, during which the slot is pinned and its data mustn't be touched
+    uint8_t listed; //Set while the slot is on the list of dirty slots
+    uint8_t damaged; //Set if the data failed to verify when it was read in, and hasn't been written to since
+    uint64_t sequence; //Journal transaction holding the last copy taken, which must be durable before the data is written back
+    uint8_t *data; //Contents of the cluster
+};
+
+struct PinRing
+{
+    uint32_t generation; //Cache the pins were taken from, they're dropped if it's been replaced
+    uint32_t slots[BLOCK_CACHE_PINS]; //Pinned slot + 1, or 0 if unused
+    uint32_t next; //Next entry to reuse
+};
+
+//A chain to read ahead along
+struct PrefetchRequest
+{
+    uint32_t clusterIndex; //Cluster to start from
+    uint32_t count; //Number of clusters of the chain to read in
+};
+
+static std::mutex cacheLock;
+static std::condition_variable slotsLoaded; //Signalled whenever clusters finish loading
+static std::condition_variable prefetchQueued; //Signalled when there's reading ahead to do, or the threads doing it should stop
+static std::deque<PrefetchRequest> prefetchQueue;
+static std::vector<std::thread> prefetchThreads;
+static uint8_t prefetchStopping = 0;
+static BlockDevice *cacheDevice = NULL;
+static std::vector<CacheSlot> cacheSlots;
+static std::unordered_map<uint32_t, uint32_t> cacheIndex; //Cluster index to slot
+static std::vector<uint32_t> dirtySlots; //Every dirty slot, along with some which have since been cleaned, each listed once
+static std::vector<uint32_t> modifiedSlots; //Every slot with modified set, along with some which have since been evicted
+static uint32_t cacheCapacity = 0; //Number of slots allowed by the budget
+static uint32_t clockHand = 0;
+static uint32_t cacheGeneration = 0;
+static uint64_t cacheBudget = DEFAULT_CACHE_BUDGET;
+static uint8_t writeFailed = 0; //Set if a write back has failed since the last flush
+static uint32_t modifiedCount = 0; //Number of slots with modified set
+static BlockCacheStats cacheStats;
+static std::vector<uint8_t> zeroCluster; //What a cluster which couldn't be read in is seen as through fs_cachePointer
+static thread_local PinRing pinRing;
+static thread_local uint8_t cacheError = 0; //Set when this thread accesses a cluster which couldn't be read in
+
+//Writes a slot back to the device if it's dirty, along with its checksum. If the write fails the slot stays dirty, so the
+//change isn't lost. The cache lock must be held. Returns 0 on failure
+static uint8_t fs_writeBackSlot(CacheSlot *slot)
+{
+    if(!slot->dirty)
+        return 1;
+    fs_sealCluster(slot->clusterIndex, slot->data);
+    std::vector<uint32_t> written(1, slot->clusterIndex);
+    std::vector<uint32_t> tableClusters;
+    std::vector<uint8_t> tableImages;
+    fs_collectChecksumWrites(written, &tableClusters, &tableImages);
+    std::vector<struct iovec> vectors(1 + tableClusters.size());
+    std::vector<BlockRequest> requests(vectors.size());
+    for(uint32_t a = 0; a < vectors.size(); a++)
+    {
+        vectors[a].iov_base = a == 0 ? slot->data : &tableImages[(a - 1) * CLUSTER_SIZE];
+        vectors[a].iov_len = CLUSTER_SIZE;
+        requests[a].position = fs_getWritePosition(a == 0 ? slot->clusterIndex : tableClusters[a - 1]);
+        requests[a].vectors = &vectors[a];
+        requests[a].vectorCount = 1;
+    }
+    if(!cacheDevice->writeBatch(&requests[0], requests.size()))
+    {
+        fs_restoreChecksumWrites(tableClusters);
+        writeFailed = 1;
+        return 0;
+    }
+    slot->dirty = 0;
+    cacheStats.writebacks++;
+    return 1;
+}
+
+//Returns 1 if a dirty slot may be written back in place now. With the journal running, changes only reach their home once a
+//committed copy is durable, apart from clusters allocated since the last commit, as nothing committed depends on what they held
+static uint8_t fs_mayWriteBack(CacheSlot *slot)
+{
+    if(!slot->dirty || !fs_isJournalActive())
+        return 1;
+    if(!slot->modified)
+        return slot->sequence <= fs_getDurableSequence();
+    return fs_claimEarlyWrite(slot->clusterIndex);
+}
+
+//Marks a slot as changed. The cache lock must be held
+static inline void fs_modifySlot(CacheSlot *slot)
+{
+    slot->dirty = 1;
+    slot->damaged = 0;
+    if(!slot->listed)
+    {
+        slot->listed = 1;
+        dirtySlots.push_back(slot - &cacheSlots[0]);
+    }
+    if(!slot->modified && fs_isJournalActive())
+    {
+        slot->modified = 1;
+        modifiedSlots.push_back(slot - &cacheSlots[0]);
+        __atomic_store_n(&modifiedCount, modifiedCount + 1, __ATOMIC_RELAXED);
+    }
+}
+
+//Finds a slot to load a new cluster into, evicting whatever it held. The cache lock must be held
+static uint32_t fs_claimCacheSlot()
+{
+    //Use up the budget before evicting anything
+    if(cacheSlots.size() < cacheCapacity)
+    {
+        CacheSlot slot;
+        slot.pins = 0;
+        slot.referenced = 0;
+        slot.dirty = 0;
+        slot.modified = 0;
+        slot.loading = 0;
+        slot.listed = 0;
+        slot.damaged = 0;
+        slot.sequence = 0;
+        slot.data = new uint8_t[CLUSTER_SIZE];
+        cacheSlots.push_back(slot);
+        return cacheSlots.size() - 1;
+    }
+
+    //Two sweeps of the clock are enough to find a cluster which hasn't been referenced, unless everything is pinned
+    for(uint32_t a = 0; a < cacheSlots.size() * 2; a++)
+    {
+        uint32_t index = clockHand;
+        CacheSlot *slot = &cacheSlots[index];
+        if(++clockHand == cacheSlots.size())
+            clockHand = 0;
+        if(slot->pins != 0)
+            continue;
+        if(slot->referenced)
+        {
+            slot->referenced = 0;
+            continue;
+        }
+        if(!fs_mayWriteBack(slot) || !fs_writeBackSlot(slot))
+            continue;
+
+        if(slot->modified)
+            __atomic_store_n(&modifiedCount, modifiedCount - 1, __ATOMIC_RELAXED);
+        slot->modified = 0;
+        slot->sequence = 0;
+        cacheIndex.erase(slot->clusterIndex);
+        slot->clusterIndex = BLOCK_CACHE_NO_CLUSTER;
+        cacheStats.evictions++;
+        return index;
+    }
+
+    //Every slot is pinned, waiting on the journal or failing to be written back, so go over budget rather than fail
+    cacheCapacity++;
+    return fs_claimCacheSlot();
+}
+
+//Claims a slot for a cluster which isn't cached, marking it as loading. The cache lock must be held
+static uint32_t fs_claimLoadingSlot(uint32_t clusterIndex)
+{
+    uint32_t slotIndex = fs_claimCacheSlot();
+    CacheSlot *slot = &cacheSlots[slotIndex];
+    slot->clusterIndex = clusterIndex;
+    slot->referenced = 1;
+    slot->loading = 1;
+    slot->pins++;
+    cacheIndex[clusterIndex] = slotIndex;
+    return slotIndex;
+}
+
+//Orders slots by the cluster they hold
+static bool fs_compareSlotClusters(uint32_t a, uint32_t b)
+{
+    return cacheSlots[a].clusterIndex < cacheSlots[b].clusterIndex;
+}
+
+static void fs_buildCacheRequests(const std::vector<uint32_t> &slots, std::vector<struct iovec> *vectors, std::vector<BlockRequest> *requests);
+
+//Gets the dirty slots in order of cluster, taking those which have been cleaned off the list. The cache lock must be held
+static void fs_getDirtySlots(std::vector<uint32_t> *dirty)
+{
+    uint32_t kept = 0;
+    for(uint32_t a = 0; a < dirtySlots.size(); a++)
+    {
+        CacheSlot *slot = &cacheSlots[dirtySlots[a]];
+        if(slot->dirty)
+            dirtySlots[kept++] = dirtySlots[a];
+        else
+            slot->listed = 0;
+    }
+    dirtySlots.resize(kept);
+    dirty->assign(dirtySlots.begin(), dirtySlots.end());
+    std::sort(dirty->begin(), dirty->end(), fs_compareSlotClusters);
+}
+
+//Reads in the clusters of slots claimed by fs_claimLoadingSlot, in order of cluster. The cache lock is held by guard, and
+//is dropped while the device reads them. Clusters which can't be read are dropped from the cache, leaving their slots free,
+//and those which fail to verify are marked as damaged. Returns 0 if any were dropped
+static uint8_t fs_loadSlots(const std::vector<uint32_t> &slots, std::unique_lock<std::mutex> &guard)
+{
+    BlockDevice *device = cacheDevice;
+    std::vector<uint32_t> clusters(slots.size());
+    std::vector<uint8_t*> buffers(slots.size());
+    for(uint32_t a = 0; a < slots.size(); a++)
+    {
+        clusters[a] = cacheSlots[slots[a]].clusterIndex;
+        buffers[a] = cacheSlots[slots[a]].data;
+    }
+    std::vector<struct iovec> vectors;
+    std::vector<BlockRequest> requests;
+    if(slots.size() > 1)
+        fs_buildCacheRequests(slots, &vectors, &requests);
+    guard.unlock();
+
+    //If a batch fails, fall back to reading each cluster on its own
+    std::vector<uint8_t> loaded(slots.size(), 1);
+    std::vector<uint8_t> verified(slots.size(), 1);
+    uint8_t success = slots.size() > 1 && device->readBatch(&requests[0], requests.size());
+    for(uint32_t a = 0; a < slots.size(); a++)
+    {
+        if(!success && !device->read(fs_getWritePosition(clusters[a]), buffers[a], CLUSTER_SIZE))
+            loaded[a] = 0;
+        else
+            verified[a] = fs_verifyCluster(clusters[a], buffers[a]);
+    }
+
+    guard.lock();
+    uint8_t allLoaded = 1;
+    for(uint32_t a = 0; a < slots.size(); a++)
+    {
+        CacheSlot *slot = &cacheSlots[slots[a]];
+        slot->loading = 0;
+        slot->pins--;
+        slot->damaged = !verified[a];
+        if(!loaded[a])
+        {
+            cacheIndex.erase(slot->clusterIndex);
+            slot->clusterIndex = BLOCK_CACHE_NO_CLUSTER;
+            slot->referenced = 0;
+            allLoaded = 0;
+        }
+    }
+    slotsLoaded.notify_all();
+    return allLoaded;
+}
+
+//Returns the slot holding a cluster, reading it in if it isn't cached, or NULL if it can't be read in, or is damaged and
+//isn't being written to, in which case the thread's cache error is set. The cache lock is held by guard, and may be dropped
+//while waiting for the cluster, so slot pointers taken before the call may no longer be valid
+static CacheSlot *fs_getCacheSlot(uint32_t clusterIndex, uint8_t writing, uint32_t *slotIndex, std::unique_lock<std::mutex> &guard)
+{
+    CacheSlot *slot = NULL;
+    while(slot == NULL)
+    {
+        std::unordered_map<uint32_t, uint32_t>::iterator found = cacheIndex.find(clusterIndex);
+        if(found == cacheIndex.end())
+            break;
+
+        //Another thread is already reading the cluster in, so wait for it and look again, as it may be evicted by then
+        if(cacheSlots[found->second].loading)
+        {
+            slotsLoaded.wait(guard);
+            continue;
+        }
+        cacheStats.hits++;
+        *slotIndex = found->second;
+        slot = &cacheSlots[found->second];
+        slot->referenced = 1;
+    }
+
+    if(slot == NULL)
+    {
+        cacheStats.misses++;
+        std::vector<uint32_t> loading(1, fs_claimLoadingSlot(clusterIndex));
+        if(fs_loadSlots(loading, guard))
+        {
+            *slotIndex = loading[0];
+            slot = &cacheSlots[loading[0]];
+        }
+    }
+    if(slot == NULL || (slot->damaged && !writing))
+    {
+        cacheError = 1;
+        return NULL;
+    }
+    return slot;
+}
+
+//Builds the transfers for a list of slots sorted by cluster, joining slots holding consecutive clusters. The cache lock must be held
+static void fs_buildCacheRequests(const std::vector<uint32_t> &slots, std::vector<struct iovec> *vectors, std::vector<BlockRequest> *requests)
+{
+    //Requests point into the vector list, so it mustn't be reallocated
+    vectors->resize(slots.size());
+    for(uint32_t a = 0; a < slots.size(); a++)
+    {
+        CacheSlot *slot = &cacheSlots[slots[a]];
+        (*vectors)[a].iov_base = slot->data;
+        (*vectors)[a].iov_len = CLUSTER_SIZE;
+        if(a > 0 && slot->clusterIndex == cacheSlots[slots[a - 1]].clusterIndex + 1 && requests->back().vectorCount < BLOCK_CACHE_MAX_RUN)
+        {
+            requests->back().vectorCount++;
+            continue;
+        }
+
+        BlockRequest request;
+        request.position = fs_getWritePosition(slot->clusterIndex);
+        request.vectors = &(*vectors)[a];
+        request.vectorCount = 1;
+        requests->push_back(request);
+    }
+}
+
+static void fs_prefetchThread();
+
+//Starts caching a device, using the current budget
+void fs_openCache(BlockDevice *device)
+{
+    fs_closeCache();
+    std::lock_guard<std::mutex> guard(cacheLock);
+    cacheDevice = device;
+    cacheCapacity = cacheBudget / CLUSTER_SIZE < BLOCK_CACHE_MIN_CLUSTERS ? BLOCK_CACHE_MIN_CLUSTERS : cacheBudget / CLUSTER_SIZE;
+    cacheIndex.reserve(cacheCapacity);
+    clockHand = 0;
+    cacheGeneration++;
+    writeFailed = 0;
+    modifiedCount = 0;
+    memset(&cacheStats, 0, sizeof(cacheStats));
+    zeroCluster.assign(CLUSTER_SIZE, 0);
+    for(uint32_t a = 0; a < BLOCK_CACHE_PREFETCH_THREADS; a++)
+        prefetchThreads.push_back(std::thread(fs_prefetchThread));
+}
+
+//Drops everything in the cache without writing it back, fs_flushCache should be called first
+void fs_closeCache()
+{
+    //Stop reading ahead first, letting any reads in progress finish
+    std::unique_lock<std::mutex> guard(cacheLock);
+    prefetchStopping = 1;
+    prefetchQueue.clear();
+    prefetchQueued.notify_all();
+    guard.unlock();
+    for(uint32_t a = 0; a < prefetchThreads.size(); a++)
+        prefetchThreads[a].join();
+    prefetchThreads.clear();
+
+    guard.lock();
+    prefetchStopping = 0;
+    for(uint32_t a = 0; a < cacheSlots.size(); a++)
+        delete[] cacheSlots[a].data;
+    cacheSlots.clear();
+    cacheIndex.clear();
+    dirtySlots.clear();
+    modifiedSlots.clear();
+    cacheDevice = NULL;
+    cacheGeneration++;
+}
+
+//Writes every dirty cluster back to the device. Returns 0 if any write back failed since the last flush
+uint8_t fs_flushCache()
+{
+    std::unique_lock<std::mutex> guard(cacheLock);
+    if(cacheDevice == NULL)
+        return 1;
+
+    //Take a copy of everything dirty and write the copies back as one batch in disk order, with the lock dropped. The slots
+    //stay pinned until the batch is done, so none can be evicted and read back in before their copy has reached the device
+    std::vector<uint32_t> dirty;
+    fs_getDirtySlots(&dirty);
+
+    std::vector<struct iovec> vectors;
+    std::vector<BlockRequest> requests;
+    std::vector<uint8_t> images(dirty.size() * CLUSTER_SIZE);
+    std::vector<uint32_t> clusters(dirty.size());
+    fs_buildCacheRequests(dirty, &vectors, &requests);
+    for(uint32_t a = 0; a < dirty.size(); a++)
+    {
+        CacheSlot *slot = &cacheSlots[dirty[a]];
+        fs_sealCluster(slot->clusterIndex, slot->data);
+        memcpy(&images[a * CLUSTER_SIZE], slot->data, CLUSTER_SIZE);
+        vectors[a].iov_base = &images[a * CLUSTER_SIZE];
+        clusters[a] = slot->clusterIndex;
+        slot->dirty = 0;
+        slot->modified = 0;
+        slot->pins++;
+    }
+
+    //The checksums of the clusters go in the same batch, so they can't be left behind if it doesn't get to sync
+    std::vector<uint32_t> tableClusters;
+    std::vector<uint8_t> tableImages;
+    fs_collectChecksumWrites(clusters, &tableClusters, &tableImages);
+    std::vector<struct iovec> tableVectors(tableClusters.size());
+    for(uint32_t a = 0; a < tableClusters.size(); a++)
+    {
+        tableVectors[a].iov_base = &tableImages[a * CLUSTER_SIZE];
+        tableVectors[a].iov_len = CLUSTER_SIZE;
+        BlockRequest request;
+        request.position = fs_getWritePosition(tableClusters[a]);
+        request.vectors = &tableVectors[a];
+        request.vectorCount = 1;
+        requests.push_back(request);
+    }
+    modifiedSlots.clear();
+    modifiedCount = 0;
+    cacheStats.writebacks += dirty.size();
+
+    BlockDevice *device = cacheDevice;
+    guard.unlock();
+    uint8_t written = requests.empty() || device->writeBatch(&requests[0], requests.size());
+    guard.lock();
+    //If the batch failed, what the slots hold is the only good copy
+    for(uint32_t a = 0; a < dirty.size(); a++)
+    {
+        cacheSlots[dirty[a]].pins--;
+        if(!written)
+            cacheSlots[dirty[a]].dirty = 1;
+    }
+    if(!written)
+    {
+        fs_restoreChecksumWrites(tableClusters);
+        writeFailed = 1;
+    }
+
+    uint8_t success = !writeFailed;
+    writeFailed = 0;
+    return success;
+}
+
+//Sets the most memory the cache may use for cluster data, which applies from the next mount
+void fs_setCacheBudget(uint64_t bytes)
+{
+    cacheBudget = bytes;
+}
+
+//Returns the cache's counters
+BlockCacheStats fs_getCacheStats()
+{
+    std::lock_guard<std::mutex> guard(cacheLock);
+    BlockCacheStats stats = cacheStats;
+    stats.capacity = cacheCapacity;
+    stats.resident = cacheSlots.size();
+    return stats;
+}
+
+//Copies bytes out of the cache, which may cross clusters
+void fs_cacheRead(uint64_t writePos, uint8_t *data, uint64_t length)
+{
+    std::unique_lock<std::mutex> guard(cacheLock);
+    while(length > 0)
+    {
+        uint32_t slotIndex;
+        uint32_t offset = writePos & (CLUSTER_SIZE - 1);
+        uint32_t copyLength = CLUSTER_SIZE - offset < length ? CLUSTER_SIZE - offset : length;
+        CacheSlot *slot = fs_getCacheSlot(writePos >> superblock.clusterShift, 0, &slotIndex, guard);
+        if(slot == NULL)
+            memset(data, 0, copyLength);
+        else
+            memcpy(data, slot->data + offset, copyLength);
+        writePos += copyLength;
+        data += copyLength;
+        length -= copyLength;
+    }
+}
+
+//Copies bytes into the cache, which may cross clusters
+void fs_cacheWrite(uint64_t writePos, const uint8_t *data, uint64_t length)
+{
+    std::unique_lock<std::mutex> guard(cacheLock);
+    while(length > 0)
+    {
+        uint32_t slotIndex;
+        uint32_t offset = writePos & (CLUSTER_SIZE - 1);
+        uint32_t copyLength = CLUSTER_SIZE - offset < length ? CLUSTER_SIZE - offset : length;
+        CacheSlot *slot = fs_getCacheSlot(writePos >> superblock.clusterShift, 1, &slotIndex, guard);
+        if(slot != NULL)
+        {
+            memcpy(slot->data + offset, data, copyLength);
+            fs_modifySlot(slot);
+        }
+        writePos += copyLength;
+        data += copyLength;
+        length -= copyLength;
+    }
+}
+
+//Moves bytes within a single cluster, the source and destination may overlap
+void fs_cacheMove(uint64_t destination, uint64_t source, uint64_t length)
+{
+    std::unique_lock<std::mutex> guard(cacheLock);
+    uint32_t slotIndex;
+    CacheSlot *slot = fs_getCacheSlot(destination >> superblock.clusterShift, 1, &slotIndex, guard);
+    if(slot == NULL)
+        return;
+    memmove(slot->data + (destination & (CLUSTER_SIZE - 1)), slot->data + (source & (CLUSTER_SIZE - 1)), length);
+    fs_modifySlot(slot);
+}
+
+//Returns a read only pointer into the cache, valid to the end of its cluster until this thread takes another BLOCK_CACHE_PINS pointers
+const uint8_t *fs_cachePointer(uint64_t writePos)
+{
+    std::unique_lock<std::mutex> guard(cacheLock);
+    if(pinRing.generation != cacheGeneration)
+    {
+        memset(&pinRing, 0, sizeof(pinRing));
+        pinRing.generation = cacheGeneration;
+    }
+
+    //Release the oldest pointer this thread holds to make room
+    if(pinRing.slots[pinRing.next] != 0)
+        cacheSlots[pinRing.slots[pinRing.next] - 1].pins--;
+    pinRing.slots[pinRing.next] = 0;
+
+    uint32_t slotIndex;
+    CacheSlot *slot = fs_getCacheSlot(writePos >> superblock.clusterShift, 0, &slotIndex, guard);
+    if(slot == NULL)
+        return &zeroCluster[writePos & (CLUSTER_SIZE - 1)];
+    slot->pins++;
+    pinRing.slots[pinRing.next] = slotIndex + 1;
+    pinRing.next = (pinRing.next + 1) % BLOCK_CACHE_PINS;
+    return slot->data + (writePos & (CLUSTER_SIZE - 1));
+}
+
+//Reads in count clusters of the chain starting at clusterIndex. The chain is followed through whatever is already cached,
+//and where it reaches a cluster which isn't, the clusters after it are read in as one batch up to the next one which is, as
+//chains are mostly allocated in runs. If the guess was wrong, the chain is picked up again from where it really goes. The
+//cache lock is held by guard, and is dropped while reading
+static void fs_prefetchChain(uint32_t clusterIndex, uint32_t count, std::unique_lock<std::mutex> &guard)
+{
+    std::vector<uint32_t> loading;
+    while(count > 0 && clusterIndex >= superblock.firstDataCluster && clusterIndex < CLUSTER_COUNT && !prefetchStopping)
+    {
+        std::unordered_map<uint32_t, uint32_t>::iterator found = cacheIndex.find(clusterIndex);
+        if(found != cacheIndex.end())
+        {
+            CacheSlot *slot = &cacheSlots[found->second];
+            if(slot->loading)
+            {
+                slotsLoaded.wait(guard);
+                continue;
+            }
+            clusterIndex = intConcatL(slot->data[4], slot->data[5], slot->data[6], slot->data[7]);
+            count--;
+            continue;
+        }
+
+        loading.clear();
+        uint32_t end = count < CLUSTER_COUNT - clusterIndex ? clusterIndex + count : CLUSTER_COUNT;
+        for(uint32_t cluster = clusterIndex; cluster < end && cacheIndex.find(cluster) == cacheIndex.end(); cluster++)
+            loading.push_back(fs_claimLoadingSlot(cluster));
+        cacheStats.prefetched += loading.size();
+
+        //Whoever wants a cluster which can't be read in will find out when they read it themselves
+        if(!fs_loadSlots(loading, guard) && cacheIndex.find(clusterIndex) == cacheIndex.end())
+            return;
+    }
+}
+
+//Thread body reading ahead for whatever is queued, until the cache is closed
+static void fs_prefetchThread()
+{
+    std::unique_lock<std::mutex> guard(cacheLock);
+    while(true)
+    {
+        prefetchQueued.wait(guard, [] { return prefetchStopping || !prefetchQueue.empty(); });
+        if(prefetchStopping)
+            return;
+        PrefetchRequest request = prefetchQueue.front();
+        prefetchQueue.pop_front();
+        fs_prefetchChain(request.clusterIndex, request.count, guard);
+    }
+}
+
+//Asks for count clusters of the chain starting at clusterIndex to be read in the background, without waiting for them.
+//At most a quarter of the cache is read ahead at once, so reading ahead can't push out everything else, and if too much is
+//already queued the request is dropped. Returns the number of clusters which will be read ahead
+uint32_t fs_cachePrefetch(uint32_t clusterIndex, uint32_t count)
+{
+    std::lock_guard<std::mutex> guard(cacheLock);
+    if(cacheDevice == NULL || clusterIndex >= CLUSTER_COUNT || prefetchQueue.size() >= BLOCK_CACHE_PREFETCH_QUEUE)
+        return 0;
+    PrefetchRequest request;
+    request.clusterIndex = clusterIndex;
+    request.count = count < cacheCapacity / 4 ? count : cacheCapacity / 4;
+    prefetchQueue.push_back(request);
+    prefetchQueued.notify_one();
+    return request.count;
+}
+
+//Hands the journal the clusters changed since its last copy, sealing each and marking the copy as belonging to transaction sequence
+void fs_collectCacheChanges(uint64_t sequence, std::vector<uint32_t> *clusters, std::vector<uint8_t> *images)
+{
+    std::lock_guard<std::mutex> guard(cacheLock);
+    std::vector<uint32_t> modified;
+    for(uint32_t a = 0; a < modifiedSlots.size(); a++)
+        if(cacheSlots[modifiedSlots[a]].modified)
+            modified.push_back(modifiedSlots[a]);
+    modifiedSlots.clear();
+    std::sort(modified.begin(), modified.end(), fs_compareSlotClusters);
+    for(uint32_t a = 0; a < modified.size(); a++)
+    {
+        //A slot which was evicted and changed again is listed twice
+        CacheSlot *slot = &cacheSlots[modified[a]];
+        if(!slot->modified)
+            continue;
+        fs_sealCluster(slot->clusterIndex, slot->data);
+        clusters->push_back(slot->clusterIndex);
+        images->insert(images->end(), slot->data, slot->data + CLUSTER_SIZE);
+        slot->modified = 0;
+        slot->sequence = sequence;
+    }
+    __atomic_store_n(&modifiedCount, 0, __ATOMIC_RELAXED);
+}
+
+//Marks clusters the journal has written back in place, as of the transactions before sequence, as clean unless they've changed since
+void fs_finishCacheCheckpoint(uint64_t sequence, const std::vector<uint32_t> &clusters)
+{
+    std::lock_guard<std::mutex> guard(cacheLock);
+    for(uint32_t a = 0; a < clusters.size(); a++)
+    {
+        std::unordered_map<uint32_t, uint32_t>::iterator found = cacheIndex.find(clusters[a]);
+        if(found == cacheIndex.end())
+            continue;
+        CacheSlot *slot = &cacheSlots[found->second];
+        if(slot->dirty && !slot->modified && slot->sequence < sequence)
+        {
+            slot->dirty = 0;
+            cacheStats.writebacks++;
+        }
+    }
+}
+
+//Returns 1 if the calling thread has accessed a cluster which couldn't be read in or failed to verify since it last called
+//this, clearing it
+uint8_t fs_takeCacheError()
+{
+    uint8_t error = cacheError;
+    cacheError = 0;
+    return error;
+}
+
+//Returns the number of cached clusters changed since the journal last took a copy of them
+uint32_t fs_getCacheModifiedCount()
+{
+    return __atomic_load_n(&modifiedCount, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,527 @@
+#include "blockdevice.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_QUEUE_DEPTH 64 //Most transfers the io_uring device keeps in flight at once
+
+//Reads each request in turn, a buffer at a time
+uint8_t BlockDevice::readBatch(BlockRequest *requests, uint32_t count)
+{
+    uint8_t success = 1;
+    for(uint32_t a = 0; a < count; a++)
+    {
+        uint64_t position = requests[a].position;
+        for(uint32_t b = 0; b < requests[a].vectorCount; b++)
+        {
+            success &= read(position, (uint8_t*)requests[a].vectors[b].iov_base, requests[a].vectors[b].iov_len);
+            position += requests[a].vectors[b].iov_len;
+        }
+    }
+    return success;
+}
+
+//Writes each request in turn, a buffer at a time
+uint8_t BlockDevice::writeBatch(BlockRequest *requests, uint32_t count)
+{
+    uint8_t success = 1;
+    for(uint32_t a = 0; a < count; a++)
+    {
+        uint64_t position = requests[a].position;
+        for(uint32_t b = 0; b < requests[a].vectorCount; b++)
+        {
+            success &= write(position, (const uint8_t*)requests[a].vectors[b].iov_base, requests[a].vectors[b].iov_len);
+            position += requests[a].vectors[b].iov_len;
+        }
+    }
+    return success;
+}
+
+//Shared behaviour for devices which are entirely mapped into memory
+class MappedBlockDevice : public BlockDevice
+{
+public:
+    uint64_t getSize()
+    {
+        return size;
+    }
+
+    uint8_t *getMapping()
+    {
+        return mapping;
+    }
+
+    uint8_t read(uint64_t position, uint8_t *buffer, uint64_t length)
+    {
+        if(position + length > size)
+            return 0;
+        memcpy(buffer, mapping + position, length);
+        return 1;
+    }
+
+    uint8_t write(uint64_t position, const uint8_t *buffer, uint64_t length)
+    {
+        if(position + length > size)
+            return 0;
+        memcpy(mapping + position, buffer, length);
+        return 1;
+    }
+
+protected:
+    uint8_t *mapping = NULL;
+    uint64_t size = 0;
+};
+
+//Anonymous memory, which the kernel zero fills one page at a time as it's first touched
+class RamBlockDevice : public MappedBlockDevice
+{
+public:
+    uint8_t open(uint64_t deviceSize)
+    {
+        void *address = mmap(NULL, deviceSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(address == MAP_FAILED)
+            return 0;
+        mapping = (uint8_t*)address;
+        size = deviceSize;
+        return 1;
+    }
+
+    ~RamBlockDevice()
+    {
+        if(mapping != NULL)
+            munmap(mapping, size);
+    }
+
+    uint8_t sync()
+    {
+        return 1;
+    }
+};
+
+//A disk image file mapped in place. Pages are read in lazily as they're touched and written back by the kernel
+class MmapBlockDevice : public MappedBlockDevice
+{
+public:
+    uint8_t open(const char *path, uint64_t minimumSize)
+    {
+        fd = ::open(path, minimumSize != 0 ? O_RDWR | O_CREAT : O_RDWR, 0644);
+        if(fd < 0)
+            return 0;
+
+        //Images are written out without their unused tail, so extend the file back to full size. The new space reads as zeros without taking up any disk space
+        struct stat info;
+        if(fstat(fd, &info) != 0)
+            return 0;
+        size = info.st_size;
+        if(size < minimumSize)
+        {
+            if(ftruncate(fd, minimumSize) != 0)
+                return 0;
+            size = minimumSize;
+        }
+
+        void *address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(address == MAP_FAILED)
+            return 0;
+        mapping = (uint8_t*)address;
+        return 1;
+    }
+
+    ~MmapBlockDevice()
+    {
+        if(mapping != NULL)
+            munmap(mapping, size);
+        if(fd >= 0)
+            close(fd);
+    }
+
+    uint8_t sync()
+    {
+        return msync(mapping, size, MS_SYNC) == 0;
+    }
+
+private:
+    int fd = -1;
+};
+
+//A disk image file accessed with pread and pwrite, so only what's cached is held in memory. Filesystems on it go through the block cache
+class FileBlockDevice : public BlockDevice
+{
+public:
+    uint8_t open(const char *path, uint64_t minimumSize)
+    {
+        fd = ::open(path, minimumSize != 0 ? O_RDWR | O_CREAT : O_RDWR, 0644);
+        if(fd < 0)
+            return 0;
+
+        //As with mapped images, grow the file back to full size without allocating the new space
+        struct stat info;
+        if(fstat(fd, &info) != 0)
+            return 0;
+        size = info.st_size;
+        if(size < minimumSize)
+        {
+            if(ftruncate(fd, minimumSize) != 0)
+                return 0;
+            size = minimumSize;
+        }
+        return 1;
+    }
+
+    ~FileBlockDevice()
+    {
+        if(fd >= 0)
+            close(fd);
+    }
+
+    uint64_t getSize()
+    {
+        return size;
+    }
+
+    uint8_t *getMapping()
+    {
+        return NULL;
+    }
+
+    uint8_t read(uint64_t position, uint8_t *buffer, uint64_t length)
+    {
+        if(position + length > size)
+            return 0;
+        while(length > 0)
+        {
+            ssize_t result = pread(fd, buffer, length, position);
+            if(result < 0 && errno == EINTR)
+                continue;
+            if(result < 0)
+                return 0;
+
+            //Reading past the end of a file which was shrunk underneath us gives zeros, like the sparse tail
+            if(result == 0)
+            {
+                memset(buffer, 0, length);
+                return 1;
+            }
+            buffer += result;
+            position += result;
+            length -= result;
+        }
+        return 1;
+    }
+
+    uint8_t write(uint64_t position, const uint8_t *buffer, uint64_t length)
+    {
+        if(position + length > size)
+            return 0;
+        while(length > 0)
+        {
+            ssize_t result = pwrite(fd, buffer, length, position);
+            if(result < 0 && errno == EINTR)
+                continue;
+            if(result <= 0)
+                return 0;
+            buffer += result;
+            position += result;
+            length -= result;
+        }
+        return 1;
+    }
+
+    //Does each request with a single system call
+    uint8_t readBatch(BlockRequest *requests, uint32_t count)
+    {
+        uint8_t success = 1;
+        for(uint32_t a = 0; a < count; a++)
+            success &= transfer(&requests[a], 0);
+        return success;
+    }
+
+    uint8_t writeBatch(BlockRequest *requests, uint32_t count)
+    {
+        uint8_t success = 1;
+        for(uint32_t a = 0; a < count; a++)
+            success &= transfer(&requests[a], 1);
+        return success;
+    }
+
+    uint8_t sync()
+    {
+        return fdatasync(fd) == 0;
+    }
+
+protected:
+    //Returns 1 if a request lies entirely within the device
+    uint8_t inBounds(BlockRequest *request)
+    {
+        uint64_t length = 0;
+        for(uint32_t a = 0; a < request->vectorCount; a++)
+            length += request->vectors[a].iov_len;
+        return request->position + length <= size;
+    }
+
+    //Does a whole request with preadv or pwritev, which may stop short
+    uint8_t transfer(BlockRequest *request, uint8_t writing)
+    {
+        if(!inBounds(request))
+            return 0;
+        ssize_t result;
+        do
+        {
+            if(writing)
+                result = pwritev(fd, request->vectors, request->vectorCount, request->position);
+            else
+                result = preadv(fd, request->vectors, request->vectorCount, request->position);
+        } while(result < 0 && errno == EINTR);
+        return finishRequest(request, result < 0 ? 0 : result, writing);
+    }
+
+    //Completes whatever is left of a request after the first done bytes were transferred, a buffer at a time
+    uint8_t finishRequest(BlockRequest *request, uint64_t done, uint8_t writing)
+    {
+        uint64_t position = request->position;
+        for(uint32_t a = 0; a < request->vectorCount; a++)
+        {
+            uint8_t *buffer = (uint8_t*)request->vectors[a].iov_base;
+            uint64_t length = request->vectors[a].iov_len;
+            if(done >= length)
+            {
+                done -= length;
+                position += length;
+                continue;
+            }
+            if(!(writing ? write(position + done, buffer + done, length - done) : read(position + done, buffer + done, length - done)))
+                return 0;
+            position += length;
+            done = 0;
+        }
+        return 1;
+    }
+
+    int fd = -1;
+    uint64_t size = 0;
+};
+
+//A disk image file accessed through io_uring, set up with raw system calls. A batch is submitted as a queue of transfers
+//which the kernel works on in parallel, rather than one blocking call at a time. Single reads and writes still use the
+//plain file device, as there's nothing to overlap them with. Batches from different threads take turns on the one ring
+class UringBlockDevice : public FileBlockDevice
+{
+public:
+    uint8_t open(const char *path, uint64_t minimumSize)
+    {
+        if(!FileBlockDevice::open(path, minimumSize))
+            return 0;
+
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &params);
+        if(ringFd < 0)
+            return 0;
+
+        //Map the submission and completion rings and the array of submission entries
+        submissionRingSize = params.sq_off.array + (params.sq_entries * sizeof(uint32_t));
+        completionRingSize = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+        entryCount = params.sq_entries;
+        submissionRing = (uint8_t*)mmap(NULL, submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        completionRing = (uint8_t*)mmap(NULL, completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        entries = (struct io_uring_sqe*)mmap(NULL, entryCount * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if(submissionRing == MAP_FAILED || completionRing == MAP_FAILED || entries == MAP_FAILED)
+            return 0;
+
+        submissionTail = (uint32_t*)(submissionRing + params.sq_off.tail);
+        submissionMask = *(uint32_t*)(submissionRing + params.sq_off.ring_mask);
+        submissionArray = (uint32_t*)(submissionRing + params.sq_off.array);
+        completionHead = (uint32_t*)(completionRing + params.cq_off.head);
+        completionTail = (uint32_t*)(completionRing + params.cq_off.tail);
+        completionMask = *(uint32_t*)(completionRing + params.cq_off.ring_mask);
+        completions = (struct io_uring_cqe*)(completionRing + params.cq_off.cqes);
+        return 1;
+    }
+
+    ~UringBlockDevice()
+    {
+        if(entries != MAP_FAILED)
+            munmap(entries, entryCount * sizeof(struct io_uring_sqe));
+        if(completionRing != MAP_FAILED)
+            munmap(completionRing, completionRingSize);
+        if(submissionRing != MAP_FAILED)
+            munmap(submissionRing, submissionRingSize);
+        if(ringFd >= 0)
+            close(ringFd);
+    }
+
+    uint8_t readBatch(BlockRequest *requests, uint32_t count)
+    {
+        return submitBatch(requests, count, 0);
+    }
+
+    uint8_t writeBatch(BlockRequest *requests, uint32_t count)
+    {
+        return submitBatch(requests, count, 1);
+    }
+
+private:
+    //Keeps up to URING_QUEUE_DEPTH transfers in flight until the whole batch is done. Transfers which fail or stop short
+    //are finished off synchronously, so the batch only fails if the device really can't do them
+    uint8_t submitBatch(BlockRequest *requests, uint32_t count, uint8_t writing)
+    {
+        for(uint32_t a = 0; a < count; a++)
+            if(!inBounds(&requests[a]))
+                return 0;
+
+        std::lock_guard<std::mutex> guard(ringLock);
+        uint8_t success = 1;
+        uint32_t queued = 0;
+        uint32_t unsubmitted = 0;
+        uint32_t inFlight = 0;
+        uint32_t completed = 0;
+        while(completed < count)
+        {
+            //Top up the submission queue. The kernel takes every entry during io_uring_enter, so the queue is never full
+            uint32_t tail = *submissionTail;
+            while(queued < count && inFlight < URING_QUEUE_DEPTH)
+            {
+                uint32_t index = tail & submissionMask;
+                struct io_uring_sqe *entry = &entries[index];
+                memset(entry, 0, sizeof(*entry));
+                entry->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+                entry->fd = fd;
+                entry->addr = (uint64_t)requests[queued].vectors;
+                entry->len = requests[queued].vectorCount;
+                entry->off = requests[queued].position;
+                entry->user_data = queued;
+                submissionArray[index] = index;
+                tail++;
+                queued++;
+                unsubmitted++;
+                inFlight++;
+            }
+            __atomic_store_n(submissionTail, tail, __ATOMIC_RELEASE);
+
+            //Hand over the new entries and wait for at least one transfer to finish
+            int result = syscall(__NR_io_uring_enter, ringFd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if(result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                return abandonBatch(requests, count, queued, unsubmitted, inFlight, writing) && success;
+            if(result > 0)
+                unsubmitted -= result;
+
+            uint32_t reaped = reapCompletions(requests, writing, &success);
+            inFlight -= reaped;
+            completed += reaped;
+        }
+        return success;
+    }
+
+    //Collects every transfer which has finished, completing any which stopped short. Returns the number collected
+    uint32_t reapCompletions(BlockRequest *requests, uint8_t writing, uint8_t *success)
+    {
+        uint32_t reaped = 0;
+        uint32_t head = *completionHead;
+        while(head != __atomic_load_n(completionTail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *completion = &completions[head & completionMask];
+            *success &= finishRequest(&requests[completion->user_data], completion->res < 0 ? 0 : completion->res, writing);
+            head++;
+            reaped++;
+        }
+        __atomic_store_n(completionHead, head, __ATOMIC_RELEASE);
+        return reaped;
+    }
+
+    //Gives up on the ring part way through a batch after io_uring_enter fails. Entries the kernel hasn't taken are withdrawn,
+    //and everything it has taken is waited for, as it's still reading or writing the caller's buffers and its completions
+    //would otherwise be picked up by the next batch. Whatever wasn't done through the ring is then done synchronously.
+    //Returns 0 if any of it failed
+    uint8_t abandonBatch(BlockRequest *requests, uint32_t count, uint32_t queued, uint32_t unsubmitted, uint32_t inFlight, uint8_t writing)
+    {
+        uint8_t success = 1;
+        __atomic_store_n(submissionTail, *submissionTail - unsubmitted, __ATOMIC_RELEASE);
+        inFlight -= unsubmitted;
+        while(inFlight > 0)
+        {
+            uint32_t reaped = reapCompletions(requests, writing, &success);
+            inFlight -= reaped;
+            if(reaped == 0 && syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+                sched_yield();
+        }
+
+        for(uint32_t a = queued - unsubmitted; a < count; a++)
+            success &= transfer(&requests[a], writing);
+        return success;
+    }
+
+    std::mutex ringLock;
+    int ringFd = -1;
+    uint8_t *submissionRing = (uint8_t*)MAP_FAILED;
+    uint8_t *completionRing = (uint8_t*)MAP_FAILED;
+    struct io_uring_sqe *entries = (struct io_uring_sqe*)MAP_FAILED;
+    uint64_t submissionRingSize = 0;
+    uint64_t completionRingSize = 0;
+    uint32_t entryCount = 0;
+    uint32_t *submissionTail = NULL;
+    uint32_t submissionMask = 0;
+    uint32_t *submissionArray = NULL;
+    uint32_t *completionHead = NULL;
+    uint32_t *completionTail = NULL;
+    uint32_t completionMask = 0;
+    struct io_uring_cqe *completions = NULL;
+};
+
+//Creates a device held entirely in memory. Returns NULL on failure
+BlockDevice *fs_createRamDevice(uint64_t size)
+{
+    RamBlockDevice *device = new RamBlockDevice;
+    if(!device->open(size))
+    {
+        delete device;
+        return NULL;
+    }
+    return device;
+}
+
+//Maps an image file in place as a device, growing it to minimumSize if needed. The file is only created if minimumSize isn't 0,
+//so an image being mounted has to exist already. Returns NULL on failure
+BlockDevice *fs_openMmapDevice(const char *path, uint64_t minimumSize)
+{
+    MmapBlockDevice *device = new MmapBlockDevice;
+    if(!device->open(path, minimumSize))
+    {
+        delete device;
+        return NULL;
+    }
+    return device;
+}
+
+//Opens an image file as a device accessed through reads and writes, growing it to minimumSize if needed. The file is only
+//created if minimumSize isn't 0, so an image being mounted has to exist already. Returns NULL on failure
+BlockDevice *fs_openFileDevice(const char *path, uint64_t minimumSize)
+{
+    FileBlockDevice *device = new FileBlockDevice;
+    if(!device->open(path, minimumSize))
+    {
+        delete device;
+        return NULL;
+    }
+    return device;
+}
+
+//Opens an image file as a device accessed through io_uring, growing it to minimumSize if needed. The file is only created
+//if minimumSize isn't 0, so an image being mounted has to exist already. Returns NULL on failure, including when the kernel
+//doesn't support io_uring
+BlockDevice *fs_openUringDevice(const char *path, uint64_t minimumSize)
+{
+    UringBlockDevice *device = new UringBlockDevice;
+    if(!device->open(path, minimumSize))
+    {
+        delete device;
+        return NULL;
+    }
+    return device;
+}
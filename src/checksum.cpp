@@ -0,0 +1,610 @@
+#include "filesystem.h"
+#include <string.h>
+#include <thread>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+//Cluster checksums. On disks formatted with FEATURE_CHECKSUMS, a table after the allocation table holds a CRC32C of every
+//cluster's contents. Checksums describe clusters as they are on the device, so they're brought up to date as clusters are
+//written out: the block cache seals each cluster as it writes it back and verifies each cluster it reads in, while on a mapped
+//disk, where the device can't be watched, changed clusters are noted as they're written and sealed on the next sync. A checksum
+//of 0 means the cluster hasn't been sealed since it was last freed, so its contents aren't checked. A cluster which fails to
+//verify can't be read: the block cache keeps it but reads of it stop short there, until it's written over and sealed again,
+//and the failure is counted so it can be reported and the disk scrubbed. With a journal, the table's changes are committed
+//along with the clusters they describe. Without one, the block cache writes the changed parts of the table in the same batch
+//as the clusters it writes back, so a crash doesn't leave written clusters behind with stale checksums.
+#define CRC32C_POLYNOMIAL 0x82F63B78 //Castagnoli polynomial, bit reversed
+#define SCRUB_CHUNK_SIZE (1 << 20) //Bytes of clusters each scrubbing thread checks at a time
+
+typedef uint32_t (*CrcFunction)(uint32_t crc, const uint8_t *data, uint64_t length);
+
+//The checksum table is updated with atomic stores, as clusters are freed without holding the block cache lock. It's used in
+//place on a mapped device, otherwise a copy is loaded at mount and its changed clusters written back on sync
+static uint32_t *checksumTable = NULL;
+static std::vector<uint32_t> checksumTableCopy;
+static std::vector<uint8_t> checksumTableDirty; //One flag per cluster of the copied table, set when it's changed
+static std::vector<uint64_t> changedClusters; //One bit per cluster of a mapped disk, set when it's written to
+static BlockDevice *checksumDevice = NULL;
+static uint32_t checksumFailures = 0; //Clusters read in which didn't match their checksum since the disk was mounted
+static uint32_t crcTable[8][256];
+
+//Fills in the tables for the software CRC, which takes eight bytes at a time
+static void fs_buildCrcTable()
+{
+    for(uint32_t a = 0; a < 256; a++)
+    {
+        uint32_t crc = a;
+        for(uint32_t bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+        crcTable[0][a] = crc;
+    }
+    for(uint32_t a = 0; a < 256; a++)
+        for(uint32_t slice = 1; slice < 8; slice++)
+            crcTable[slice][a] = (crcTable[slice - 1][a] >> 8) ^ crcTable[0][crcTable[slice - 1][a] & 0xFF];
+}
+
+//Updates a CRC32C with a table lookup for each byte of an 8 byte word, for processors without a CRC instruction
+static uint32_t fs_crc32cSoftware(uint32_t crc, const uint8_t *data, uint64_t length)
+{
+    while(length >= 8)
+    {
+        uint32_t low = crc ^ intConcatL(data[0], data[1], data[2], data[3]);
+        uint32_t high = intConcatL(data[4], data[5], data[6], data[7]);
+        crc = crcTable[7][low & 0xFF] ^ crcTable[6][(low >> 8) & 0xFF] ^ crcTable[5][(low >> 16) & 0xFF] ^ crcTable[4][low >> 24] ^
+              crcTable[3][high & 0xFF] ^ crcTable[2][(high >> 8) & 0xFF] ^ crcTable[1][(high >> 16) & 0xFF] ^ crcTable[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while(length-- > 0)
+        crc = (crc >> 8) ^ crcTable[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+//Updates a CRC32C with the SSE4.2 crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2"))) static uint32_t fs_crc32cHardware(uint32_t crc, const uint8_t *data, uint64_t length)
+{
+    uint64_t wideCrc = crc;
+    while(length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        wideCrc = _mm_crc32_u64(wideCrc, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = wideCrc;
+    while(length-- > 0)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+//Picks the fastest CRC the processor supports
+static CrcFunction fs_chooseCrc()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2"))
+        return fs_crc32cHardware;
+#endif
+    fs_buildCrcTable();
+    return fs_crc32cSoftware;
+}
+
+static CrcFunction crcUpdate = fs_chooseCrc();
+
+//Returns the CRC32C of a block of bytes. A running CRC can be continued by passing in the CRC of everything before, otherwise pass 0
+uint32_t fs_crc32c(uint32_t crc, const uint8_t *data, uint64_t length)
+{
+    return ~crcUpdate(~crc, data, length);
+}
+
+//Converts a checksum between the little endian order it's stored in and the host's order
+static inline uint32_t fs_toChecksumOrder(uint32_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+//Returns the checksum recorded for a cluster, 0 if it has none
+static inline uint32_t fs_getChecksum(uint32_t clusterIndex)
+{
+    return fs_toChecksumOrder(__atomic_load_n(&checksumTable[clusterIndex], __ATOMIC_RELAXED));
+}
+
+//Records the checksum of a cluster, noting that the copied table needs writing back
+static inline void fs_setChecksum(uint32_t clusterIndex, uint32_t checksum)
+{
+    __atomic_store_n(&checksumTable[clusterIndex], fs_toChecksumOrder(checksum), __ATOMIC_RELAXED);
+    if(disk == NULL)
+        __atomic_store_n(&checksumTableDirty[((uint64_t)clusterIndex * 4) >> superblock.clusterShift], 1, __ATOMIC_RELAXED);
+}
+
+//Gets the checksum table of a newly attached device ready, clearing it if the device is about to be formatted.
+//Must be called once the device's mapping, if any, is in place. Returns 0 if the table couldn't be read
+uint8_t fs_openChecksums(BlockDevice *device, uint8_t loadTable)
+{
+    checksumDevice = device;
+    checksumFailures = 0;
+    checksumTable = NULL;
+    checksumTableCopy.clear();
+    checksumTableDirty.clear();
+    changedClusters.clear();
+    if(!(superblock.features & FEATURE_CHECKSUMS))
+        return 1;
+
+    uint64_t tableSize = fs_getWritePosition(superblock.checksumTableLength);
+    if(disk != NULL)
+    {
+        checksumTable = (uint32_t*)&disk[fs_getWritePosition(superblock.checksumTableCluster)];
+        if(!loadTable)
+            memset(checksumTable, 0, tableSize);
+        changedClusters.assign(superblock.allocationWordCount, 0);
+    }
+    else
+    {
+        checksumTableCopy.assign(tableSize / 4, 0);
+        checksumTableDirty.assign(superblock.checksumTableLength, !loadTable);
+        checksumTable = &checksumTableCopy[0];
+        if(loadTable && !device->read(fs_getWritePosition(superblock.checksumTableCluster), (uint8_t*)checksumTable, tableSize))
+            return 0;
+    }
+    return 1;
+}
+
+//Notes that clusters firstCluster to lastCluster of a mapped disk have been written to
+void fs_markChecksumsDirty(uint32_t firstCluster, uint32_t lastCluster)
+{
+    for(uint32_t cluster = firstCluster; cluster <= lastCluster; cluster++)
+    {
+        //Most writes land on a cluster which has already been noted, so check before paying for the atomic update
+        uint64_t *word = &changedClusters[cluster / 64];
+        uint64_t bit = 1ULL << (cluster % 64);
+        if(!(__atomic_load_n(word, __ATOMIC_SEQ_CST) & bit))
+            __atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST);
+    }
+}
+
+//Drops the checksums of freed clusters, the clusters in mask counting from firstCluster, as their contents no longer matter
+void fs_forgetChecksums(uint32_t firstCluster, uint64_t mask)
+{
+    while(mask != 0)
+    {
+        uint32_t cluster = firstCluster + __builtin_ctzll(mask);
+        mask &= mask - 1;
+        if(fs_getChecksum(cluster) != 0)
+            fs_setChecksum(cluster, 0);
+    }
+}
+
+//Records the checksum of a cluster's contents as they're written out to the device
+void fs_sealCluster(uint32_t clusterIndex, const uint8_t *data)
+{
+    if(!(superblock.features & FEATURE_CHECKSUMS) || clusterIndex < superblock.firstDataCluster)
+        return;
+
+    //Clusters are often written back unchanged since they were last sealed, which needn't touch the table
+    uint32_t checksum = fs_crc32c(0, data, CLUSTER_SIZE);
+    if(fs_getChecksum(clusterIndex) != checksum)
+        fs_setChecksum(clusterIndex, checksum);
+}
+
+//Checks a cluster's contents as they're read in from the device. Returns 0, and counts the failure, if they don't match its checksum
+uint8_t fs_verifyCluster(uint32_t clusterIndex, const uint8_t *data)
+{
+    if(!(superblock.features & FEATURE_CHECKSUMS) || clusterIndex < superblock.firstDataCluster)
+        return 1;
+    uint32_t expected = fs_getChecksum(clusterIndex);
+    if(expected == 0 || fs_crc32c(0, data, CLUSTER_SIZE) == expected)
+        return 1;
+    __atomic_fetch_add(&checksumFailures, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+//Returns the number of clusters read in since the disk was mounted which didn't match their checksums
+uint32_t fs_getChecksumFailures()
+{
+    return __atomic_load_n(&checksumFailures, __ATOMIC_RELAXED);
+}
+
+//Brings the checksum table up to date on the device. On a mapped disk every cluster written since the last sync is sealed,
+//while with the block cache the clusters were sealed as they were written back, so only the table needs writing. Returns 0 on failure
+uint8_t fs_syncChecksums()
+{
+    if(!(superblock.features & FEATURE_CHECKSUMS))
+        return 1;
+
+    if(disk != NULL)
+    {
+        //A cluster written to after its bit is cleared is noted again, so it's sealed on the next sync if not this one
+        for(uint32_t word = 0; word < changedClusters.size(); word++)
+        {
+            if(__atomic_load_n(&changedClusters[word], __ATOMIC_SEQ_CST) == 0)
+                continue;
+            uint64_t bits = __atomic_exchange_n(&changedClusters[word], 0, __ATOMIC_SEQ_CST);
+            while(bits != 0)
+            {
+                uint32_t cluster = (word * 64) + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if(cluster < CLUSTER_COUNT && fs_getClusterState(cluster) == CLUSTER_USED)
+                    fs_sealCluster(cluster, &disk[fs_getWritePosition(cluster)]);
+            }
+        }
+        return 1;
+    }
+
+    //Write the changed clusters of the copied table back as one batch
+    std::vector<struct iovec> vectors(checksumTableDirty.size());
+    std::vector<BlockRequest> requests;
+    for(uint32_t a = 0; a < checksumTableDirty.size(); a++)
+    {
+        if(!__atomic_exchange_n(&checksumTableDirty[a], 0, __ATOMIC_RELAXED))
+            continue;
+        vectors[a].iov_base = (uint8_t*)checksumTable + fs_getWritePosition(a);
+        vectors[a].iov_len = CLUSTER_SIZE;
+        BlockRequest request;
+        request.position = fs_getWritePosition(superblock.checksumTableCluster + a);
+        request.vectors = &vectors[a];
+        request.vectorCount = 1;
+        requests.push_back(request);
+    }
+    return requests.empty() || checksumDevice->writeBatch(&requests[0], requests.size());
+}
+
+//Takes cluster a of a copied checksum table for writing out if it's changed, adding it and a copy of it to clusters and images.
+//Clusters are sealed by whichever thread writes them back, so the entries are copied one at a time atomically
+static void fs_takeTableCluster(uint32_t a, std::vector<uint32_t> *clusters, std::vector<uint8_t> *images)
+{
+    if(!__atomic_exchange_n(&checksumTableDirty[a], 0, __ATOMIC_RELAXED))
+        return;
+    uint32_t *data = (uint32_t*)((uint8_t*)checksumTable + fs_getWritePosition(a));
+    clusters->push_back(superblock.checksumTableCluster + a);
+    uint64_t start = images->size();
+    images->resize(start + CLUSTER_SIZE);
+    for(uint32_t b = 0; b < CLUSTER_SIZE / 4; b++)
+    {
+        uint32_t entry = __atomic_load_n(&data[b], __ATOMIC_RELAXED);
+        memcpy(&(*images)[start + b * 4], &entry, 4);
+    }
+}
+
+//Hands the journal a copy of each changed cluster of a copied checksum table, as it becomes part of the transaction being committed
+void fs_collectChecksumChanges(std::vector<uint32_t> *clusters, std::vector<uint8_t> *images)
+{
+    for(uint32_t a = 0; a < checksumTableDirty.size(); a++)
+        fs_takeTableCluster(a, clusters, images);
+}
+
+//Hands the block cache a copy of each changed cluster of a copied checksum table holding the checksum of one of the sorted
+//clusters it's about to write back, to be written in the same batch. With the journal running the table is committed instead,
+//so nothing is handed over
+void fs_collectChecksumWrites(const std::vector<uint32_t> &written, std::vector<uint32_t> *clusters, std::vector<uint8_t> *images)
+{
+    if(!(superblock.features & FEATURE_CHECKSUMS) || disk != NULL || fs_isJournalActive())
+        return;
+    uint32_t previous = ~0U;
+    for(uint32_t a = 0; a < written.size(); a++)
+    {
+        if(written[a] < superblock.firstDataCluster)
+            continue;
+        uint32_t tableCluster = ((uint64_t)written[a] * 4) >> superblock.clusterShift;
+        if(tableCluster != previous)
+            fs_takeTableCluster(tableCluster, clusters, images);
+        previous = tableCluster;
+    }
+}
+
+//Notes that clusters of the checksum table handed out by fs_collectChecksumWrites didn't reach the device after all
+void fs_restoreChecksumWrites(const std::vector<uint32_t> &clusters)
+{
+    for(uint32_t a = 0; a < clusters.size(); a++)
+        __atomic_store_n(&checksumTableDirty[clusters[a] - superblock.checksumTableCluster], 1, __ATOMIC_RELAXED);
+}
+
+//Scrubbing. The tree is checked a level at a time, with the objects of each level shared out between the threads. Every cluster
+//reached is claimed in a bitmap, which catches chains running into each other or themselves. A mapped file's chain is its
+//first cluster followed by the clusters its map lists, and the map clusters are claimed along the way. Chains may only run
+//into each other at a shared cluster, where each arrival is counted instead and the first one claims it. Then the
+//threads take chunks of the disk in turn, comparing the claimed clusters against the allocation table, the arrivals at shared
+//clusters against their reference counts, and verifying the checksum of each cluster in use
+struct ScrubState
+{
+    std::vector<uint64_t> claimed; //One bit per cluster, set once a chain or index has reached it
+    std::vector<uint32_t> arrivals; //Chains which have reached each shared cluster, if the disk has FEATURE_CLONES
+    std::vector<uint64_t> visited; //One bit per cluster, set once an object starting there has been queued
+    std::vector<uint32_t> level; //Objects to check in the current level of the tree
+    uint32_t nextObject; //Next entry of level for a thread to take
+    uint64_t nextChunk; //First cluster of the next chunk for a thread to take
+};
+
+//Sets a bit in a bitmap shared between threads. Returns the bit's old value
+static inline uint8_t fs_testAndSetBit(std::vector<uint64_t> *bitmap, uint32_t index)
+{
+    uint64_t bit = 1ULL << (index % 64);
+    return (__atomic_fetch_or(&(*bitmap)[index / 64], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+//Claims a cluster for the chain being followed. Returns 0 if it's outside the data clusters or already claimed
+static uint8_t fs_claimScrubCluster(ScrubState *state, uint32_t clusterIndex, ScrubReport *report)
+{
+    if(clusterIndex < superblock.firstDataCluster || clusterIndex >= CLUSTER_COUNT)
+        return 0;
+    if(fs_testAndSetBit(&state->claimed, clusterIndex))
+    {
+        report->crossLinkedClusters++;
+        return 0;
+    }
+    return 1;
+}
+
+//Returns 1 if a cluster could hold the header of an object, so it's safe to work out where the object's data starts
+static uint8_t fs_isNodeHeaderSane(uint32_t objectIndex)
+{
+    if(objectIndex < superblock.firstDataCluster || objectIndex >= CLUSTER_COUNT)
+        return 0;
+    uint64_t headerPos = fs_getWritePosition(objectIndex);
+    uint16_t nameLength = fs_read16(headerPos + 13);
+    return (fs_read8(headerPos + 8) & NODE_TYPE_MASK) <= NODE_SYMLINK && nameLength != 0 && NODE_NAME_OFFSET + nameLength <= HEADER_SIZE;
+}
+
+//Checks the clusters of a directory's index. Returns 0 if it's damaged
+static uint8_t fs_scrubIndex(ScrubState *state, uint32_t directoryIndex, ScrubReport *report)
+{
+    uint32_t indexCluster = fs_getIndexCluster(directoryIndex);
+    if(indexCluster == 0)
+        return 1;
+
+    uint32_t tableLength;
+    std::vector<uint32_t> bucketHeads;
+    if(!fs_getIndexLayout(directoryIndex, &tableLength, &bucketHeads))
+        return 0;
+    uint8_t intact = 1;
+    for(uint32_t a = 0; a < tableLength; a++)
+        intact &= fs_claimScrubCluster(state, indexCluster + a, report);
+    for(uint32_t a = 0; a < bucketHeads.size(); a++)
+    {
+        for(uint32_t clusterIndex = bucketHeads[a]; clusterIndex != 0; clusterIndex = fs_read32(fs_getWritePosition(clusterIndex) + 4))
+        {
+            if(!fs_claimScrubCluster(state, clusterIndex, report))
+            {
+                intact = 0;
+                break;
+            }
+        }
+    }
+    return intact;
+}
+
+//Claims the clusters of a mapped file's map, checking each is full but the last and that the last is the one the file's header
+//points at, and adds the clusters listed in it onto clusters. Returns 0 if the map is damaged
+static uint8_t fs_scrubClusterMap(ScrubState *state, uint32_t objectIndex, std::vector<uint32_t> *clusters, ScrubReport *report)
+{
+    uint64_t headerPos = fs_getWritePosition(objectIndex);
+    uint32_t lastMap = 0;
+    uint8_t previousFull = 1;
+    for(uint32_t mapCluster = fs_read32(headerPos + 4); mapCluster != 0; mapCluster = fs_read32(fs_getWritePosition(mapCluster) + 4))
+    {
+        if(!fs_claimScrubCluster(state, mapCluster, report))
+            return 0;
+        uint64_t mapPos = fs_getWritePosition(mapCluster);
+        uint32_t mapLength = fs_read32(mapPos);
+        if(!previousFull || mapLength <= CLUSTER_HEADER_SIZE || mapLength > CLUSTER_SIZE || (mapLength - CLUSTER_HEADER_SIZE) % 4 != 0)
+            return 0;
+        for(uint32_t offset = CLUSTER_HEADER_SIZE; offset < mapLength; offset += 4)
+            clusters->push_back(fs_read32(mapPos + offset));
+        previousFull = mapLength == CLUSTER_SIZE;
+        lastMap = mapCluster;
+    }
+    return lastMap == fs_read32(headerPos + NODE_INDEX_OFFSET);
+}
+
+//Checks an entry of a directory, queueing the object it points to if it hasn't been reached before. Returns 0 if the entry is bad
+static uint8_t fs_scrubEntry(ScrubState *state, uint32_t directoryIndex, uint32_t child, std::vector<uint32_t> *children)
+{
+    if(!fs_isNodeHeaderSane(child))
+        return 0;
+
+    //A directory is only checked from the directory its parent entry points back to, as links to it elsewhere could form a cycle
+    uint64_t childPos = fs_getWritePosition(child);
+    if(fs_read8(childPos + 8) == NODE_DIRECTORY && fs_read32(childPos + fs_getHeaderSize(child)) != directoryIndex)
+        return 1;
+    if(!fs_testAndSetBit(&state->visited, child))
+        children->push_back(child);
+    return 1;
+}
+
+//Checks an object's chain against its header, and a directory's entries and index, adding any objects found to children
+static void fs_scrubObject(ScrubState *state, uint32_t objectIndex, std::vector<uint32_t> *children, ScrubReport *report)
+{
+    report->objects++;
+    uint64_t headerPos = fs_getWritePosition(objectIndex);
+    uint8_t type = fs_read8(headerPos + 8) & NODE_TYPE_MASK;
+    uint32_t headerSize = fs_getHeaderSize(objectIndex);
+    uint8_t broken = 0;
+
+    //Follow the chain, stopping wherever it goes wrong as nothing after that can be trusted. Every cluster of a file but
+    //the last is full, which handles rely on to find offsets
+    uint8_t entries[1024];
+    uint64_t dataLength = 0;
+    uint32_t lastCluster = 0;
+    uint32_t relativeIndex = 0;
+    uint8_t previousFull = 1;
+    uint8_t mapped = type == NODE_FILE && fs_isMapped(objectIndex);
+    std::vector<uint32_t> map;
+    uint32_t mapPosition = 0;
+    if(mapped && !fs_scrubClusterMap(state, objectIndex, &map, report))
+        broken = 1;
+    for(uint32_t clusterIndex = objectIndex; clusterIndex != 0 && !broken;
+        clusterIndex = mapped ? (mapPosition < map.size() ? map[mapPosition++] : 0) : fs_read32(fs_getWritePosition(lastCluster) + 4))
+    {
+        //Only maps can list shared clusters, each of which is claimed by the first chain to reach it, the rest counting their arrival
+        uint8_t inRange = clusterIndex >= superblock.firstDataCluster && clusterIndex < CLUSTER_COUNT;
+        uint8_t claiming = !mapped || !inRange || fs_getSharedReferences(clusterIndex) == 0 ||
+                           __atomic_fetch_add(&state->arrivals[clusterIndex], 1, __ATOMIC_RELAXED) == 0;
+        if(claiming && !fs_claimScrubCluster(state, clusterIndex, report))
+        {
+            broken = 1;
+            break;
+        }
+        uint32_t dataStart = clusterIndex == objectIndex ? headerSize : CLUSTER_HEADER_SIZE;
+        uint32_t clusterLength = fs_read32(fs_getWritePosition(clusterIndex));
+        if(clusterLength < dataStart || clusterLength > CLUSTER_SIZE || (type == NODE_FILE && !previousFull))
+        {
+            broken = 1;
+            break;
+        }
+        dataLength += clusterLength - dataStart;
+        previousFull = clusterLength == CLUSTER_SIZE;
+        lastCluster = clusterIndex;
+
+        //Check every entry but the parent, a chunk at a time
+        if(type != NODE_DIRECTORY)
+            continue;
+        if((clusterLength - dataStart) % DIRECTORY_ENTRY_SIZE != 0)
+            broken = 1;
+        uint32_t chunkLength;
+        for(uint32_t offset = dataStart; offset < clusterLength && !broken; offset += chunkLength)
+        {
+            chunkLength = clusterLength - offset < sizeof(entries) ? clusterLength - offset : sizeof(entries);
+            fs_readBytes(fs_getWritePosition(clusterIndex) + offset, entries, chunkLength);
+            for(uint32_t a = 0; a < chunkLength && !broken; a += DIRECTORY_ENTRY_SIZE, relativeIndex++)
+                if(relativeIndex != 0 && !fs_scrubEntry(state, objectIndex, intConcatL(entries[a], entries[a + 1], entries[a + 2], entries[a + 3]), children))
+                    broken = 1;
+        }
+    }
+
+    if(lastCluster != fs_getTailCluster(objectIndex) || dataLength != fs_read64(headerPos + NODE_SIZE_OFFSET))
+        broken = 1;
+    if(!broken && type == NODE_FILE && fs_isCompressed(objectIndex) && !fs_checkCompressedFile(objectIndex))
+        broken = 1;
+    if(type == NODE_DIRECTORY && !fs_scrubIndex(state, objectIndex, report))
+        broken = 1;
+    report->brokenObjects += broken;
+}
+
+//Thread body checking the objects of the current level until there are none left
+static void fs_scrubObjects(ScrubState *state, std::vector<uint32_t> *children, ScrubReport *report)
+{
+    uint32_t next;
+    while((next = __atomic_fetch_add(&state->nextObject, 1, __ATOMIC_RELAXED)) < state->level.size())
+        fs_scrubObject(state, state->level[next], children, report);
+}
+
+//Thread body comparing chunks of the disk against the allocation table and verifying their checksums until there are none left
+static void fs_scrubClusters(ScrubState *state, ScrubReport *report)
+{
+    uint32_t chunkClusters = SCRUB_CHUNK_SIZE >> superblock.clusterShift > 0 ? SCRUB_CHUNK_SIZE >> superblock.clusterShift : 1;
+    uint8_t checksums = (superblock.features & FEATURE_CHECKSUMS) != 0;
+    std::vector<uint8_t> buffer(checksums && disk == NULL ? fs_getWritePosition(chunkClusters) : 0);
+    uint64_t first;
+    while((first = __atomic_fetch_add(&state->nextChunk, chunkClusters, __ATOMIC_RELAXED)) < CLUSTER_COUNT)
+    {
+        uint32_t count = CLUSTER_COUNT - first < chunkClusters ? CLUSTER_COUNT - first : chunkClusters;
+
+        //Everything has been flushed, so without a mapping the chunk can be read straight from the device
+        const uint8_t *data = NULL;
+        if(checksums && disk != NULL)
+            data = &disk[fs_getWritePosition(first)];
+        else if(checksums && checksumDevice->read(fs_getWritePosition(first), &buffer[0], fs_getWritePosition(count)))
+            data = &buffer[0];
+
+        for(uint32_t a = 0; a < count; a++)
+        {
+            uint32_t clusterIndex = first + a;
+            uint8_t used = fs_getClusterState(clusterIndex) == CLUSTER_USED;
+            uint8_t claimed = (state->claimed[clusterIndex / 64] >> (clusterIndex % 64)) & 1;
+            if(used && !claimed)
+                report->leakedClusters++;
+            if(!used && claimed)
+                report->unallocatedClusters++;
+            uint32_t references = fs_getSharedReferences(clusterIndex);
+            if(references != 0 && (!used || state->arrivals[clusterIndex] != references + 1))
+                report->miscountedClusters++;
+            if(!used || !checksums || fs_getChecksum(clusterIndex) == 0)
+                continue;
+
+            report->clustersVerified++;
+            if(data == NULL || fs_crc32c(0, data + fs_getWritePosition(a), CLUSTER_SIZE) != fs_getChecksum(clusterIndex))
+                report->checksumErrors++;
+        }
+    }
+}
+
+//Adds one thread's findings onto the total
+static void fs_addScrubReport(ScrubReport *total, const ScrubReport *report)
+{
+    total->objects += report->objects;
+    total->clustersVerified += report->clustersVerified;
+    total->checksumErrors += report->checksumErrors;
+    total->brokenObjects += report->brokenObjects;
+    total->crossLinkedClusters += report->crossLinkedClusters;
+    total->unallocatedClusters += report->unallocatedClusters;
+    total->leakedClusters += report->leakedClusters;
+    total->miscountedClusters += report->miscountedClusters;
+}
+
+//Checks the whole disk for damage using threadCount threads: every object's chain and header, every directory's entries
+//and index, the allocation table against the clusters actually reached, and, if the disk has them, the reference count of
+//every shared cluster and the checksum of every cluster in use. Nothing is repaired. Mustn't overlap with anything else. Returns 1 if no problems were found
+uint8_t fs_scrub(uint32_t threadCount, ScrubReport *report)
+{
+    memset(report, 0, sizeof(ScrubReport));
+    if(threadCount == 0)
+        threadCount = 1;
+
+    //Checksums are only up to date after a sync, and a checkpoint also puts everything on the device where it can be read directly
+    fs_checkpoint();
+    report->expectedObjects = fs_statfs().objectCount;
+
+    ScrubState state;
+    state.claimed.assign(superblock.allocationWordCount, 0);
+    state.visited.assign(superblock.allocationWordCount, 0);
+    if(superblock.features & FEATURE_CLONES)
+        state.arrivals.assign(CLUSTER_COUNT, 0);
+    std::vector<ScrubReport> reports(threadCount);
+    std::vector<std::vector<uint32_t>> children(threadCount);
+    std::vector<std::thread> threads;
+    memset(&reports[0], 0, sizeof(ScrubReport) * threadCount);
+
+    //Check the tree a level at a time, starting from the root
+    if(fs_isNodeHeaderSane(superblock.rootDirectory) && fs_getNodeHeader(superblock.rootDirectory).type == NODE_DIRECTORY)
+    {
+        fs_testAndSetBit(&state.visited, superblock.rootDirectory);
+        state.level.push_back(superblock.rootDirectory);
+    }
+    else
+        report->brokenObjects++;
+    while(!state.level.empty())
+    {
+        state.nextObject = 0;
+        for(uint32_t a = 0; a < threadCount; a++)
+            threads.push_back(std::thread(fs_scrubObjects, &state, &children[a], &reports[a]));
+        for(uint32_t a = 0; a < threadCount; a++)
+            threads[a].join();
+        threads.clear();
+
+        state.level.clear();
+        for(uint32_t a = 0; a < threadCount; a++)
+        {
+            state.level.insert(state.level.end(), children[a].begin(), children[a].end());
+            children[a].clear();
+        }
+    }
+
+    //Then go over every data cluster
+    state.nextChunk = superblock.firstDataCluster;
+    for(uint32_t a = 0; a < threadCount; a++)
+        threads.push_back(std::thread(fs_scrubClusters, &state, &reports[a]));
+    for(uint32_t a = 0; a < threadCount; a++)
+    {
+        threads[a].join();
+        fs_addScrubReport(report, &reports[a]);
+    }
+
+    return report->checksumErrors == 0 && report->brokenObjects == 0 && report->crossLinkedClusters == 0 &&
+           report->unallocatedClusters == 0 && report->leakedClusters == 0 && report->miscountedClusters == 0 && report->objects == report->expectedObjects;
+}
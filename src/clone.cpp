@@ -0,0 +1,559 @@
+#include "filesystem.h"
+#include <string.h>
+
+//Copy-on-write clones. On disks formatted with FEATURE_CLONES, files can share clusters. A cluster linking on to the next can't
+//be shared without sharing everything after it, so a file is given a map the first time it's cloned and flagged with
+//NODE_MAPPED: its first cluster, which holds its header and is never shared, links on to a chain of map clusters listing every
+//cluster after it in order, and the links in those clusters are no longer followed, other than as a guess at what to read
+//ahead. The last map cluster is kept where a directory keeps its index. A clone gets a first cluster and a map of its own
+//listing the same clusters, and a table after the checksum table counts, for each cluster, how many more maps than one list it.
+//A file is only ever changed in its own clusters: before a write lands on a shared cluster, just that cluster is copied, the
+//file's map is pointed at the copy and the original loses a reference, so it's freed along with the last file listing it. Files
+//which have never been cloned keep their clusters linked together, and can be written without looking for shared clusters.
+//Directories are never shared, as their entries and index change all the time, so a snapshot of a tree copies every directory
+//in it and clones every file, which takes time and space in proportion to the number of objects and the length of their maps,
+//not the size of their data
+
+//The reference table is updated with atomic operations, as references are dropped by threads holding the locks of different
+//files. It's used in place on a mapped device, otherwise a copy is loaded at mount and its changed clusters written back on sync
+static uint32_t *referenceTable = NULL;
+static std::vector<uint32_t> referenceTableCopy;
+static std::vector<uint8_t> referenceTableDirty; //One flag per cluster of the copied table, set when it's changed
+static BlockDevice *referenceDevice = NULL;
+
+//Converts a reference count between the little endian order it's stored in and the host's order
+static inline uint32_t fs_toReferenceOrder(uint32_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+//Adds a reference to a cluster, noting that the copied table needs writing back
+static void fs_addReference(uint32_t clusterIndex)
+{
+    uint32_t stored = __atomic_load_n(&referenceTable[clusterIndex], __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&referenceTable[clusterIndex], &stored, fs_toReferenceOrder(fs_toReferenceOrder(stored) + 1), 1,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        ;
+    if(disk == NULL)
+        __atomic_store_n(&referenceTableDirty[((uint64_t)clusterIndex * 4) >> superblock.clusterShift], 1, __ATOMIC_RELAXED);
+}
+
+//Gets the reference table of a newly attached device ready, clearing it if the device is about to be formatted.
+//Must be called once the device's mapping, if any, is in place. Returns 0 if the table couldn't be read
+uint8_t fs_openReferences(BlockDevice *device, uint8_t loadTable)
+{
+    referenceDevice = device;
+    referenceTable = NULL;
+    referenceTableCopy.clear();
+    referenceTableDirty.clear();
+    if(!(superblock.features & FEATURE_CLONES))
+        return 1;
+
+    uint64_t tableSize = fs_getWritePosition(superblock.referenceTableLength);
+    if(disk != NULL)
+    {
+        referenceTable = (uint32_t*)&disk[fs_getWritePosition(superblock.referenceTableCluster)];
+        if(!loadTable)
+            memset(referenceTable, 0, tableSize);
+    }
+    else
+    {
+        referenceTableCopy.assign(tableSize / 4, 0);
+        referenceTableDirty.assign(superblock.referenceTableLength, !loadTable);
+        referenceTable = &referenceTableCopy[0];
+        if(loadTable && !device->read(fs_getWritePosition(superblock.referenceTableCluster), (uint8_t*)referenceTable, tableSize))
+            return 0;
+    }
+    return 1;
+}
+
+//Writes the changed clusters of a copied reference table back to the device as one batch. A mapped table is already in place.
+//Returns 0 on failure
+uint8_t fs_syncReferences()
+{
+    std::vector<struct iovec> vectors(referenceTableDirty.size());
+    std::vector<BlockRequest> requests;
+    for(uint32_t a = 0; a < referenceTableDirty.size(); a++)
+    {
+        if(!__atomic_exchange_n(&referenceTableDirty[a], 0, __ATOMIC_RELAXED))
+            continue;
+        vectors[a].iov_base = (uint8_t*)referenceTable + fs_getWritePosition(a);
+        vectors[a].iov_len = CLUSTER_SIZE;
+        BlockRequest request;
+        request.position = fs_getWritePosition(superblock.referenceTableCluster + a);
+        request.vectors = &vectors[a];
+        request.vectorCount = 1;
+        requests.push_back(request);
+    }
+    return requests.empty() || referenceDevice->writeBatch(&requests[0], requests.size());
+}
+
+//Hands the journal a copy of each changed cluster of a copied reference table, as it becomes part of the transaction being committed
+void fs_collectReferenceChanges(std::vector<uint32_t> *clusters, std::vector<uint8_t> *images)
+{
+    for(uint32_t a = 0; a < referenceTableDirty.size(); a++)
+    {
+        if(!__atomic_exchange_n(&referenceTableDirty[a], 0, __ATOMIC_RELAXED))
+            continue;
+        uint8_t *data = (uint8_t*)referenceTable + fs_getWritePosition(a);
+        clusters->push_back(superblock.referenceTableCluster + a);
+        images->insert(images->end(), data, data + CLUSTER_SIZE);
+    }
+}
+
+//Returns the number of maps listing a cluster beyond the first, 0 if it isn't shared
+uint32_t fs_getSharedReferences(uint32_t clusterIndex)
+{
+    if(!(superblock.features & FEATURE_CLONES))
+        return 0;
+    return fs_toReferenceOrder(__atomic_load_n(&referenceTable[clusterIndex], __ATOMIC_ACQUIRE));
+}
+
+//Drops the reference to a cluster from a map which no longer lists it. Returns 1 if that was the only one, so the cluster is
+//the caller's to free, or 0 if another map still lists it
+static uint8_t fs_releaseReference(uint32_t clusterIndex)
+{
+    if(!(superblock.features & FEATURE_CLONES))
+        return 1;
+
+    //A cluster with no extra references can only be reached through the caller's map, so nothing else can change its count
+    uint32_t stored = __atomic_load_n(&referenceTable[clusterIndex], __ATOMIC_ACQUIRE);
+    do
+    {
+        if(stored == 0)
+            return 1;
+    } while(!__atomic_compare_exchange_n(&referenceTable[clusterIndex], &stored, fs_toReferenceOrder(fs_toReferenceOrder(stored) - 1), 1,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    if(disk == NULL)
+        __atomic_store_n(&referenceTableDirty[((uint64_t)clusterIndex * 4) >> superblock.clusterShift], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+//Stores a map entry in the little endian order clusters are stored in
+static inline void fs_encode32(uint8_t *data, uint32_t value)
+{
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+}
+
+//Reads the entry of a file's map at entryOffset within mapCluster, moving both on to the entry after it. Returns 0 once there
+//are no more
+uint32_t fs_nextMapEntry(uint32_t *mapCluster, uint32_t *entryOffset)
+{
+    while(*mapCluster != 0)
+    {
+        uint64_t mapPos = fs_getWritePosition(*mapCluster);
+        uint32_t mapLength = fs_read32(mapPos);
+        if(*entryOffset < mapLength && *entryOffset < CLUSTER_SIZE)
+        {
+            *entryOffset += 4;
+            return fs_read32(mapPos + *entryOffset - 4);
+        }
+        *mapCluster = fs_read32(mapPos + 4);
+        *entryOffset = CLUSTER_HEADER_SIZE;
+    }
+    return 0;
+}
+
+//Adds every cluster listed in a mapped file's map onto the end of clusters, in order
+void fs_readClusterMap(uint32_t objectIndex, std::vector<uint32_t> *clusters)
+{
+    uint32_t mapCluster = fs_read32(fs_getWritePosition(objectIndex) + 4);
+    uint32_t entryOffset = CLUSTER_HEADER_SIZE;
+    for(uint32_t clusterIndex; (clusterIndex = fs_nextMapEntry(&mapCluster, &entryOffset)) != 0;)
+        clusters->push_back(clusterIndex);
+}
+
+//Writes count clusters out as a new chain of map clusters, reserved in runs near nearIndex. Returns the first cluster of the
+//chain, setting lastMapCluster to its last, or 0 if the disk is full
+static uint32_t fs_writeClusterMap(const uint32_t *clusters, uint32_t count, uint32_t nearIndex, uint32_t *lastMapCluster)
+{
+    uint32_t perCluster = (CLUSTER_SIZE - CLUSTER_HEADER_SIZE) / 4;
+    uint32_t needed = (count + perCluster - 1) / perCluster;
+    std::vector<uint32_t> mapClusters;
+    while(mapClusters.size() < needed)
+    {
+        uint32_t first;
+        uint32_t length = fs_allocateRunNear(needed - mapClusters.size(), &first, mapClusters.empty() ? nearIndex : mapClusters.back() + 1);
+        if(length == 0)
+        {
+            for(uint32_t a = 0; a < mapClusters.size(); a++)
+                fs_freeCluster(mapClusters[a]);
+            return 0;
+        }
+        for(uint32_t a = 0; a < length; a++)
+            mapClusters.push_back(first + a);
+    }
+
+    //Every map cluster is filled but the last
+    std::vector<uint8_t> buffer(CLUSTER_SIZE);
+    for(uint32_t a = 0; a < needed; a++)
+    {
+        uint32_t entries = count - (a * perCluster) < perCluster ? count - (a * perCluster) : perCluster;
+        fs_encode32(&buffer[0], CLUSTER_HEADER_SIZE + (entries * 4));
+        fs_encode32(&buffer[4], a + 1 < needed ? mapClusters[a + 1] : 0);
+        for(uint32_t b = 0; b < entries; b++)
+            fs_encode32(&buffer[CLUSTER_HEADER_SIZE + (b * 4)], clusters[(a * perCluster) + b]);
+        fs_writeBytes(fs_getWritePosition(mapClusters[a]), &buffer[0], CLUSTER_HEADER_SIZE + (entries * 4));
+    }
+    *lastMapCluster = mapClusters.back();
+    return mapClusters[0];
+}
+
+//Lists clusterIndex and every cluster linked on from it at the end of a mapped file's map, which the caller must hold the lock
+//for. Returns 0 if the disk is full, in which case the map is left as it was
+uint8_t fs_extendClusterMap(uint32_t objectIndex, uint32_t clusterIndex)
+{
+    std::vector<uint32_t> clusters;
+    for(; clusterIndex != 0; clusterIndex = fs_read32(fs_getWritePosition(clusterIndex) + 4))
+        clusters.push_back(clusterIndex);
+
+    //Fill up the last map cluster, then carry on into new ones linked on from it, or from the first cluster if there's no map yet
+    uint64_t headerPos = fs_getWritePosition(objectIndex);
+    uint32_t lastMap = fs_read32(headerPos + NODE_INDEX_OFFSET);
+    uint64_t linkPos = lastMap != 0 ? fs_getWritePosition(lastMap) : headerPos;
+    uint32_t mapLength = lastMap != 0 ? fs_read32(linkPos) : CLUSTER_SIZE;
+    uint32_t filled = (CLUSTER_SIZE - mapLength) / 4 < clusters.size() ? (CLUSTER_SIZE - mapLength) / 4 : clusters.size();
+    uint32_t firstNew = 0;
+    uint32_t lastNew = 0;
+    if(filled < clusters.size() && (firstNew = fs_writeClusterMap(&clusters[filled], clusters.size() - filled, lastMap != 0 ? lastMap : objectIndex, &lastNew)) == 0)
+        return 0;
+
+    if(filled > 0)
+    {
+        std::vector<uint8_t> buffer(filled * 4);
+        for(uint32_t a = 0; a < filled; a++)
+            fs_encode32(&buffer[a * 4], clusters[a]);
+        fs_writeBytes(linkPos + mapLength, &buffer[0], buffer.size());
+        fs_write32(linkPos, mapLength + buffer.size());
+    }
+    if(firstNew != 0)
+    {
+        fs_write32(linkPos + 4, firstNew);
+        fs_write32(headerPos + NODE_INDEX_OFFSET, lastNew);
+    }
+    return 1;
+}
+
+//Cuts a mapped file's map down to its first count clusters, which the caller must hold the lock for. The clusters cut lose the
+//file's reference, those no other file lists being freed, as are map clusters left empty
+void fs_truncateClusterMap(uint32_t objectIndex, uint32_t count)
+{
+    //Find the map cluster the kept entries end in
+    uint64_t headerPos = fs_getWritePosition(objectIndex);
+    uint32_t lastMap = objectIndex;
+    uint32_t mapCluster = fs_read32(headerPos + 4);
+    uint32_t kept = 0;
+    while(mapCluster != 0)
+    {
+        uint32_t entries = (fs_read32(fs_getWritePosition(mapCluster)) - CLUSTER_HEADER_SIZE) / 4;
+        if(kept + entries > count || (kept + entries == count && count != 0))
+            break;
+        kept += entries;
+        lastMap = mapCluster;
+        mapCluster = fs_read32(fs_getWritePosition(mapCluster) + 4);
+    }
+
+    //Let go of every entry after the last kept, freeing map clusters once they're emptied
+    for(uint32_t keep = count - kept; mapCluster != 0; keep = 0)
+    {
+        uint64_t mapPos = fs_getWritePosition(mapCluster);
+        uint32_t mapLength = fs_read32(mapPos);
+        uint32_t next = fs_read32(mapPos + 4);
+        for(uint32_t offset = CLUSTER_HEADER_SIZE + (keep * 4); offset < mapLength; offset += 4)
+        {
+            uint32_t clusterIndex = fs_read32(mapPos + offset);
+            if(fs_releaseReference(clusterIndex))
+                fs_freeCluster(clusterIndex);
+        }
+        if(keep > 0)
+        {
+            fs_write32(mapPos, CLUSTER_HEADER_SIZE + (keep * 4));
+            lastMap = mapCluster;
+        }
+        else
+            fs_freeCluster(mapCluster);
+        mapCluster = next;
+    }
+    fs_write32(fs_getWritePosition(lastMap) + 4, 0);
+    fs_write32(headerPos + NODE_INDEX_OFFSET, lastMap != objectIndex ? lastMap : 0);
+}
+
+//Lets go of every cluster listed in a mapped file's map, adding those no other file lists to clusters for the caller to free.
+//The map itself is left as it is
+void fs_releaseClusterMap(uint32_t objectIndex, std::vector<uint32_t> *clusters)
+{
+    std::vector<uint32_t> listed;
+    fs_readClusterMap(objectIndex, &listed);
+    for(uint32_t a = 0; a < listed.size(); a++)
+        if(fs_releaseReference(listed[a]))
+            clusters->push_back(listed[a]);
+}
+
+//Makes sure a file has its own copy of every cluster of its chain from position first to last, counting the first cluster as 0,
+//so they can be changed. A first position of ~0 stands for the last cluster, which appending writes to. If clusterTable isn't
+//NULL it lists the file's clusters, like a handle's table, and is kept in step. The caller must hold the file's lock for writing.
+//Returns 0 if the disk is full, in which case nothing is changed
+uint8_t fs_unshareClusters(uint32_t objectIndex, uint32_t first, uint32_t last, std::vector<uint32_t> *clusterTable)
+{
+    //The first cluster is never shared, and nor is the last once it's been found not to be
+    if(!fs_isMapped(objectIndex) || last == 0)
+        return 1;
+    uint64_t headerPos = fs_getWritePosition(objectIndex);
+    uint32_t tail = fs_read32(headerPos + NODE_TAIL_OFFSET);
+    if(first == ~0U && fs_getSharedReferences(tail) == 0)
+        return 1;
+    if(first == 0)
+        first = 1;
+
+    //Find where in the map each shared cluster in range is listed
+    std::vector<uint64_t> entries;
+    std::vector<uint32_t> positions;
+    uint64_t lastEntry = 0;
+    uint32_t position = 1;
+    uint32_t mapCluster = fs_read32(headerPos + 4);
+    while(mapCluster != 0 && position <= last)
+    {
+        uint64_t mapPos = fs_getWritePosition(mapCluster);
+        uint32_t count = (fs_read32(mapPos) - CLUSTER_HEADER_SIZE) / 4;
+        for(uint32_t a = first > position ? first - position : 0; a < count && position + a <= last; a++)
+        {
+            if(fs_getSharedReferences(fs_read32(mapPos + CLUSTER_HEADER_SIZE + (a * 4))) != 0)
+            {
+                entries.push_back(mapPos + CLUSTER_HEADER_SIZE + (a * 4));
+                positions.push_back(position + a);
+            }
+        }
+        if(count != 0)
+            lastEntry = mapPos + CLUSTER_HEADER_SIZE + ((count - 1) * 4);
+        position += count;
+        mapCluster = fs_read32(mapPos + 4);
+    }
+    if(first == ~0U && lastEntry != 0)
+    {
+        entries.push_back(lastEntry);
+        positions.push_back(position - 1);
+    }
+    if(entries.empty())
+        return 1;
+
+    //Reserve the copies in runs following on from the clusters they replace, giving them back if the disk fills up
+    std::vector<uint32_t> copies;
+    while(copies.size() < entries.size())
+    {
+        uint32_t firstCopy;
+        uint32_t length = fs_allocateRunNear(entries.size() - copies.size(), &firstCopy, (copies.empty() ? fs_read32(entries[0]) : copies.back()) + 1);
+        if(length == 0)
+        {
+            for(uint32_t a = 0; a < copies.size(); a++)
+                fs_freeCluster(copies[a]);
+            return 0;
+        }
+        for(uint32_t a = 0; a < length; a++)
+            copies.push_back(firstCopy + a);
+    }
+
+    //Copy each cluster whole and list the copy in its place. Another file may have let go of the original since it was found
+    //to be shared, leaving it to this one to free
+    std::vector<uint8_t> buffer(CLUSTER_SIZE);
+    for(uint32_t a = 0; a < entries.size(); a++)
+    {
+        uint32_t original = fs_read32(entries[a]);
+        fs_readBytes(fs_getWritePosition(original), &buffer[0], CLUSTER_SIZE);
+        fs_writeBytes(fs_getWritePosition(copies[a]), &buffer[0], CLUSTER_SIZE);
+        fs_write32(entries[a], copies[a]);
+        if(original == tail)
+            fs_write32(headerPos + NODE_TAIL_OFFSET, copies[a]);
+        if(clusterTable != NULL && positions[a] < clusterTable->size())
+            (*clusterTable)[positions[a]] = copies[a];
+        if(fs_releaseReference(original))
+            fs_freeCluster(original);
+    }
+    fs_moveChainGeneration(objectIndex);
+    return 1;
+}
+
+//Gives a file whose lock the caller holds for writing a map listing the clusters linked on from its first. Returns 0 if the
+//disk is full, in which case the file is left as it was
+static uint8_t fs_mapFile(uint32_t objectIndex)
+{
+    uint64_t headerPos = fs_getWritePosition(objectIndex);
+    uint32_t first = fs_read32(headerPos + 4);
+    fs_write32(headerPos + 4, 0);
+    fs_write32(headerPos + NODE_INDEX_OFFSET, 0);
+    if(!fs_extendClusterMap(objectIndex, first))
+    {
+        fs_write32(headerPos + 4, first);
+        return 0;
+    }
+    fs_write8(headerPos + 8, fs_read8(headerPos + 8) | NODE_MAPPED);
+    fs_moveChainGeneration(objectIndex);
+    return 1;
+}
+
+//Clones a file whose lock the caller holds for writing, putting the clone's first cluster near nearIndex. Returns the clone,
+//or 0 if the object is a directory or the disk is full
+static uint32_t fs_cloneFile(uint32_t objectIndex, uint32_t nearIndex)
+{
+    uint64_t headerPos = fs_getWritePosition(objectIndex);
+    uint8_t type = fs_read8(headerPos + 8);
+    if((type & NODE_TYPE_MASK) == NODE_DIRECTORY)
+        return 0;
+
+    //A file which fits in its first cluster has nothing to share, otherwise it needs a map to share its clusters through
+    if(!(type & NODE_MAPPED) && fs_read32(headerPos + 4) != 0)
+    {
+        if(!fs_mapFile(objectIndex))
+            return 0;
+        type |= NODE_MAPPED;
+    }
+
+    //Copy the original's map for the clone, then create the clone with the same name, giving the map back if that fails
+    std::vector<uint32_t> clusters;
+    if(type & NODE_MAPPED)
+        fs_readClusterMap(objectIndex, &clusters);
+    uint32_t firstMap = 0;
+    uint32_t lastMap = 0;
+    if(!clusters.empty() && (firstMap = fs_writeClusterMap(&clusters[0], clusters.size(), nearIndex, &lastMap)) == 0)
+        return 0;
+    uint16_t nameLength = fs_read16(headerPos + 13);
+    std::vector<uint8_t> buffer(CLUSTER_SIZE);
+    fs_readBytes(headerPos, &buffer[0], CLUSTER_SIZE);
+    uint32_t clone = fs_createObjectNear(nearIndex, type & NODE_TYPE_MASK, fs_read32(headerPos + 9), nameLength, &buffer[NODE_NAME_OFFSET]);
+    if(clone == 0)
+    {
+        while(firstMap != 0)
+        {
+            uint32_t next = fs_read32(fs_getWritePosition(firstMap) + 4);
+            fs_freeCluster(firstMap);
+            firstMap = next;
+        }
+        return 0;
+    }
+
+    //Every cluster the map lists gains a reference, and the clone's first cluster is a copy of the original's pointing at its map
+    for(uint32_t a = 0; a < clusters.size(); a++)
+        fs_addReference(clusters[a]);
+    uint32_t tail = clusters.empty() ? clone : clusters.back();
+    for(uint32_t a = 0; a < 4; a++)
+    {
+        buffer[4 + a] = firstMap >> (a * 8);
+        buffer[NODE_TAIL_OFFSET + a] = tail >> (a * 8);
+        buffer[NODE_INDEX_OFFSET + a] = lastMap >> (a * 8);
+    }
+    fs_writeBytes(fs_getWritePosition(clone), &buffer[0], CLUSTER_SIZE);
+    return clone;
+}
+
+//Creates a copy of a file which shares every cluster but the first with it, so it takes up one cluster and a map of 4 bytes
+//for each of the others however much data there is. Clusters are only copied once one of the files writes to them. The copy has the same name, as the name's length decides where
+//the data starts, and isn't added to any directory. Only works on disks formatted with FEATURE_CLONES.
+//Returns the copy, or 0 if the object is a directory or the disk is full
+uint32_t fs_clone(uint32_t objectIndex)
+{
+    if(!(superblock.features & FEATURE_CLONES))
+        return 0;
+    fs_beginOperation();
+    fs_lockObject(objectIndex, 1);
+    uint32_t clone = fs_cloneFile(objectIndex, objectIndex);
+    fs_unlockObject(objectIndex, 1);
+    fs_endOperation();
+    return clone;
+}
+
+//A directory of a snapshot waiting to be filled in
+struct SnapshotDirectory
+{
+    uint32_t original; //Directory being copied
+    uint32_t copy; //Its copy in the snapshot
+};
+
+//Creates a copy of a directory and everything below it in parentIndex, called name. Every directory is copied and every file
+//cloned, so the copy takes a cluster or so per object and a map of each file, however much data there is. Links to directories outside the tree are
+//copied as links. The copy is added to its parent before anything is copied into it, and each object is added as it's copied,
+//so a crash part way through leaves a partial copy which can be removed like any other directory. The tree mustn't change
+//while it's copied: each object is copied as it stands when it's reached, so the copy isn't of the tree at any one moment
+//otherwise, and objects moved around in it can be missed or copied twice. Only works on disks formatted with FEATURE_CLONES.
+//Returns the copy, or 0 if the disk fills up, in which case whatever was copied is removed again
+uint32_t fs_snapshot(uint32_t directoryIndex, uint32_t parentIndex, uint16_t nameLength, uint8_t *name)
+{
+    if(!(superblock.features & FEATURE_CLONES))
+        return 0;
+    fs_beginOperation();
+    uint32_t root = fs_createDirectory(parentIndex, fs_getNodeHeader(directoryIndex).permissions, nameLength, name);
+    if(root != 0)
+        fs_addObjectToDirectory(parentIndex, root);
+    fs_endOperation();
+    if(root == 0)
+        return 0;
+
+    //Copy a directory at a time, reading its entries first so only one lock is held at once
+    std::vector<SnapshotDirectory> pending(1);
+    pending[0].original = directoryIndex;
+    pending[0].copy = root;
+    std::vector<uint32_t> entries;
+    uint8_t complete = 1;
+    while(!pending.empty() && complete)
+    {
+        SnapshotDirectory directory = pending.back();
+        pending.pop_back();
+
+        entries.clear();
+        fs_lockObject(directory.original, 0);
+        ClusterSpanIterator iterator;
+        fs_beginSpans(directory.original, &iterator);
+        const uint8_t *span;
+        uint32_t spanLength;
+        while(fs_nextSpan(&iterator, &span, &spanLength))
+            for(uint32_t a = 0; a < spanLength; a += DIRECTORY_ENTRY_SIZE)
+                entries.push_back(intConcatL(span[a], span[a + 1], span[a + 2], span[a + 3]));
+        fs_unlockObject(directory.original, 0);
+
+        //Every entry but the parent is copied, each in an operation of its own so a big tree doesn't overflow the journal
+        for(uint32_t a = 1; a < entries.size() && complete; a++)
+        {
+            uint32_t child = entries[a];
+            uint64_t childPos = fs_getWritePosition(child);
+            uint32_t copy = child;
+            fs_beginOperation();
+            if((fs_read8(childPos + 8) & NODE_TYPE_MASK) == NODE_DIRECTORY)
+            {
+                //A directory whose parent entry points elsewhere is linked in from outside the tree, and stays a link
+                if(fs_read32(childPos + fs_getHeaderSize(child)) == directory.original)
+                {
+                    std::vector<uint8_t> childName(fs_read16(childPos + 13));
+                    fs_readBytes(childPos + NODE_NAME_OFFSET, &childName[0], childName.size());
+                    copy = fs_createDirectory(directory.copy, fs_read32(childPos + 9), childName.size(), &childName[0]);
+                    SnapshotDirectory next = {child, copy};
+                    if(copy != 0)
+                        pending.push_back(next);
+                }
+            }
+            else
+            {
+                fs_lockObject(child, 1);
+                copy = fs_cloneFile(child, directory.copy);
+                fs_unlockObject(child, 1);
+            }
+            if(copy != 0)
+                fs_addObjectToDirectory(directory.copy, copy);
+            fs_endOperation();
+            complete = copy != 0;
+        }
+    }
+
+    if(!complete)
+    {
+        fs_beginOperation();
+        if(fs_unlistObject(parentIndex, root))
+            fs_removeTree(root);
+        fs_endOperation();
+        return 0;
+    }
+    return root;
+}
@@ -0,0 +1,684 @@
+#include "filesystem.h"
+#include <string.h>
+
+//Compressed files. On disks formatted with FEATURE_COMPRESSION, a file created with NODE_COMPRESSED stores its data in chunks
+//of COMPRESSION_CHUNK_SIZE bytes, each compressed on its own so any part of the file can be read by decompressing just the
+//chunks it falls in. Each chunk is stored as a frame: a header giving how many bytes the frame takes up after it, the chunk's
+//stored length, with COMPRESSION_RAW_FRAME set if it didn't get any smaller and is stored as it is, and which chunk it holds,
+//followed by the chunk. The frames are the file's data as far as everything else is concerned, so clusters, clones, spans and
+//scrubbing all work on them unchanged, and the node header's size counts them. The uncompressed size and where the last chunk
+//is stored follow the name instead. Every chunk but the last is full, so the chunk holding an offset follows from it. Frames
+//are written in order, and a handle remembers where each chunk it comes across is stored as it reads through their headers
+//looking for the ones it wants, so a file is only scanned once per handle. A handle also keeps the last chunk it decompressed,
+//so small reads don't decompress it again.
+//A chunk which is written is stored back in its own frame when it still fits, so a write only costs the chunks it touches, and
+//one which shrinks keeps the room it had as it may well grow back. One which has grown moves into whichever free frame fits it
+//best, or after the end, while the last frame grows where it is. The new frame is written before the old one is freed, so if
+//the disk fills up each chunk is left either written or as it was. Free frames next to each other are merged so they can take
+//a bigger chunk, and a handle reuses those it has freed or come across.
+//The codec is an LZ77 byte format in the style of LZ4: a token whose top four bits give a number of literals and bottom four
+//a match length, either of which carries on in extra bytes when it's 15, then the literals, then a two byte offset back into
+//the output. The last sequence of a chunk has literals only. Matches are found through a hash table of the last position each
+//four bytes were seen at, which is fast enough to compress at around the speed of a disk and decompress several times faster
+#define COMPRESSION_RAW_FRAME 0x80000000 //Set in a frame's stored length if the chunk is stored uncompressed
+#define COMPRESSION_FREE_FRAME 0xFFFFFFFF //Chunk number of a frame with nothing in it
+#define COMPRESSION_WINDOW_SIZE (256 * 1024) //Most stored bytes of a compressed file read or written in one go
+#define COMPRESSION_HASH_BITS 12 //log2 of the number of entries in the match finder's hash table
+#define COMPRESSION_MIN_MATCH 4 //Shortest match which can be encoded
+#define COMPRESSION_MAX_OFFSET 65535 //Furthest back a match can be
+#define COMPRESSION_MATCH_LIMIT 12 //No match starts in this many bytes at the end of a chunk
+#define COMPRESSION_LAST_LITERALS 5 //Nor runs into this many bytes at the end
+
+//Reads four bytes as an integer, for comparing and hashing
+static inline uint32_t fs_readSequence(const uint8_t *data)
+{
+    uint32_t sequence;
+    memcpy(&sequence, data, 4);
+    return sequence;
+}
+
+//Hashes four bytes onto the match finder's table
+static inline uint32_t fs_hashSequence(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - COMPRESSION_HASH_BITS);
+}
+
+//Returns how many bytes two buffers have in common from the start, comparing at most limit bytes
+static inline uint32_t fs_countMatching(const uint8_t *a, const uint8_t *b, uint32_t limit)
+{
+    uint32_t length = 0;
+    while(length + 8 <= limit)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + length, 8);
+        memcpy(&y, b + length, 8);
+        if(x != y)
+        {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return length + (__builtin_clzll(x ^ y) >> 3);
+#else
+            return length + (__builtin_ctzll(x ^ y) >> 3);
+#endif
+        }
+        length += 8;
+    }
+    while(length < limit && a[length] == b[length])
+        length++;
+    return length;
+}
+
+//Writes the part of a literal or match length which didn't fit in the token. Returns the new output position, or NULL if it doesn't fit
+static uint8_t *fs_writeLength(uint8_t *output, const uint8_t *outputEnd, uint32_t length)
+{
+    for(; length >= 255; length -= 255)
+    {
+        if(output == outputEnd)
+            return NULL;
+        *output++ = 255;
+    }
+    if(output == outputEnd)
+        return NULL;
+    *output++ = length;
+    return output;
+}
+
+//Writes a run of literals followed by a match, or just the literals if matchLength is 0. Returns the new output position, or
+//NULL if it doesn't fit
+static uint8_t *fs_writeSequence(uint8_t *output, const uint8_t *outputEnd, const uint8_t *literals, uint32_t literalLength, uint32_t offset, uint32_t matchLength)
+{
+    if(output == outputEnd)
+        return NULL;
+    uint8_t *token = output++;
+    *token = (literalLength < 15 ? literalLength : 15) << 4;
+    if(literalLength >= 15 && (output = fs_writeLength(output, outputEnd, literalLength - 15)) == NULL)
+        return NULL;
+    if((uint64_t)(outputEnd - output) < literalLength)
+        return NULL;
+    memcpy(output, literals, literalLength);
+    output += literalLength;
+    if(matchLength == 0)
+        return output;
+
+    if(outputEnd - output < 2)
+        return NULL;
+    *output++ = offset;
+    *output++ = offset >> 8;
+    matchLength -= COMPRESSION_MIN_MATCH;
+    *token |= matchLength < 15 ? matchLength : 15;
+    if(matchLength >= 15 && (output = fs_writeLength(output, outputEnd, matchLength - 15)) == NULL)
+        return NULL;
+    return output;
+}
+
+//Compresses length bytes of source into destination. Returns the compressed length, or 0 if it would take more than capacity bytes
+uint32_t fs_compressChunk(const uint8_t *source, uint32_t length, uint8_t *destination, uint32_t capacity)
+{
+    uint8_t *output = destination;
+    const uint8_t *outputEnd = destination + capacity;
+    uint32_t anchor = 0; //Start of the literals not written yet
+    if(length > COMPRESSION_MATCH_LIMIT)
+    {
+        uint32_t table[1 << COMPRESSION_HASH_BITS];
+        memset(table, 0, sizeof(table));
+        uint32_t matchLimit = length - COMPRESSION_MATCH_LIMIT;
+        uint32_t position = 0;
+        uint32_t misses = 0;
+        while(position < matchLimit)
+        {
+            uint32_t sequence = fs_readSequence(source + position);
+            uint32_t hash = fs_hashSequence(sequence);
+            uint32_t candidate = table[hash];
+            table[hash] = position;
+            if(candidate >= position || position - candidate > COMPRESSION_MAX_OFFSET || fs_readSequence(source + candidate) != sequence)
+            {
+                //Step further the longer nothing matches, so data which won't compress goes through quickly
+                position += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            //Take the match back over any literals which match as well, then as far forwards as it goes
+            while(position > anchor && candidate > 0 && source[position - 1] == source[candidate - 1])
+            {
+                position--;
+                candidate--;
+            }
+            uint32_t matchLength = fs_countMatching(source + position, source + candidate, length - COMPRESSION_LAST_LITERALS - position);
+            output = fs_writeSequence(output, outputEnd, source + anchor, position - anchor, position - candidate, matchLength);
+            if(output == NULL)
+                return 0;
+            position += matchLength;
+            anchor = position;
+
+            //Remember a position near the end of the match too, so repeats following on from it are found
+            if(position - 2 < matchLimit)
+                table[fs_hashSequence(fs_readSequence(source + position - 2))] = position - 2;
+        }
+    }
+    output = fs_writeSequence(output, outputEnd, source + anchor, length - anchor, 0, 0);
+    return output == NULL ? 0 : output - destination;
+}
+
+//Reads the extra bytes of a literal or match length onto length. Returns 0 if they run off the end of the input
+static inline uint8_t fs_readLength(const uint8_t **input, const uint8_t *inputEnd, uint32_t *length)
+{
+    uint8_t byte;
+    do
+    {
+        if(*input == inputEnd || *length > COMPRESSION_CHUNK_SIZE * 2)
+            return 0;
+        byte = *(*input)++;
+        *length += byte;
+    } while(byte == 255);
+    return 1;
+}
+
+//Decompresses length bytes of source into destination, which must come to exactly expectedLength bytes. Returns 0 if the data
+//is damaged, in which case destination may have been partly written, but never past expectedLength
+uint8_t fs_decompressChunk(const uint8_t *source, uint32_t length, uint8_t *destination, uint32_t expectedLength)
+{
+    const uint8_t *input = source;
+    const uint8_t *inputEnd = source + length;
+    uint8_t *output = destination;
+    uint8_t *outputEnd = destination + expectedLength;
+    while(input < inputEnd)
+    {
+        uint8_t token = *input++;
+        uint32_t literalLength = token >> 4;
+        if(literalLength == 15 && !fs_readLength(&input, inputEnd, &literalLength))
+            return 0;
+        if(literalLength > (uint64_t)(inputEnd - input) || literalLength > (uint64_t)(outputEnd - output))
+            return 0;
+        memcpy(output, input, literalLength);
+        input += literalLength;
+        output += literalLength;
+
+        //The last sequence has no match
+        if(input == inputEnd)
+            break;
+        if(inputEnd - input < 2)
+            return 0;
+        uint32_t offset = input[0] | (input[1] << 8);
+        input += 2;
+        uint32_t matchLength = token & 15;
+        if(matchLength == 15 && !fs_readLength(&input, inputEnd, &matchLength))
+            return 0;
+        matchLength += COMPRESSION_MIN_MATCH;
+        if(offset == 0 || offset > output - destination || matchLength > (uint64_t)(outputEnd - output))
+            return 0;
+
+        //A match may overlap what it's copying, which repeats the bytes between, so it's copied in steps no longer than the offset
+        const uint8_t *match = output - offset;
+        uint32_t copied = 0;
+        if(offset >= 8)
+            for(; copied + 8 <= matchLength; copied += 8)
+                memcpy(output + copied, match + copied, 8);
+        for(; copied < matchLength; copied++)
+            output[copied] = match[copied];
+        output += matchLength;
+    }
+    return output == outputEnd;
+}
+
+//Stored data of a compressed file read in one go, so runs of chunks are read in a single pass over their clusters
+struct ChunkWindow
+{
+    uint64_t start; //Stored offset of the first byte in data
+    std::vector<uint8_t> data;
+};
+
+//Returns the position of a compressed file's uncompressed size, which is followed by where its last chunk is stored
+static inline uint64_t fs_getCompressionInfoPosition(FileHandle *handle)
+{
+    return fs_getWritePosition(handle->objectIndex) + handle->headerSize - NODE_COMPRESSION_INFO_LENGTH;
+}
+
+//Reads one of the four byte fields of a frame header
+static inline uint32_t fs_readFrameField(const uint8_t *field)
+{
+    return intConcatL(field[0], field[1], field[2], field[3]);
+}
+
+//Fills in the header of a frame taking up room bytes after it. storedLength has COMPRESSION_RAW_FRAME set if the chunk is
+//stored as it is, and chunk is COMPRESSION_FREE_FRAME for a frame with nothing in it
+static void fs_writeFrameHeader(uint8_t *header, uint32_t room, uint32_t storedLength, uint32_t chunk)
+{
+    for(uint32_t a = 0; a < 4; a++)
+    {
+        header[a] = room >> (a * 8);
+        header[4 + a] = storedLength >> (a * 8);
+        header[8 + a] = chunk >> (a * 8);
+    }
+}
+
+//Makes sure the window holds the stored bytes from position up to end, reading want bytes from position if that's further.
+//end must be within the stored data. Returns 0 if they couldn't be read
+static uint8_t fs_fillWindow(FileHandle *handle, ChunkWindow *window, uint64_t position, uint64_t end, uint64_t want, uint64_t storedSize)
+{
+    if(position >= window->start && end <= window->start + window->data.size())
+        return 1;
+    uint64_t length = storedSize - position < want ? storedSize - position : want;
+    if(length < end - position)
+        length = end - position;
+    window->start = position;
+    window->data.resize(length);
+    return fs_readAt(handle, position, window->data.data(), length) == length;
+}
+
+//Drops a free frame from those the handle knows of. Returns 0 if it wasn't one of them
+static uint8_t fs_forgetFreeFrame(FileHandle *handle, uint64_t position)
+{
+    for(uint64_t a = 0; a < handle->freeFrames.size(); a++)
+    {
+        if(handle->freeFrames[a] != position)
+            continue;
+        handle->freeFrames.erase(handle->freeFrames.begin() + a);
+        return 1;
+    }
+    return 0;
+}
+
+//Reads the frame header the handle has got up to, noting where its chunk is stored or that it's free, and moves on past it.
+//Returns 0 if the header is damaged or its chunk has already been found somewhere else
+static uint8_t fs_scanFrame(FileHandle *handle, ChunkWindow *window, uint64_t want, uint64_t storedSize, uint64_t chunkCount)
+{
+    uint64_t position = handle->chunkScan;
+    if(position + COMPRESSION_FRAME_HEADER_SIZE > storedSize || !fs_fillWindow(handle, window, position, position + COMPRESSION_FRAME_HEADER_SIZE, want, storedSize))
+        return 0;
+    const uint8_t *header = &window->data[position - window->start];
+    uint32_t room = fs_readFrameField(header);
+    uint32_t storedLength = fs_readFrameField(header + 4) & ~COMPRESSION_RAW_FRAME;
+    uint32_t chunk = fs_readFrameField(header + 8);
+    if((room > COMPRESSION_CHUNK_SIZE && chunk != COMPRESSION_FREE_FRAME) || storedLength > room || position + COMPRESSION_FRAME_HEADER_SIZE + room > storedSize)
+        return 0;
+    if(chunk == COMPRESSION_FREE_FRAME)
+    {
+        //The handle may have freed it itself
+        fs_forgetFreeFrame(handle, position);
+        handle->freeFrames.push_back(position);
+    }
+    else if(chunk >= chunkCount || (handle->chunkTable[chunk] != ~0ULL && handle->chunkTable[chunk] != position))
+        return 0;
+    else
+        handle->chunkTable[chunk] = position;
+    handle->chunkScan = position + COMPRESSION_FRAME_HEADER_SIZE + room;
+    return 1;
+}
+
+//Makes sure the handle knows where a chunk is stored, carrying on through the frame headers from where it got to until it comes
+//across it. The first header is read along with want bytes, any after it a window at a time. The last chunk is found straight
+//from the file's header. Returns 0 if the chunk isn't there, which only happens to a damaged file
+static uint8_t fs_findChunk(FileHandle *handle, ChunkWindow *window, uint64_t chunk, uint64_t want)
+{
+    uint64_t infoPos = fs_getCompressionInfoPosition(handle);
+    uint64_t chunkCount = (fs_read64(infoPos) + COMPRESSION_CHUNK_SIZE - 1) / COMPRESSION_CHUNK_SIZE;
+    uint64_t storedSize = fs_read64(fs_getWritePosition(handle->objectIndex) + NODE_SIZE_OFFSET);
+    if(chunk >= chunkCount)
+        return 0;
+    if(handle->chunkTable.size() < chunkCount)
+        handle->chunkTable.resize(chunkCount, ~0ULL);
+    if(handle->chunkTable[chunk] == ~0ULL && chunk + 1 == chunkCount)
+        handle->chunkTable[chunk] = fs_read64(infoPos + 8);
+    for(uint64_t scanned = 0; handle->chunkTable[chunk] == ~0ULL; scanned++)
+        if(!fs_scanFrame(handle, window, scanned == 0 ? want : COMPRESSION_WINDOW_SIZE, storedSize, chunkCount))
+            return 0;
+    return 1;
+}
+
+//Makes sure the clusters holding length bytes of the stored data from offset are the file's own, so writing there can't run
+//out of room. The handle keeps track of its chunks. Returns 0 if the disk is full
+static uint8_t fs_unshareStoredData(FileHandle *handle, uint64_t offset, uint64_t length)
+{
+    return fs_unshareHandle(handle, fs_getClusterPosition(handle, offset), fs_getClusterPosition(handle, offset + length - 1));
+}
+
+//Reads how many bytes the frame at position takes up after its header and which chunk it holds. Returns 0 if it can't be read
+static uint8_t fs_readFrame(FileHandle *handle, ChunkWindow *window, uint64_t position, uint64_t storedSize, uint32_t *room, uint32_t *chunk)
+{
+    if(position + COMPRESSION_FRAME_HEADER_SIZE > storedSize || !fs_fillWindow(handle, window, position, position + COMPRESSION_FRAME_HEADER_SIZE, COMPRESSION_FRAME_HEADER_SIZE, storedSize))
+        return 0;
+    const uint8_t *header = &window->data[position - window->start];
+    *room = fs_readFrameField(header);
+    *chunk = fs_readFrameField(header + 8);
+    return (*room <= COMPRESSION_CHUNK_SIZE || *chunk == COMPRESSION_FREE_FRAME) && position + COMPRESSION_FRAME_HEADER_SIZE + *room <= storedSize;
+}
+
+//Marks the frame at position as free, along with any free frames either side of it so they can hold a bigger chunk together.
+//Any cluster it's in must already be the file's own
+static void fs_freeFrame(FileHandle *handle, ChunkWindow *window, uint64_t position, uint32_t room, uint64_t storedSize)
+{
+    uint64_t end = position + COMPRESSION_FRAME_HEADER_SIZE + room;
+    uint32_t nextRoom;
+    uint32_t nextChunk;
+    while(fs_readFrame(handle, window, end, storedSize, &nextRoom, &nextChunk) && nextChunk == COMPRESSION_FREE_FRAME)
+    {
+        fs_forgetFreeFrame(handle, end);
+        end += COMPRESSION_FRAME_HEADER_SIZE + nextRoom;
+    }
+    for(uint64_t a = 0; a < handle->freeFrames.size(); a++)
+    {
+        uint64_t previous = handle->freeFrames[a];
+        if(previous < position && fs_readFrame(handle, window, previous, storedSize, &nextRoom, &nextChunk) && previous + COMPRESSION_FRAME_HEADER_SIZE + nextRoom == position)
+        {
+            handle->freeFrames.erase(handle->freeFrames.begin() + a);
+            position = previous;
+            break;
+        }
+    }
+    uint8_t header[COMPRESSION_FRAME_HEADER_SIZE];
+    fs_writeFrameHeader(header, end - position - COMPRESSION_FRAME_HEADER_SIZE, 0, COMPRESSION_FREE_FRAME);
+    fs_writeAt(handle, position, header, sizeof(header));
+    window->data.clear();
+
+    //The scan mustn't carry on from inside the merged frame
+    if(handle->chunkScan > position && handle->chunkScan < end)
+        handle->chunkScan = end;
+    handle->freeFrames.push_back(position);
+}
+
+//Decompresses a chunk of chunkLength bytes into destination, reading want bytes of stored data at once if it has to read any.
+//Returns 0 if it's damaged
+static uint8_t fs_decodeChunk(FileHandle *handle, ChunkWindow *window, uint64_t chunk, uint32_t chunkLength, uint64_t want, uint8_t *destination)
+{
+    uint64_t storedSize = fs_read64(fs_getWritePosition(handle->objectIndex) + NODE_SIZE_OFFSET);
+    if(!fs_findChunk(handle, window, chunk, want))
+        return 0;
+    uint64_t start = handle->chunkTable[chunk];
+    if(start + COMPRESSION_FRAME_HEADER_SIZE > storedSize || !fs_fillWindow(handle, window, start, start + COMPRESSION_FRAME_HEADER_SIZE, want, storedSize))
+        return 0;
+    const uint8_t *frame = &window->data[start - window->start];
+    uint32_t room = fs_readFrameField(frame);
+    uint32_t header = fs_readFrameField(frame + 4);
+    uint32_t storedLength = header & ~COMPRESSION_RAW_FRAME;
+    if(fs_readFrameField(frame + 8) != chunk || storedLength > room || start + COMPRESSION_FRAME_HEADER_SIZE + room > storedSize)
+        return 0;
+    if(!fs_fillWindow(handle, window, start, start + COMPRESSION_FRAME_HEADER_SIZE + storedLength, want, storedSize))
+        return 0;
+
+    frame = &window->data[start - window->start] + COMPRESSION_FRAME_HEADER_SIZE;
+    if(!(header & COMPRESSION_RAW_FRAME))
+        return fs_decompressChunk(frame, storedLength, destination, chunkLength);
+    if(storedLength != chunkLength)
+        return 0;
+    memcpy(destination, frame, chunkLength);
+    return 1;
+}
+
+//Compresses a chunk of chunkLength bytes into the frame after its header, which must have room for the whole chunk. A chunk
+//which doesn't get any smaller is stored as it is. Returns its stored length, with COMPRESSION_RAW_FRAME set if it's stored as it is
+static uint32_t fs_encodeChunk(const uint8_t *chunkData, uint32_t chunkLength, uint8_t *frame)
+{
+    uint32_t storedLength = fs_compressChunk(chunkData, chunkLength, frame + COMPRESSION_FRAME_HEADER_SIZE, chunkLength - 1);
+    if(storedLength != 0)
+        return storedLength;
+    memcpy(frame + COMPRESSION_FRAME_HEADER_SIZE, chunkData, chunkLength);
+    return chunkLength | COMPRESSION_RAW_FRAME;
+}
+
+//Reads up to length bytes of a compressed file's uncompressed data from offset through a handle, decompressing only the chunks
+//the range falls in. The caller must hold the file's lock. Returns the number of bytes read, which stops short at a damaged chunk
+uint64_t fs_readCompressed(FileHandle *handle, uint64_t offset, uint8_t *buffer, uint64_t length)
+{
+    fs_refreshHandle(handle);
+    uint64_t size = fs_read64(fs_getCompressionInfoPosition(handle));
+    if(offset >= size)
+        return 0;
+    if(length > size - offset)
+        length = size - offset;
+
+    ChunkWindow window;
+    window.start = 0;
+    uint64_t bufferOffset = 0;
+    while(bufferOffset < length)
+    {
+        uint64_t chunk = (offset + bufferOffset) / COMPRESSION_CHUNK_SIZE;
+        uint32_t chunkOffset = (offset + bufferOffset) % COMPRESSION_CHUNK_SIZE;
+        uint64_t chunkStart = chunk * COMPRESSION_CHUNK_SIZE;
+        uint32_t chunkLength = size - chunkStart < COMPRESSION_CHUNK_SIZE ? size - chunkStart : COMPRESSION_CHUNK_SIZE;
+        uint64_t copyLength = chunkLength - chunkOffset < length - bufferOffset ? chunkLength - chunkOffset : length - bufferOffset;
+
+        //Whole chunks are decompressed straight into the buffer, anything less goes through the handle's copy of the chunk
+        if(handle->cachedChunk != chunk)
+        {
+            uint64_t want = length - bufferOffset + COMPRESSION_FRAME_HEADER_SIZE < COMPRESSION_WINDOW_SIZE ? length - bufferOffset + COMPRESSION_FRAME_HEADER_SIZE : COMPRESSION_WINDOW_SIZE;
+            if(copyLength == chunkLength)
+            {
+                if(!fs_decodeChunk(handle, &window, chunk, chunkLength, want, buffer + bufferOffset))
+                    break;
+                bufferOffset += copyLength;
+                continue;
+            }
+            handle->cachedChunk = ~0ULL;
+            handle->chunkData.resize(COMPRESSION_CHUNK_SIZE);
+            if(!fs_decodeChunk(handle, &window, chunk, chunkLength, want, handle->chunkData.data()))
+                break;
+            handle->cachedChunk = chunk;
+        }
+        memcpy(buffer + bufferOffset, &handle->chunkData[chunkOffset], copyLength);
+        bufferOffset += copyLength;
+    }
+    return bufferOffset;
+}
+
+//Writes length bytes at offset within a compressed file through a handle, extending it as needed and filling any gap past
+//the end with zeros. Each chunk written is put back together, compressed again and stored where it fits, with nothing past
+//the chunks written touched. The caller must hold the file's lock for writing. Returns the number of bytes written, which falls
+//short if the disk fills up
+uint64_t fs_writeCompressed(FileHandle *handle, uint64_t offset, const uint8_t *data, uint64_t length)
+{
+    fs_refreshHandle(handle);
+    uint64_t infoPos = fs_getCompressionInfoPosition(handle);
+    uint64_t size = fs_read64(infoPos);
+    uint64_t sizePos = fs_getWritePosition(handle->objectIndex) + NODE_SIZE_OFFSET;
+    uint64_t storedSize = fs_read64(sizePos);
+    if(length == 0 && offset <= size)
+        return 0;
+    uint64_t end = offset + length > size ? offset + length : size;
+    uint64_t firstChunk = (offset < size ? offset : size) / COMPRESSION_CHUNK_SIZE;
+    uint64_t chunkCount = (size + COMPRESSION_CHUNK_SIZE - 1) / COMPRESSION_CHUNK_SIZE;
+
+    ChunkWindow window;
+    window.start = 0;
+    std::vector<uint8_t> chunkData(COMPRESSION_CHUNK_SIZE);
+    std::vector<uint8_t> frame(COMPRESSION_FRAME_HEADER_SIZE * 2 + COMPRESSION_CHUNK_SIZE); //Room for a free frame split off after it
+    std::vector<uint8_t> frames; //New chunks waiting to be written after the end
+    uint64_t batchChunk = chunkCount; //First chunk in frames
+    uint64_t stopped = ~0ULL; //Chunk the disk filled up at
+    for(uint64_t chunk = firstChunk; chunk * COMPRESSION_CHUNK_SIZE < offset + length && stopped == ~0ULL; chunk++)
+    {
+        uint64_t chunkStart = chunk * COMPRESSION_CHUNK_SIZE;
+        uint32_t chunkLength = end - chunkStart < COMPRESSION_CHUNK_SIZE ? end - chunkStart : COMPRESSION_CHUNK_SIZE;
+        uint32_t oldLength = chunk >= chunkCount ? 0 : size - chunkStart < COMPRESSION_CHUNK_SIZE ? size - chunkStart : COMPRESSION_CHUNK_SIZE;
+        uint64_t copyStart = offset > chunkStart ? offset : chunkStart;
+        uint64_t copyEnd = offset + length < chunkStart + chunkLength ? offset + length : chunkStart + chunkLength;
+        uint64_t want = copyEnd - chunkStart + COMPRESSION_FRAME_HEADER_SIZE < COMPRESSION_WINDOW_SIZE ? copyEnd - chunkStart + COMPRESSION_FRAME_HEADER_SIZE : COMPRESSION_WINDOW_SIZE;
+        uint64_t position = ~0ULL;
+        if(chunk < chunkCount && fs_findChunk(handle, &window, chunk, want))
+            position = handle->chunkTable[chunk];
+
+        //Put the chunk back together from what was there and the data written over it. A damaged chunk is taken as zeros,
+        //which is all that can be done with it
+        if(oldLength != 0 && (copyStart > chunkStart || copyEnd < chunkStart + oldLength))
+        {
+            if(handle->cachedChunk == chunk)
+                memcpy(chunkData.data(), handle->chunkData.data(), oldLength);
+            else if(!fs_decodeChunk(handle, &window, chunk, oldLength, want, chunkData.data()))
+                oldLength = 0;
+        }
+        if(handle->cachedChunk == chunk)
+            handle->cachedChunk = ~0ULL;
+        memset(&chunkData[oldLength], 0, chunkLength - oldLength);
+        if(copyStart < copyEnd)
+            memcpy(&chunkData[copyStart - chunkStart], data + (copyStart - offset), copyEnd - copyStart);
+        uint32_t storedLength = fs_encodeChunk(chunkData.data(), chunkLength, frame.data());
+        uint32_t frameLength = COMPRESSION_FRAME_HEADER_SIZE + (storedLength & ~COMPRESSION_RAW_FRAME);
+
+        //New chunks are written after the end in batches. If the disk fills up, whatever of the batch got written is cut off again
+        if(chunk >= chunkCount)
+        {
+            fs_writeFrameHeader(frame.data(), frameLength - COMPRESSION_FRAME_HEADER_SIZE, storedLength, chunk);
+            frames.insert(frames.end(), frame.begin(), frame.begin() + frameLength);
+            if(frames.size() < COMPRESSION_WINDOW_SIZE && chunkStart + chunkLength < offset + length)
+                continue;
+            if(fs_writeAt(handle, storedSize, frames.data(), frames.size()) != frames.size())
+            {
+                fs_truncateAt(handle, storedSize);
+                stopped = batchChunk;
+                break;
+            }
+            if(handle->chunkTable.size() <= chunk)
+                handle->chunkTable.resize(chunk + 1, ~0ULL);
+            for(uint64_t framePosition = 0; framePosition < frames.size(); batchChunk++)
+            {
+                handle->chunkTable[batchChunk] = storedSize + framePosition;
+                framePosition += COMPRESSION_FRAME_HEADER_SIZE + fs_readFrameField(&frames[framePosition]);
+            }
+            storedSize += frames.size();
+            frames.clear();
+            continue;
+        }
+
+        //Work out where the chunk goes. It stays in its own frame if it fits, and the last frame grows where it is. Otherwise it
+        //moves into whichever free frame fits it best, with any room it doesn't need split off into a free frame of its own,
+        //or after the end
+        uint32_t room = 0;
+        uint32_t frameChunk;
+        if(position != ~0ULL && !fs_readFrame(handle, &window, position, storedSize, &room, &frameChunk))
+            room = 0;
+        uint32_t neededRoom = frameLength - COMPRESSION_FRAME_HEADER_SIZE;
+        uint64_t target = position;
+        uint32_t targetRoom = room;
+        uint32_t writeLength = frameLength;
+        if(neededRoom > room)
+        {
+            targetRoom = neededRoom;
+            if(room == 0 || position + COMPRESSION_FRAME_HEADER_SIZE + room != storedSize)
+            {
+                target = storedSize;
+                uint32_t bestRoom = ~0U;
+                for(uint64_t a = 0; a < handle->freeFrames.size(); a++)
+                {
+                    uint32_t freeRoom;
+                    uint32_t freeChunk;
+                    if(fs_readFrame(handle, &window, handle->freeFrames[a], storedSize, &freeRoom, &freeChunk) && freeChunk == COMPRESSION_FREE_FRAME && freeRoom < bestRoom &&
+                       (freeRoom >= neededRoom + COMPRESSION_FRAME_HEADER_SIZE || (freeRoom >= neededRoom && freeRoom <= COMPRESSION_CHUNK_SIZE)))
+                    {
+                        target = handle->freeFrames[a];
+                        bestRoom = freeRoom;
+                    }
+                }
+                if(target != storedSize)
+                {
+                    targetRoom = bestRoom;
+                    if(bestRoom >= neededRoom + COMPRESSION_FRAME_HEADER_SIZE)
+                    {
+                        targetRoom = neededRoom;
+                        fs_writeFrameHeader(&frame[frameLength], bestRoom - neededRoom - COMPRESSION_FRAME_HEADER_SIZE, 0, COMPRESSION_FREE_FRAME);
+                        writeLength += COMPRESSION_FRAME_HEADER_SIZE;
+                    }
+                }
+            }
+        }
+
+        //A frame growing at the end has its room added first, and one moving has any cluster its old frame is in copied first if
+        //it's shared, so a full disk leaves the chunk as it was
+        uint64_t frameEnd = target + COMPRESSION_FRAME_HEADER_SIZE + targetRoom;
+        if(target != position && room != 0 && !fs_unshareStoredData(handle, position, COMPRESSION_FRAME_HEADER_SIZE))
+        {
+            stopped = chunk;
+            break;
+        }
+        if(target < storedSize && frameEnd > storedSize)
+        {
+            fs_writeAt(handle, frameEnd, NULL, 0);
+            if(fs_read64(sizePos) != frameEnd)
+            {
+                fs_truncateAt(handle, storedSize);
+                stopped = chunk;
+                break;
+            }
+        }
+        fs_writeFrameHeader(frame.data(), targetRoom, storedLength, chunk);
+        if(fs_writeAt(handle, target, frame.data(), writeLength) != writeLength)
+        {
+            fs_truncateAt(handle, storedSize);
+            stopped = chunk;
+            break;
+        }
+        if(target != position && target < storedSize)
+            fs_forgetFreeFrame(handle, target);
+        if(writeLength > frameLength)
+            handle->freeFrames.push_back(target + frameLength);
+        if(frameEnd > storedSize)
+            storedSize = frameEnd;
+        if(handle->chunkTable.size() <= chunk)
+            handle->chunkTable.resize(chunk + 1, ~0ULL);
+        handle->chunkTable[chunk] = target;
+
+        //Only now the chunk is in its new frame can the old one be let go of. What the window holds may have just been written over
+        window.data.clear();
+        if(target != position && room != 0)
+            fs_freeFrame(handle, &window, position, room, storedSize);
+    }
+
+    //The file ends at the last chunk written, or where it did if that's further
+    uint64_t reached = stopped == ~0ULL ? end : stopped * COMPRESSION_CHUNK_SIZE;
+    if(reached > size)
+        size = reached;
+    uint64_t lastChunk = (size + COMPRESSION_CHUNK_SIZE - 1) / COMPRESSION_CHUNK_SIZE - 1;
+    fs_write64(infoPos, size);
+    if(size == 0)
+        fs_write64(infoPos + 8, 0);
+    else if(lastChunk < handle->chunkTable.size() && handle->chunkTable[lastChunk] != ~0ULL)
+        fs_write64(infoPos + 8, handle->chunkTable[lastChunk]);
+
+    //Other handles may remember chunks which have moved or changed, but this one has been kept in step
+    if(stopped != firstChunk)
+        handle->generation = fs_moveChainGeneration(handle->objectIndex);
+    if(reached <= offset)
+        return 0;
+    return reached - offset < length ? reached - offset : length;
+}
+
+//Appends buffers to a compressed file, which the caller must hold the lock of for writing. Returns 0 if the disk is full
+uint8_t fs_appendCompressed(uint32_t objectIndex, const struct iovec *vectors, uint32_t vectorCount)
+{
+    FileHandle *handle = fs_open(objectIndex);
+    uint8_t written = 1;
+    for(uint32_t a = 0; a < vectorCount && written; a++)
+    {
+        uint64_t size = fs_read64(fs_getCompressionInfoPosition(handle));
+        written = fs_writeCompressed(handle, size, (const uint8_t*)vectors[a].iov_base, vectors[a].iov_len) == vectors[a].iov_len;
+    }
+    fs_close(handle);
+    return written;
+}
+
+//Checks that a compressed file's frames run exactly to the end of its stored data, hold each chunk once, match its sizes, and
+//all decompress. Nothing else may be changing the file. Returns 0 if it's damaged
+uint8_t fs_checkCompressedFile(uint32_t objectIndex)
+{
+    FileHandle *handle = fs_open(objectIndex);
+    uint64_t infoPos = fs_getCompressionInfoPosition(handle);
+    uint64_t size = fs_read64(infoPos);
+    uint64_t storedSize = fs_read64(fs_getWritePosition(objectIndex) + NODE_SIZE_OFFSET);
+    uint64_t chunkCount = (size + COMPRESSION_CHUNK_SIZE - 1) / COMPRESSION_CHUNK_SIZE;
+    ChunkWindow window;
+    window.start = 0;
+    handle->chunkTable.assign(chunkCount, ~0ULL);
+    uint8_t intact = 1;
+    while(intact && handle->chunkScan < storedSize)
+        intact = fs_scanFrame(handle, &window, COMPRESSION_WINDOW_SIZE, storedSize, chunkCount);
+    for(uint64_t chunk = 0; chunk < chunkCount && intact; chunk++)
+        intact = handle->chunkTable[chunk] != ~0ULL;
+    intact = intact && fs_read64(infoPos + 8) == (chunkCount == 0 ? 0 : handle->chunkTable[chunkCount - 1]);
+    std::vector<uint8_t> chunkData(COMPRESSION_CHUNK_SIZE);
+    for(uint64_t chunk = 0; chunk < chunkCount && intact; chunk++)
+    {
+        uint64_t chunkStart = chunk * COMPRESSION_CHUNK_SIZE;
+        uint32_t chunkLength = size - chunkStart < COMPRESSION_CHUNK_SIZE ? size - chunkStart : COMPRESSION_CHUNK_SIZE;
+        intact = fs_decodeChunk(handle, &window, chunk, chunkLength, COMPRESSION_WINDOW_SIZE, chunkData.data());
+    }
+    fs_close(handle);
+    return intact;
+}
@@ -0,0 +1,94 @@
+#include "filesystem.h"
+#include <string.h>
+#include <mutex>
+
+//Directory entry cache. Maps a (directory, name) pair to the object it names, or to nothing for names known not to exist.
+//The table is direct mapped, so a new entry simply replaces whatever was in its slot. Rather than searching the table when
+//objects are freed and their clusters may be reused, the whole cache is dropped by moving onto a new generation.
+//Slots are guarded by a table of locks, each one covering every DENTRY_LOCK_COUNT'th slot.
+#define DENTRY_CACHE_SIZE 8192 //Number of cache slots, must be a power of 2
+#define DENTRY_LOCK_COUNT 64 //Number of locks guarding the slots, must be a power of 2
+#define DENTRY_NAME_LIMIT 48 //Names longer than this aren't cached
+
+struct DentryCacheEntry
+{
+    uint32_t generation; //Generation the entry was cached in, stale unless it matches the current one
+    uint32_t directoryIndex; //Directory the name was looked up in
+    uint32_t objectIndex; //Object the name refers to, 0 if it doesn't exist
+    uint32_t relativeIndex; //Index of the object relative to the directory
+    uint8_t nameLength; //Length of name
+    char name[DENTRY_NAME_LIMIT]; //Name of the object, not null terminated
+};
+
+static DentryCacheEntry dentryCache[DENTRY_CACHE_SIZE];
+static std::mutex dentryLocks[DENTRY_LOCK_COUNT];
+static uint32_t dentryGeneration = 1;
+
+//Returns the slot a directory and name map to
+static inline uint32_t fs_getDentrySlot(uint32_t directoryIndex, const char *name, uint32_t nameLength)
+{
+    uint32_t hash = fs_hashName(name, nameLength) ^ (directoryIndex * 2654435761u);
+    return hash & (DENTRY_CACHE_SIZE - 1);
+}
+
+//Looks a name up in the cache. Returns 0 on a miss, otherwise 1 with objectIndex set to 0 if the name is known not to exist
+uint8_t fs_lookupDentry(uint32_t directoryIndex, const char *name, uint32_t nameLength, uint32_t *objectIndex, uint32_t *relativeIndex)
+{
+    if(nameLength > DENTRY_NAME_LIMIT)
+        return 0;
+
+    uint32_t slot = fs_getDentrySlot(directoryIndex, name, nameLength);
+    DentryCacheEntry *entry = &dentryCache[slot];
+    std::lock_guard<std::mutex> guard(dentryLocks[slot & (DENTRY_LOCK_COUNT - 1)]);
+    if(entry->generation != __atomic_load_n(&dentryGeneration, __ATOMIC_ACQUIRE) || entry->directoryIndex != directoryIndex || entry->nameLength != nameLength || memcmp(entry->name, name, nameLength) != 0)
+        return 0;
+
+    *objectIndex = entry->objectIndex;
+    *relativeIndex = entry->relativeIndex;
+    return 1;
+}
+
+//Caches the result of looking a name up in a directory. objectIndex is 0 if the name wasn't found
+void fs_insertDentry(uint32_t directoryIndex, const char *name, uint32_t nameLength, uint32_t objectIndex, uint32_t relativeIndex)
+{
+    if(nameLength > DENTRY_NAME_LIMIT)
+        return;
+
+    uint32_t slot = fs_getDentrySlot(directoryIndex, name, nameLength);
+    DentryCacheEntry *entry = &dentryCache[slot];
+    std::lock_guard<std::mutex> guard(dentryLocks[slot & (DENTRY_LOCK_COUNT - 1)]);
+    entry->generation = __atomic_load_n(&dentryGeneration, __ATOMIC_ACQUIRE);
+    entry->directoryIndex = directoryIndex;
+    entry->objectIndex = objectIndex;
+    entry->relativeIndex = relativeIndex;
+    entry->nameLength = nameLength;
+    memcpy(entry->name, name, nameLength);
+}
+
+//Drops any cached result for a single name in a directory, used when the name is added
+void fs_invalidateDentry(uint32_t directoryIndex, const char *name, uint32_t nameLength)
+{
+    if(nameLength > DENTRY_NAME_LIMIT)
+        return;
+
+    uint32_t slot = fs_getDentrySlot(directoryIndex, name, nameLength);
+    DentryCacheEntry *entry = &dentryCache[slot];
+    std::lock_guard<std::mutex> guard(dentryLocks[slot & (DENTRY_LOCK_COUNT - 1)]);
+    if(entry->directoryIndex == directoryIndex && entry->nameLength == nameLength && memcmp(entry->name, name, nameLength) == 0)
+        entry->generation = 0;
+}
+
+//Drops everything in the cache
+void fs_invalidateDentries()
+{
+    //Generation 0 is never valid, so skip over it when wrapping around
+    if(__atomic_add_fetch(&dentryGeneration, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        for(uint32_t a = 0; a < DENTRY_LOCK_COUNT; a++)
+            dentryLocks[a].lock();
+        memset(dentryCache, 0, sizeof(dentryCache));
+        __atomic_store_n(&dentryGeneration, 1, __ATOMIC_RELEASE);
+        for(uint32_t a = 0; a < DENTRY_LOCK_COUNT; a++)
+            dentryLocks[a].unlock();
+    }
+}
@@ -0,0 +1,383 @@
+#include "filesystem.h"
+#include <string.h>
+
+//A directory index is a linear hash table mapping name hashes to directory entries. The table of bucket heads lives in a
+//contiguous run of clusters so any bucket can be found directly, and each bucket is a chain of clusters holding its entries.
+//Buckets are split one at a time as the directory grows, so no single insert has to rehash the whole directory.
+#define INDEX_LEVEL_OFFSET 0 //Number of times the bucket count has doubled past INDEX_INITIAL_LEVEL
+#define INDEX_SPLIT_OFFSET 4 //Next bucket due to be split
+#define INDEX_ENTRY_COUNT_OFFSET 8 //Number of entries in the index
+#define INDEX_TABLE_LENGTH_OFFSET 12 //Number of clusters in the bucket table run
+#define INDEX_BUCKETS_OFFSET 16 //Start of the bucket head array
+#define INDEX_ENTRY_SIZE 12 //Name hash, object index and index relative to the directory
+#define INDEX_INITIAL_LEVEL 4 //The index starts out with 2^INDEX_INITIAL_LEVEL buckets
+#define INDEX_BUCKET_LOAD 24 //Average number of entries per bucket before a bucket is split
+#define INDEX_THRESHOLD 16 //Directories are given an index once they hold this many entries
+
+//32bit FNV-1a hash of a name
+uint32_t fs_hashName(const char *name, uint32_t nameLength)
+{
+    uint32_t hash = 2166136261u;
+    for(uint32_t a = 0; a < nameLength; a++)
+    {
+        hash ^= (uint8_t)name[a];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//Returns the first cluster of a directory's index, or 0 if the directory doesn't have one
+uint32_t fs_getIndexCluster(uint32_t directoryIndex)
+{
+    return fs_read32(fs_getWritePosition(directoryIndex) + NODE_INDEX_OFFSET);
+}
+
+//Returns the number of buckets in an index
+static inline uint32_t fs_getBucketCount(uint64_t indexPos)
+{
+    return (1u << fs_read32(indexPos + INDEX_LEVEL_OFFSET)) + fs_read32(indexPos + INDEX_SPLIT_OFFSET);
+}
+
+//Returns which bucket a hash belongs in
+static inline uint32_t fs_getBucket(uint64_t indexPos, uint32_t hash)
+{
+    uint32_t level = fs_read32(indexPos + INDEX_LEVEL_OFFSET);
+    uint32_t bucket = hash & ((1u << level) - 1);
+    if(bucket < fs_read32(indexPos + INDEX_SPLIT_OFFSET)) //Already split, so use the next level's bucket
+        bucket = hash & ((2u << level) - 1);
+    return bucket;
+}
+
+//Returns the disk position of a bucket's head pointer
+static inline uint64_t fs_getBucketPosition(uint64_t indexPos, uint32_t bucket)
+{
+    return indexPos + INDEX_BUCKETS_OFFSET + ((uint64_t)bucket * 4);
+}
+
+//Frees every cluster in a bucket chain
+static void fs_freeBucket(uint32_t clusterIndex)
+{
+    while(clusterIndex != 0)
+    {
+        uint32_t next = fs_read32(fs_getWritePosition(clusterIndex) + 4);
+        fs_freeCluster(clusterIndex);
+        clusterIndex = next;
+    }
+}
+
+//Frees a directory's index, leaving it to be searched linearly
+void fs_freeDirectoryIndex(uint32_t directoryIndex)
+{
+    uint32_t indexCluster = fs_getIndexCluster(directoryIndex);
+    if(indexCluster == 0)
+        return;
+
+    uint64_t indexPos = fs_getWritePosition(indexCluster);
+    uint32_t bucketCount = fs_getBucketCount(indexPos);
+    for(uint32_t a = 0; a < bucketCount; a++)
+        fs_freeBucket(fs_read32(fs_getBucketPosition(indexPos, a)));
+    fs_freeRun(indexCluster, fs_read32(indexPos + INDEX_TABLE_LENGTH_OFFSET));
+    fs_write32(fs_getWritePosition(directoryIndex) + NODE_INDEX_OFFSET, 0);
+}
+
+//Adds every cluster of a directory's index onto a list, for freeing along with the directory
+void fs_collectIndexClusters(uint32_t directoryIndex, std::vector<uint32_t> *clusters)
+{
+    uint32_t indexCluster = fs_getIndexCluster(directoryIndex);
+    if(indexCluster == 0)
+        return;
+
+    uint64_t indexPos = fs_getWritePosition(indexCluster);
+    uint32_t bucketCount = fs_getBucketCount(indexPos);
+    for(uint32_t a = 0; a < bucketCount; a++)
+        for(uint32_t clusterIndex = fs_read32(fs_getBucketPosition(indexPos, a)); clusterIndex != 0; clusterIndex = fs_read32(fs_getWritePosition(clusterIndex) + 4))
+            clusters->push_back(clusterIndex);
+    uint32_t tableLength = fs_read32(indexPos + INDEX_TABLE_LENGTH_OFFSET);
+    for(uint32_t a = 0; a < tableLength; a++)
+        clusters->push_back(indexCluster + a);
+}
+
+//Gets the length of a directory's bucket table run and the first cluster of each bucket, without following the buckets, for
+//checking an index which may be damaged. Returns 0 if the directory has no index or its header doesn't fit in the disk
+uint8_t fs_getIndexLayout(uint32_t directoryIndex, uint32_t *tableLength, std::vector<uint32_t> *bucketHeads)
+{
+    uint32_t indexCluster = fs_getIndexCluster(directoryIndex);
+    if(indexCluster < superblock.firstDataCluster || indexCluster >= CLUSTER_COUNT)
+        return 0;
+
+    uint64_t indexPos = fs_getWritePosition(indexCluster);
+    uint32_t level = fs_read32(indexPos + INDEX_LEVEL_OFFSET);
+    *tableLength = fs_read32(indexPos + INDEX_TABLE_LENGTH_OFFSET);
+    if(level >= 31 || fs_read32(indexPos + INDEX_SPLIT_OFFSET) > (1u << level) || *tableLength == 0 || *tableLength > CLUSTER_COUNT - indexCluster)
+        return 0;
+    uint32_t bucketCount = fs_getBucketCount(indexPos);
+    if(INDEX_BUCKETS_OFFSET + ((uint64_t)bucketCount * 4) > fs_getWritePosition(*tableLength))
+        return 0;
+
+    bucketHeads->clear();
+    for(uint32_t a = 0; a < bucketCount; a++)
+        bucketHeads->push_back(fs_read32(fs_getBucketPosition(indexPos, a)));
+    return 1;
+}
+
+//Adds an entry to the front cluster of a bucket, prepending a new cluster if it's full. Returns 0 if the disk is full
+static uint8_t fs_addBucketEntry(uint64_t indexPos, uint32_t bucket, uint32_t hash, uint32_t objectIndex, uint32_t relativeIndex)
+{
+    uint64_t bucketPos = fs_getBucketPosition(indexPos, bucket);
+    uint32_t clusterIndex = fs_read32(bucketPos);
+    uint32_t clusterLength = clusterIndex != 0 ? fs_read32(fs_getWritePosition(clusterIndex)) : CLUSTER_SIZE;
+
+    //Only the front cluster of a bucket can have free space, so start a new one if it's full
+    if(clusterLength + INDEX_ENTRY_SIZE > CLUSTER_SIZE)
+    {
+        uint32_t newCluster = fs_allocateClusterNear(indexPos / CLUSTER_SIZE);
+        if(newCluster == 0)
+            return 0;
+        ClusterHeader header;
+        header.clusterLength = CLUSTER_HEADER_SIZE;
+        header.next = clusterIndex;
+        fs_writeClusterHeader(newCluster, &header);
+        fs_write32(bucketPos, newCluster);
+        clusterIndex = newCluster;
+        clusterLength = CLUSTER_HEADER_SIZE;
+    }
+
+    uint64_t writePos = fs_getWritePosition(clusterIndex);
+    fs_write32(writePos + clusterLength, hash);
+    fs_write32(writePos + clusterLength + 4, objectIndex);
+    fs_write32(writePos + clusterLength + 8, relativeIndex);
+    fs_write32(writePos, clusterLength + INDEX_ENTRY_SIZE);
+    return 1;
+}
+
+//Doubles the size of the bucket table run. Returns 0 if the disk has no contiguous space for it
+static uint8_t fs_growBucketTable(uint32_t directoryIndex)
+{
+    uint32_t indexCluster = fs_getIndexCluster(directoryIndex);
+    uint64_t indexPos = fs_getWritePosition(indexCluster);
+    uint32_t tableLength = fs_read32(indexPos + INDEX_TABLE_LENGTH_OFFSET);
+
+    uint32_t newCluster;
+    uint32_t newLength = fs_allocateRunNear(tableLength * 2, &newCluster, indexCluster);
+    if(newLength < tableLength * 2)
+    {
+        if(newLength != 0)
+            fs_freeRun(newCluster, newLength);
+        return 0;
+    }
+
+    //Copy the table over and record the new length
+    uint64_t newPos = fs_getWritePosition(newCluster);
+    for(uint64_t a = 0; a < (uint64_t)tableLength * CLUSTER_SIZE; a += 4)
+        fs_write32(newPos + a, fs_read32(indexPos + a));
+    fs_write32(newPos + INDEX_TABLE_LENGTH_OFFSET, newLength);
+
+    fs_freeRun(indexCluster, tableLength);
+    fs_write32(fs_getWritePosition(directoryIndex) + NODE_INDEX_OFFSET, newCluster);
+    return 1;
+}
+
+//Splits the next bucket in line, moving roughly half its entries into a new bucket at the end of the table. Returns 0 if the disk is full
+static uint8_t fs_splitBucket(uint32_t directoryIndex)
+{
+    uint64_t indexPos = fs_getWritePosition(fs_getIndexCluster(directoryIndex));
+
+    //Make sure there's room in the table for one more bucket
+    uint32_t bucketCount = fs_getBucketCount(indexPos);
+    uint64_t tableSize = (uint64_t)fs_read32(indexPos + INDEX_TABLE_LENGTH_OFFSET) * CLUSTER_SIZE;
+    if(INDEX_BUCKETS_OFFSET + ((uint64_t)(bucketCount + 1) * 4) > tableSize)
+    {
+        if(!fs_growBucketTable(directoryIndex))
+            return 0;
+        indexPos = fs_getWritePosition(fs_getIndexCluster(directoryIndex));
+    }
+
+    //Detach the bucket being split and move the split pointer on, so entries are rehashed with the next level
+    uint32_t level = fs_read32(indexPos + INDEX_LEVEL_OFFSET);
+    uint32_t split = fs_read32(indexPos + INDEX_SPLIT_OFFSET);
+    uint32_t clusterIndex = fs_read32(fs_getBucketPosition(indexPos, split));
+    fs_write32(fs_getBucketPosition(indexPos, split), 0);
+    fs_write32(fs_getBucketPosition(indexPos, bucketCount), 0);
+    if(split + 1 == (1u << level))
+    {
+        fs_write32(indexPos + INDEX_LEVEL_OFFSET, level + 1);
+        fs_write32(indexPos + INDEX_SPLIT_OFFSET, 0);
+    }
+    else
+    {
+        fs_write32(indexPos + INDEX_SPLIT_OFFSET, split + 1);
+    }
+
+    //Reinsert each entry of the old bucket, freeing its clusters as they're emptied
+    uint8_t success = 1;
+    while(clusterIndex != 0)
+    {
+        uint64_t writePos = fs_getWritePosition(clusterIndex);
+        uint32_t clusterLength = fs_read32(writePos);
+        for(uint32_t a = CLUSTER_HEADER_SIZE; a < clusterLength && success; a += INDEX_ENTRY_SIZE)
+        {
+            uint32_t hash = fs_read32(writePos + a);
+            success = fs_addBucketEntry(indexPos, fs_getBucket(indexPos, hash), hash, fs_read32(writePos + a + 4), fs_read32(writePos + a + 8));
+        }
+        uint32_t next = fs_read32(writePos + 4);
+        fs_freeCluster(clusterIndex);
+        clusterIndex = next;
+    }
+    return success;
+}
+
+//Adds an object to a directory's index. If the index can't be grown it's dropped, so the directory falls back to a linear search
+void fs_addIndexEntry(uint32_t directoryIndex, uint32_t objectIndex, uint32_t relativeIndex)
+{
+    uint32_t indexCluster = fs_getIndexCluster(directoryIndex);
+    if(indexCluster == 0)
+    {
+        //Index directories once they're big enough for a linear search to hurt. This also upgrades older directories
+        if(fs_getDirectorySize(directoryIndex) >= INDEX_THRESHOLD)
+            fs_buildDirectoryIndex(directoryIndex);
+        return;
+    }
+
+    uint64_t indexPos = fs_getWritePosition(indexCluster);
+    const char *name = (const char*)fs_getDataPointer(fs_getWritePosition(objectIndex) + NODE_NAME_OFFSET);
+    uint32_t hash = fs_hashName(name, strlen(name));
+    if(!fs_addBucketEntry(indexPos, fs_getBucket(indexPos, hash), hash, objectIndex, relativeIndex))
+    {
+        fs_freeDirectoryIndex(directoryIndex);
+        return;
+    }
+
+    //Split a bucket once the average bucket is over its load
+    uint32_t entryCount = fs_read32(indexPos + INDEX_ENTRY_COUNT_OFFSET) + 1;
+    fs_write32(indexPos + INDEX_ENTRY_COUNT_OFFSET, entryCount);
+    if(entryCount > fs_getBucketCount(indexPos) * INDEX_BUCKET_LOAD && !fs_splitBucket(directoryIndex))
+        fs_freeDirectoryIndex(directoryIndex);
+}
+
+//Returns the disk position of an object's entry in an index, or 0 if it isn't there. The bucket holding it is returned through bucket
+static uint64_t fs_findBucketEntry(uint64_t indexPos, uint32_t objectIndex, uint32_t relativeIndex, uint32_t *bucket)
+{
+    const char *name = (const char*)fs_getDataPointer(fs_getWritePosition(objectIndex) + NODE_NAME_OFFSET);
+    uint32_t hash = fs_hashName(name, strlen(name));
+    *bucket = fs_getBucket(indexPos, hash);
+    for(uint32_t clusterIndex = fs_read32(fs_getBucketPosition(indexPos, *bucket)); clusterIndex != 0; clusterIndex = fs_read32(fs_getWritePosition(clusterIndex) + 4))
+    {
+        uint64_t writePos = fs_getWritePosition(clusterIndex);
+        uint32_t clusterLength = fs_read32(writePos);
+        for(uint32_t a = CLUSTER_HEADER_SIZE; a < clusterLength; a += INDEX_ENTRY_SIZE)
+            if(fs_read32(writePos + a) == hash && fs_read32(writePos + a + 4) == objectIndex && fs_read32(writePos + a + 8) == relativeIndex)
+                return writePos + a;
+    }
+    return 0;
+}
+
+//Removes an object from a directory's index
+void fs_removeIndexEntry(uint32_t directoryIndex, uint32_t objectIndex, uint32_t relativeIndex)
+{
+    uint32_t indexCluster = fs_getIndexCluster(directoryIndex);
+    if(indexCluster == 0)
+        return;
+
+    uint64_t indexPos = fs_getWritePosition(indexCluster);
+    uint32_t bucket;
+    uint64_t entryPos = fs_findBucketEntry(indexPos, objectIndex, relativeIndex, &bucket);
+    if(entryPos == 0)
+        return;
+
+    //Fill the hole with the last entry in the front cluster of the bucket, so that only the front cluster is ever partly full
+    uint64_t bucketPos = fs_getBucketPosition(indexPos, bucket);
+    uint32_t frontCluster = fs_read32(bucketPos);
+    uint64_t frontPos = fs_getWritePosition(frontCluster);
+    uint32_t frontLength = fs_read32(frontPos) - INDEX_ENTRY_SIZE;
+    for(uint32_t a = 0; a < INDEX_ENTRY_SIZE; a += 4)
+        fs_write32(entryPos + a, fs_read32(frontPos + frontLength + a));
+    fs_write32(frontPos, frontLength);
+
+    //Free the front cluster if it's now empty
+    if(frontLength == CLUSTER_HEADER_SIZE)
+    {
+        fs_write32(bucketPos, fs_read32(frontPos + 4));
+        fs_freeCluster(frontCluster);
+    }
+    fs_write32(indexPos + INDEX_ENTRY_COUNT_OFFSET, fs_read32(indexPos + INDEX_ENTRY_COUNT_OFFSET) - 1);
+}
+
+//Records that an object has moved to a new place in its directory
+void fs_moveIndexEntry(uint32_t directoryIndex, uint32_t objectIndex, uint32_t oldRelativeIndex, uint32_t newRelativeIndex)
+{
+    uint32_t indexCluster = fs_getIndexCluster(directoryIndex);
+    if(indexCluster == 0)
+        return;
+
+    uint32_t bucket;
+    uint64_t entryPos = fs_findBucketEntry(fs_getWritePosition(indexCluster), objectIndex, oldRelativeIndex, &bucket);
+    if(entryPos != 0)
+        fs_write32(entryPos + 8, newRelativeIndex);
+}
+
+//Looks a name up in a directory's index. Returns 0 if the name isn't in the directory
+uint8_t fs_findIndexEntry(uint32_t directoryIndex, const char *name, uint32_t nameLength, uint32_t *objectIndex, uint32_t *relativeIndex)
+{
+    uint64_t indexPos = fs_getWritePosition(fs_getIndexCluster(directoryIndex));
+    uint32_t hash = fs_hashName(name, nameLength);
+    uint32_t bucket = fs_getBucket(indexPos, hash);
+
+    for(uint32_t clusterIndex = fs_read32(fs_getBucketPosition(indexPos, bucket)); clusterIndex != 0; clusterIndex = fs_read32(fs_getWritePosition(clusterIndex) + 4))
+    {
+        uint64_t writePos = fs_getWritePosition(clusterIndex);
+        uint32_t clusterLength = fs_read32(writePos);
+        for(uint32_t a = CLUSTER_HEADER_SIZE; a < clusterLength; a += INDEX_ENTRY_SIZE)
+        {
+            if(fs_read32(writePos + a) != hash)
+                continue;
+
+            //Hashes match, make sure the name does too
+            uint32_t node = fs_read32(writePos + a + 4);
+            if(fs_isNamed(node, name, nameLength))
+            {
+                *objectIndex = node;
+                *relativeIndex = fs_read32(writePos + a + 8);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+//Creates an index for a directory from its existing entries. Returns 0 if there isn't enough space
+uint8_t fs_buildDirectoryIndex(uint32_t directoryIndex)
+{
+    fs_freeDirectoryIndex(directoryIndex);
+
+    //Set up an empty table, kept next to the directory
+    uint32_t indexCluster = fs_allocateClusterNear(directoryIndex);
+    if(indexCluster == 0)
+        return 0;
+    uint64_t indexPos = fs_getWritePosition(indexCluster);
+    fs_write32(indexPos + INDEX_LEVEL_OFFSET, INDEX_INITIAL_LEVEL);
+    fs_write32(indexPos + INDEX_SPLIT_OFFSET, 0);
+    fs_write32(indexPos + INDEX_ENTRY_COUNT_OFFSET, 0);
+    fs_write32(indexPos + INDEX_TABLE_LENGTH_OFFSET, 1);
+    for(uint32_t a = 0; a < (1u << INDEX_INITIAL_LEVEL); a++)
+        fs_write32(fs_getBucketPosition(indexPos, a), 0);
+    fs_write32(fs_getWritePosition(directoryIndex) + NODE_INDEX_OFFSET, indexCluster);
+
+    //Add every entry but the parent, which is always entry 0
+    ClusterSpanIterator iterator;
+    fs_beginSpans(directoryIndex, &iterator);
+    const uint8_t *span;
+    uint32_t spanLength;
+    uint32_t relativeIndex = 0;
+    while(fs_nextSpan(&iterator, &span, &spanLength))
+    {
+        for(uint32_t a = 0; a < spanLength; a += DIRECTORY_ENTRY_SIZE, relativeIndex++)
+        {
+            if(relativeIndex == 0)
+                continue;
+            fs_addIndexEntry(directoryIndex, intConcatL(span[a], span[a + 1], span[a + 2], span[a + 3]), relativeIndex);
+            if(fs_getIndexCluster(directoryIndex) == 0) //Ran out of space and the index was dropped
+                return 0;
+        }
+    }
+    return 1;
+}
@@ -1,5 +1,8 @@
 #include "filesystem.h"
 #include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <unordered_set>
 
 //Writes a cluster header
 void fs_writeClusterHeader(uint32_t index, ClusterHeader *header)
@@ -21,7 +24,7 @@ void fs_writeNodeHeader(uint32_t index, NodeHeader *header)
     uint64_t writePos = fs_getWritePosition(index);
 
     //Write type
-    fs_write8(writePos + 8, header->type); //Skip over the cluster header
+    fs_write8(writePos + 8, header->type | header->flags); //Skip over the cluster header
 
     //Write permissions
     fs_write32(writePos + 9, header->permissions);
@@ -32,436 +35,2140 @@ void fs_writeNodeHeader(uint32_t index, NodeHeader *header)
     else
         fs_write16(writePos + 13, header->nameLength + 1);
 
+    //Write object size and last cluster
+    fs_write64(writePos + NODE_SIZE_OFFSET, header->size);
+    fs_write32(writePos + NODE_TAIL_OFFSET, header->tailCluster);
+    fs_write32(writePos + NODE_INDEX_OFFSET, header->indexCluster);
+
     //Write the name itself
     for(uint16_t a = 0; a < header->nameLength; a++)
-        fs_write8(writePos + 15 + a, header->nameData[a]);
+        fs_write8(writePos + NODE_NAME_OFFSET + a, header->nameData[a]);
 
     if(header->nameData[header->nameLength-1] != '\0') //Add in a null terminating character as none is provided
-        fs_write8(writePos + 15 + header->nameLength, '\0');
+        fs_write8(writePos + NODE_NAME_OFFSET + header->nameLength, '\0');
+}
+
+//Reads a cluster header into a new object, which must be deleted
+ClusterHeader *fs_readClusterHeader(uint32_t index)
+{
+    return new ClusterHeader(fs_getClusterHeader(index));
+}
+
+//Reads a node header into a new object, which must be freed with fs_freeNodeHeader
+NodeHeader *fs_readNodeHeader(uint32_t index)
+{
+    NodeHeaderView view = fs_getNodeHeader(index);
+
+    //Create new object to store data, with its own copy of the name
+    NodeHeader *header = new NodeHeader;
+    header->type = view.type;
+    header->flags = view.flags;
+    header->permissions = view.permissions;
+    header->nameLength = view.nameLength;
+    header->size = view.size;
+    header->tailCluster = view.tailCluster;
+    header->indexCluster = view.indexCluster;
+    header->nameData = new uint8_t[header->nameLength];
+    memcpy(header->nameData, view.nameData, header->nameLength);
+    return header;
+}
+
+//Reads a cluster header
+ClusterHeader fs_getClusterHeader(uint32_t index)
+{
+    uint64_t writePos = fs_getWritePosition(index);
+    ClusterHeader header;
+    header.clusterLength = fs_read32(writePos);
+    header.next = fs_read32(writePos + 4);
+    return header;
+}
+
+//Reads a node header without copying the name, which is left pointing at the disk
+NodeHeaderView fs_getNodeHeader(uint32_t index)
+{
+    uint64_t writePos = fs_getWritePosition(index);
+    NodeHeaderView header;
+    uint8_t type = fs_read8(writePos + 8); //Skip over cluster header
+    header.type = type & NODE_TYPE_MASK;
+    header.flags = type & ~NODE_TYPE_MASK;
+    header.permissions = fs_read32(writePos + 9);
+    header.nameLength = fs_read16(writePos + 13);
+    header.size = fs_read64(writePos + NODE_SIZE_OFFSET);
+    header.tailCluster = fs_read32(writePos + NODE_TAIL_OFFSET);
+    header.indexCluster = fs_read32(writePos + NODE_INDEX_OFFSET);
+    header.nameData = fs_getDataPointer(writePos + NODE_NAME_OFFSET);
+    return header;
+}
+
+Superblock superblock;
+uint8_t *disk = NULL;
+static BlockDevice *mountedDevice = NULL;
+
+//The clusters are divided into groups of ALLOCATION_GROUP_SIZE, each with its own cursor and count of free clusters.
+//Objects are placed in the same group as their directory and files grow from their last cluster, so related clusters stay
+//close together, while threads creating unrelated objects start out in different groups and don't fight over one cursor
+struct AllocationGroup
+{
+    uint32_t cursor; //Cluster of the most recent allocation in the group, only a hint so it's read and written without locking
+    uint32_t freeCount; //Number of free clusters in the group
+    uint8_t runsChanged; //Set when a cluster changes state, so the free runs below need measuring again
+    uint32_t leadingFree; //Free clusters at the start of the group, as last measured
+    uint32_t trailingFree; //Free clusters at the end of the group
+    uint32_t largestFree; //Longest run of free clusters within the group
+};
+
+static std::vector<AllocationGroup> allocationGroups;
+static uint32_t nextPreferredGroup = 0; //Group handed out to the next thread to allocate
+static thread_local uint32_t preferredGroup = ~0U; //Group the current thread allocates from when there's nothing to go near
+static uint32_t freeClusterCount = 0; //Number of free clusters on the whole disk
+static uint32_t objectCount = 0; //Number of files and directories on the disk
+static std::mutex statsLock; //Serialises measuring the free runs of groups for fs_statfs
+
+static void fs_freeClusterChain(uint32_t index);
+static uint32_t fs_readDirectoryEntry(uint32_t directoryIndex, uint32_t objectIndex);
+static uint32_t fs_walkTree(uint32_t objectIndex, std::vector<uint32_t> *clusters);
+static uint32_t fs_appendClusters(uint32_t objectIndex, uint32_t count);
+static void fs_appendDirectoryEntry(uint32_t directoryIndex, uint32_t objectIndex);
+static uint8_t fs_removeDirectoryEntry(uint32_t directoryIndex, uint32_t objectIndex);
+static uint8_t fs_appendData(uint32_t objectIndex, const struct iovec *vectors, uint32_t vectorCount, uint32_t *firstNew);
+
+//In-memory summary of the allocation table, a set bit means every cluster in that allocation word is in use.
+//It's only a hint while other threads are allocating, so the allocation words themselves have the final say
+static std::vector<uint64_t> allocationSummary;
+
+//The allocation table is updated with atomic operations, so it's accessed directly rather than through the block cache.
+//On a mapped device it's used in place, otherwise a copy is loaded at mount and its changed clusters written back on sync
+static uint64_t *allocationTable = NULL;
+static std::vector<uint64_t> allocationTableCopy;
+static std::vector<uint8_t> allocationTableDirty; //One flag per cluster of the copied table, set when it's changed
+
+//Returns a word of the allocation table. The table starts on a cluster boundary, so every word is aligned and can be updated atomically
+static inline uint64_t *fs_getAllocationWordPointer(uint32_t word)
+{
+    return &allocationTable[word];
+}
+
+//Notes that a word of a copied allocation table needs writing back
+static inline void fs_dirtyAllocationWord(uint32_t word)
+{
+    if(disk == NULL)
+        __atomic_store_n(&allocationTableDirty[((uint64_t)word * 8) >> superblock.clusterShift], 1, __ATOMIC_RELAXED);
+}
+
+//Writes the changed clusters of a copied allocation table back to the device as one batch. Returns 0 on failure
+static uint8_t fs_writeBackAllocationTable()
+{
+    std::vector<struct iovec> vectors(allocationTableDirty.size());
+    std::vector<BlockRequest> requests;
+    for(uint32_t a = 0; a < allocationTableDirty.size(); a++)
+    {
+        if(!__atomic_exchange_n(&allocationTableDirty[a], 0, __ATOMIC_RELAXED))
+            continue;
+        vectors[a].iov_base = (uint8_t*)allocationTable + fs_getWritePosition(a);
+        vectors[a].iov_len = CLUSTER_SIZE;
+        BlockRequest request;
+        request.position = fs_getWritePosition(superblock.allocationTableCluster + a);
+        request.vectors = &vectors[a];
+        request.vectorCount = 1;
+        requests.push_back(request);
+    }
+    return requests.empty() || mountedDevice->writeBatch(&requests[0], requests.size());
+}
+
+//Hands the journal a copy of each changed cluster of a copied allocation table, as it becomes part of the transaction being committed
+void fs_collectAllocationChanges(std::vector<uint32_t> *clusters, std::vector<uint8_t> *images)
+{
+    for(uint32_t a = 0; a < allocationTableDirty.size(); a++)
+    {
+        if(!__atomic_exchange_n(&allocationTableDirty[a], 0, __ATOMIC_RELAXED))
+            continue;
+        uint8_t *data = (uint8_t*)allocationTable + fs_getWritePosition(a);
+        clusters->push_back(superblock.allocationTableCluster + a);
+        images->insert(images->end(), data, data + CLUSTER_SIZE);
+    }
+}
+
+//Converts an allocation word between the little endian order it's stored in and the host's order
+static inline uint64_t fs_toAllocationOrder(uint64_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+//Reads a 64bit word of the allocation table. Bit n of word w is the state of cluster (w * 64) + n
+static inline uint64_t fs_readAllocationWord(uint32_t word)
+{
+    return fs_toAllocationOrder(__atomic_load_n(fs_getAllocationWordPointer(word), __ATOMIC_ACQUIRE));
+}
+
+//Brings the summary bit for an allocation word up to date after the word has changed. The word is checked again
+//afterwards, as another thread may have changed it in between and had its summary update overwritten by this one
+static void fs_updateAllocationSummary(uint32_t word)
+{
+    uint64_t *summary = &allocationSummary[word / 64];
+    uint64_t bit = 1ULL << (word % 64);
+    uint64_t value;
+    do
+    {
+        value = fs_readAllocationWord(word);
+        if(value == ~0ULL)
+            __atomic_fetch_or(summary, bit, __ATOMIC_SEQ_CST);
+        else
+            __atomic_fetch_and(summary, ~bit, __ATOMIC_SEQ_CST);
+    } while(fs_readAllocationWord(word) != value);
+}
+
+//Keeps the free cluster counts up to date after clusters in an allocation word have been claimed or released
+static inline void fs_countAllocationChange(uint32_t word, int32_t freeChange)
+{
+    AllocationGroup *group = &allocationGroups[word / ALLOCATION_GROUP_WORDS];
+    fs_dirtyAllocationWord(word);
+    __atomic_fetch_add(&group->freeCount, freeChange, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&freeClusterCount, freeChange, __ATOMIC_RELAXED);
+    __atomic_store_n(&group->runsChanged, 1, __ATOMIC_RELAXED);
+}
+
+//Atomically marks the clusters in mask as used, as long as they're all free. Returns 0 without changing anything otherwise
+static uint8_t fs_claimAllocationBits(uint32_t word, uint64_t mask)
+{
+    uint64_t *pointer = fs_getAllocationWordPointer(word);
+    uint64_t expected = __atomic_load_n(pointer, __ATOMIC_ACQUIRE);
+    do
+    {
+        if(fs_toAllocationOrder(expected) & mask)
+            return 0;
+    } while(!__atomic_compare_exchange_n(pointer, &expected, expected | fs_toAllocationOrder(mask), true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    fs_countAllocationChange(word, -__builtin_popcountll(mask));
+    if(superblock.features & FEATURE_JOURNAL)
+        fs_journalClaimed(word * 64, mask);
+    if((fs_toAllocationOrder(expected) | mask) == ~0ULL)
+        fs_updateAllocationSummary(word);
+    return 1;
+}
+
+//Atomically marks the lowest free cluster in an allocation word as used. Returns its bit, or 64 if the word is full
+static uint32_t fs_claimFreeAllocationBit(uint32_t word)
+{
+    uint64_t *pointer = fs_getAllocationWordPointer(word);
+    uint64_t expected = __atomic_load_n(pointer, __ATOMIC_ACQUIRE);
+    uint32_t bit;
+    do
+    {
+        uint64_t value = fs_toAllocationOrder(expected);
+        if(value == ~0ULL)
+            return 64;
+        bit = __builtin_ctzll(~value);
+    } while(!__atomic_compare_exchange_n(pointer, &expected, expected | fs_toAllocationOrder(1ULL << bit), true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    fs_countAllocationChange(word, -1);
+    if(superblock.features & FEATURE_JOURNAL)
+        fs_journalClaimed(word * 64, 1ULL << bit);
+    if((fs_toAllocationOrder(expected) | (1ULL << bit)) == ~0ULL)
+        fs_updateAllocationSummary(word);
+    return bit;
+}
+
+//Atomically marks the clusters in mask as free
+static void fs_releaseAllocationBits(uint32_t word, uint64_t mask)
+{
+    uint64_t previous = fs_toAllocationOrder(__atomic_fetch_and(fs_getAllocationWordPointer(word), ~fs_toAllocationOrder(mask), __ATOMIC_ACQ_REL));
+    fs_countAllocationChange(word, __builtin_popcountll(previous & mask));
+    if(superblock.features & FEATURE_CHECKSUMS)
+        fs_forgetChecksums(word * 64, previous & mask);
+    if(superblock.features & FEATURE_JOURNAL)
+        fs_journalReleased(word * 64, previous & mask);
+    if(previous == ~0ULL)
+        fs_updateAllocationSummary(word);
+}
+
+//Rebuilds the in-memory allocation summary and allocation groups from the allocation table on disk
+static void fs_rebuildAllocationSummary()
+{
+    allocationSummary.assign((superblock.allocationWordCount + 63) / 64, 0);
+    allocationGroups.resize((superblock.allocationWordCount + ALLOCATION_GROUP_WORDS - 1) / ALLOCATION_GROUP_WORDS);
+    for(uint32_t a = 0; a < allocationGroups.size(); a++)
+    {
+        allocationGroups[a].cursor = a == 0 ? superblock.firstDataCluster : a * ALLOCATION_GROUP_SIZE;
+        allocationGroups[a].freeCount = 0;
+        allocationGroups[a].runsChanged = 1;
+    }
+
+    //Padding bits past the last cluster are always set, so they're never counted as free
+    freeClusterCount = 0;
+    for(uint32_t a = 0; a < superblock.allocationWordCount; a++)
+    {
+        uint64_t value = fs_readAllocationWord(a);
+        allocationGroups[a / ALLOCATION_GROUP_WORDS].freeCount += __builtin_popcountll(~value);
+        freeClusterCount += __builtin_popcountll(~value);
+        if(value == ~0ULL)
+            allocationSummary[a / 64] |= 1ULL << (a % 64);
+    }
+
+    //Summary bits past the end of the table are never free
+    for(uint32_t a = superblock.allocationWordCount; a < allocationSummary.size() * 64; a++)
+        allocationSummary[a / 64] |= 1ULL << (a % 64);
+}
+
+//Finds an allocation word with at least one free cluster from startWord up to endWord. Returns endWord if there isn't one
+static uint32_t fs_findFreeAllocationWord(uint32_t startWord, uint32_t endWord)
+{
+    uint32_t word = startWord;
+    while(word < endWord)
+    {
+        uint64_t freeWords = ~__atomic_load_n(&allocationSummary[word / 64], __ATOMIC_RELAXED) >> (word % 64);
+        if(freeWords != 0)
+        {
+            word += __builtin_ctzll(freeWords);
+            return word < endWord ? word : endWord;
+        }
+        word = (word / 64 + 1) * 64;
+    }
+    return endWord;
+}
+
+//Fills in the parts of the superblock which aren't stored on disk. Returns 0 if the geometry doesn't make sense
+static uint8_t fs_setGeometry(Superblock *header)
+{
+    if(header->clusterSize < MIN_CLUSTER_SIZE || header->clusterSize > MAX_CLUSTER_SIZE || (header->clusterSize & (header->clusterSize - 1)) != 0)
+        return 0;
+    header->clusterShift = __builtin_ctz(header->clusterSize);
+    header->allocationWordCount = ((uint64_t)header->clusterCount + 63) / 64;
+    return 1;
+}
+
+//Writes the superblock into cluster 0
+static void fs_writeSuperblock()
+{
+    fs_write32(0, superblock.magic);
+    fs_write32(4, superblock.version);
+    fs_write32(8, superblock.clusterSize);
+    fs_write32(12, superblock.clusterCount);
+    fs_write32(16, superblock.allocationTableCluster);
+    fs_write32(20, superblock.allocationTableLength);
+    fs_write32(24, superblock.firstDataCluster);
+    fs_write32(28, superblock.rootDirectory);
+    fs_write32(32, superblock.freeClusters);
+    fs_write32(36, superblock.objectCount);
+    fs_write32(40, superblock.features);
+    fs_write32(44, superblock.checksumTableCluster);
+    fs_write32(48, superblock.checksumTableLength);
+    fs_write32(52, superblock.journalCluster);
+    fs_write32(56, superblock.journalLength);
+    fs_write32(60, superblock.referenceTableCluster);
+    fs_write32(64, superblock.referenceTableLength);
+}
+
+//Records the free cluster and object counts as they stand in the superblock, so they're there for anything reading the disk
+void fs_recordCounts()
+{
+    superblock.freeClusters = __atomic_load_n(&freeClusterCount, __ATOMIC_RELAXED);
+    superblock.objectCount = __atomic_load_n(&objectCount, __ATOMIC_RELAXED);
+    fs_writeSuperblock();
+}
+
+//Forgets a device which couldn't be attached. Nothing has been written to it yet, so the cache is dropped as it is. Returns 0
+static uint8_t fs_detachDevice()
+{
+    fs_closeCache();
+    mountedDevice = NULL;
+    disk = NULL;
+    allocationTable = NULL;
+    return 0;
+}
+
+//Attaches a device, resetting everything which is cached about the previously mounted disk. Devices which can't be mapped
+//are accessed through the block cache, with the allocation table loaded into memory unless it's about to be formatted.
+//Returns 0 if one of the tables couldn't be read, in which case the device is detached again
+static uint8_t fs_attachDevice(BlockDevice *device, uint8_t loadTable)
+{
+    mountedDevice = device;
+    disk = device->getMapping();
+    if(disk != NULL)
+    {
+        allocationTable = (uint64_t*)&disk[fs_getWritePosition(superblock.allocationTableCluster)];
+        allocationTableCopy.clear();
+        allocationTableDirty.clear();
+    }
+    else
+    {
+        fs_openCache(device);
+        uint64_t tableSize = fs_getWritePosition(superblock.allocationTableLength);
+        allocationTableCopy.assign(tableSize / 8, 0);
+        allocationTableDirty.assign(superblock.allocationTableLength, 0);
+        allocationTable = &allocationTableCopy[0];
+        if(loadTable && !device->read(fs_getWritePosition(superblock.allocationTableCluster), (uint8_t*)allocationTable, tableSize))
+            return fs_detachDevice();
+    }
+    if(!fs_openChecksums(device, loadTable) || !fs_openReferences(device, loadTable))
+        return fs_detachDevice();
+    fs_openJournal(device);
+    fs_rebuildAllocationSummary();
+    fs_invalidateDentries();
+    return 1;
+}
+
+//Reads and checks the superblock of a device. Returns 0 if the device isn't formatted or the superblock doesn't make sense
+static uint8_t fs_readSuperblock(BlockDevice *device, Superblock *header)
+{
+    //Read the geometry of the disk from the superblock. Every field is stored little endian, in the order fs_writeSuperblock writes them
+    uint8_t stored[SUPERBLOCK_SIZE];
+    if(!device->read(0, stored, SUPERBLOCK_SIZE))
+        return 0;
+    uint32_t *fields[SUPERBLOCK_SIZE / 4] = {&header->magic, &header->version, &header->clusterSize, &header->clusterCount,
+                                             &header->allocationTableCluster, &header->allocationTableLength, &header->firstDataCluster,
+                                             &header->rootDirectory, &header->freeClusters, &header->objectCount, &header->features,
+                                             &header->checksumTableCluster, &header->checksumTableLength, &header->journalCluster,
+                                             &header->journalLength, &header->referenceTableCluster, &header->referenceTableLength};
+    for(uint32_t a = 0; a < SUPERBLOCK_SIZE / 4; a++)
+        *fields[a] = intConcatL(stored[a * 4], stored[a * 4 + 1], stored[a * 4 + 2], stored[a * 4 + 3]);
+    if(header->magic != SUPERBLOCK_MAGIC || header->version > FORMAT_VERSION || !fs_setGeometry(header))
+        return 0;
+    if(((uint64_t)header->clusterCount << header->clusterShift) > device->getSize() || header->firstDataCluster >= header->clusterCount)
+        return 0;
+
+    //The allocation table has to sit between the superblock and the data, and be big enough for every cluster. The root
+    //directory has to be one of the data clusters
+    if(header->allocationTableCluster == 0 || (uint64_t)header->allocationTableCluster + header->allocationTableLength > header->firstDataCluster ||
+       ((uint64_t)header->allocationTableLength << header->clusterShift) < (uint64_t)header->allocationWordCount * 8)
+        return 0;
+    if(header->rootDirectory < header->firstDataCluster || header->rootDirectory >= header->clusterCount)
+        return 0;
+
+    //Older disks have no optional features, and the superblock ends before them. Features this version doesn't know about
+    //could be broken by writing to the disk, so those disks are refused
+    if(header->version < FEATURES_VERSION)
+        header->features = 0;
+    if(!(header->features & FEATURE_CHECKSUMS))
+    {
+        header->checksumTableCluster = 0;
+        header->checksumTableLength = 0;
+    }
+    if(!(header->features & FEATURE_JOURNAL))
+    {
+        header->journalCluster = 0;
+        header->journalLength = 0;
+    }
+    if(!(header->features & FEATURE_CLONES))
+    {
+        header->referenceTableCluster = 0;
+        header->referenceTableLength = 0;
+    }
+    if(header->features & ~KNOWN_FEATURES)
+        return 0;
+    if((header->features & FEATURE_CHECKSUMS) && (header->checksumTableCluster == 0 ||
+                                                  (uint64_t)header->checksumTableCluster + header->checksumTableLength > header->firstDataCluster ||
+                                                  ((uint64_t)header->checksumTableLength << header->clusterShift) < (uint64_t)header->clusterCount * 4))
+        return 0;
+    if((header->features & FEATURE_JOURNAL) && (header->journalCluster == 0 || header->journalLength < JOURNAL_MIN_LENGTH ||
+                                                (uint64_t)header->journalCluster + header->journalLength > header->firstDataCluster))
+        return 0;
+    if((header->features & FEATURE_CLONES) && (header->referenceTableCluster == 0 ||
+                                               (uint64_t)header->referenceTableCluster + header->referenceTableLength > header->firstDataCluster ||
+                                               ((uint64_t)header->referenceTableLength << header->clusterShift) < (uint64_t)header->clusterCount * 4))
+        return 0;
+    return 1;
+}
+
+//Mounts a block device holding a filesystem created by fs_formatDisk. Returns 0 if the device can't be used or isn't formatted.
+//A disk with a journal is only journaled on a device without a mapping, which goes through the block cache
+uint8_t fs_mount(BlockDevice *device)
+{
+    if(device->getSize() < SUPERBLOCK_SIZE)
+        return 0;
+    Superblock header;
+    if(!fs_readSuperblock(device, &header))
+        return 0;
+
+    //Finish anything the journal holds before looking at the rest of the disk, which includes the superblock itself
+    if(header.features & FEATURE_JOURNAL)
+    {
+        if(!fs_replayJournal(device, &header) || !fs_readSuperblock(device, &header))
+            return 0;
+    }
+
+    superblock = header;
+    if(!fs_attachDevice(device, 1))
+        return 0;
+
+    //The free count is rebuilt from the allocation table, but objects have to be counted from the superblock. Older
+    //disks don't record it, so count everything reachable from the root once and upgrade the superblock on the next sync.
+    //Only to version 2 though, as existing node headers keep their fixed size
+    if(superblock.version < 2)
+    {
+        superblock.objectCount = fs_walkTree(superblock.rootDirectory, NULL);
+        superblock.version = 2;
+    }
+    objectCount = superblock.objectCount;
+    return 1;
+}
+
+//Writes everything out and detaches the mounted device, which is returned for the caller to delete
+BlockDevice *fs_unmount()
+{
+    BlockDevice *device = mountedDevice;
+    fs_checkpoint();
+    fs_stopJournal();
+    fs_closeCache();
+    mountedDevice = NULL;
+    disk = NULL;
+    allocationTable = NULL;
+    return device;
+}
+
+//Makes sure all changes to the mounted device have reached stable storage. Returns 0 on failure
+uint8_t fs_sync()
+{
+    if(mountedDevice == NULL)
+        return 0;
+
+    //With the journal running, everything up to now is made durable by committing it
+    if(fs_isJournalActive())
+        return fs_commit();
+    fs_recordCounts();
+
+    //Without a mapping, changes are held in memory until they're written back here
+    uint8_t success = 1;
+    if(disk == NULL)
+    {
+        success &= fs_writeBackAllocationTable();
+        success &= fs_flushCache();
+    }
+
+    //Checksums of clusters written since the last sync are brought up to date once everything else has been written out
+    success &= fs_syncReferences();
+    success &= fs_syncChecksums();
+    return mountedDevice->sync() && success;
+}
+
+//Installs the filesystem on a device with the given geometry, creating an empty root directory, and mounts it.
+//A clusterCount of 0 uses the whole device. Returns 0 if the geometry doesn't fit the device
+uint8_t fs_formatDisk(BlockDevice *device, uint32_t clusterSize, uint32_t clusterCount)
+{
+    return fs_formatDiskWithFeatures(device, clusterSize, clusterCount, 0);
+}
+
+//Formats a device like fs_formatDisk, with the optional parts of the format given by features
+uint8_t fs_formatDiskWithFeatures(BlockDevice *device, uint32_t clusterSize, uint32_t clusterCount, uint32_t features)
+{
+    if(features & ~KNOWN_FEATURES)
+        return 0;
+    Superblock header;
+    header.magic = SUPERBLOCK_MAGIC;
+    header.version = FORMAT_VERSION;
+    header.clusterSize = clusterSize;
+    header.clusterCount = clusterCount;
+    if(!fs_setGeometry(&header))
+        return 0;
+    if(clusterCount == 0)
+    {
+        uint64_t deviceClusters = device->getSize() >> header.clusterShift;
+        header.clusterCount = deviceClusters > 0xFFFFFFFF ? 0xFFFFFFFF : deviceClusters;
+        fs_setGeometry(&header);
+    }
+
+    //Cluster 0 holds the superblock, which is followed by the allocation table, then the checksum table, the reference table
+    //and the journal if there are any
+    header.allocationTableCluster = 1;
+    header.allocationTableLength = (((uint64_t)header.allocationWordCount * 8) + clusterSize - 1) / clusterSize;
+    header.features = features;
+    header.checksumTableCluster = 0;
+    header.checksumTableLength = 0;
+    if(features & FEATURE_CHECKSUMS)
+    {
+        header.checksumTableCluster = header.allocationTableCluster + header.allocationTableLength;
+        header.checksumTableLength = (((uint64_t)header.clusterCount * 4) + clusterSize - 1) / clusterSize;
+    }
+    header.referenceTableCluster = 0;
+    header.referenceTableLength = 0;
+    if(features & FEATURE_CLONES)
+    {
+        header.referenceTableCluster = header.allocationTableCluster + header.allocationTableLength + header.checksumTableLength;
+        header.referenceTableLength = (((uint64_t)header.clusterCount * 4) + clusterSize - 1) / clusterSize;
+    }
+    header.journalCluster = 0;
+    header.journalLength = 0;
+    if(features & FEATURE_JOURNAL)
+    {
+        uint64_t journalLength = header.clusterCount / JOURNAL_FRACTION;
+        if(journalLength > JOURNAL_MAX_SIZE / clusterSize)
+            journalLength = JOURNAL_MAX_SIZE / clusterSize;
+        if(journalLength < JOURNAL_MIN_LENGTH)
+            journalLength = JOURNAL_MIN_LENGTH;
+        header.journalCluster = header.allocationTableCluster + header.allocationTableLength + header.checksumTableLength + header.referenceTableLength;
+        header.journalLength = journalLength & ~1ULL;
+    }
+    header.firstDataCluster = header.allocationTableCluster + header.allocationTableLength + header.checksumTableLength + header.referenceTableLength +
+                              header.journalLength;
+    header.rootDirectory = 0;
+    header.freeClusters = 0;
+    header.objectCount = 0;
+    if(((uint64_t)header.clusterCount << header.clusterShift) > device->getSize() || (uint64_t)header.firstDataCluster + 1 >= header.clusterCount)
+        return 0;
+    //A disk being formatted has nothing on it for a crash to spoil, so it's written in place and the journal only starts afterwards
+    superblock = header;
+    superblock.features &= ~FEATURE_JOURNAL;
+    if(!fs_attachDevice(device, 0))
+        return 0;
+    superblock.features = header.features;
+    if(!fs_emptyJournal())
+        return 0;
+
+    //Mark every cluster as free
+    uint8_t *table = (uint8_t*)allocationTable;
+    memset(table, 0, fs_getWritePosition(superblock.allocationTableLength));
+
+    //Reserve the superblock and the clusters holding the tables and the journal
+    for(uint32_t a = 0; a < superblock.firstDataCluster; a++)
+        table[a / 8] |= 1 << (a % 8);
+
+    //Bits past the last cluster don't refer to real clusters, so mark them as used
+    for(uint64_t a = superblock.clusterCount; a < (uint64_t)superblock.allocationWordCount * 64; a++)
+        table[a / 8] |= 1 << (a % 8);
+
+    fs_rebuildAllocationSummary();
+    if(disk == NULL)
+        allocationTableDirty.assign(superblock.allocationTableLength, 1);
+    objectCount = 0;
+
+    //Create the root directory, which is its own parent
+    uint8_t rootName[] = "root";
+    superblock.rootDirectory = fs_createObject(NODE_DIRECTORY, 0, 4, rootName);
+    fs_addObjectToDirectory(superblock.rootDirectory, superblock.rootDirectory);
+    superblock.freeClusters = freeClusterCount;
+    superblock.objectCount = objectCount;
+    fs_writeSuperblock();
+
+    //The journal is found through the superblock, so a journaled disk starts out with everything in place
+    if(disk != NULL || !(superblock.features & FEATURE_JOURNAL))
+        return 1;
+    uint8_t success = fs_sync();
+    fs_openJournal(device);
+    return success;
+}
+
+//Returns the index of the mounted disk's root directory
+uint32_t fs_getRootDirectory()
+{
+    return superblock.rootDirectory;
+}
+
+//Returns the index of the last cluster in use, so everything past it can be left out of a disk image
+uint32_t fs_getHighestUsedCluster()
+{
+    //The padding bits at the very end are always set, so mask them off
+    for(uint32_t word = superblock.allocationWordCount; word-- > 0;)
+    {
+        uint64_t value = fs_readAllocationWord(word);
+        if(word == superblock.allocationWordCount - 1 && CLUSTER_COUNT % 64 != 0)
+            value &= (1ULL << (CLUSTER_COUNT % 64)) - 1;
+        if(value != 0)
+            return (word * 64) + 63 - __builtin_clzll(value);
+    }
+    return 0;
+}
+
+//Returns the state of a cluster in the allocation table
+uint8_t fs_getClusterState(uint32_t index)
+{
+    return (fs_readAllocationWord(index / 64) >> (index % 64)) & 1 ? CLUSTER_USED : CLUSTER_FREE;
+}
+
+//Marks a single cluster as free in the allocation table
+void fs_freeCluster(uint32_t index)
+{
+    fs_releaseAllocationBits(index / 64, 1ULL << (index % 64));
+}
+
+//Returns the group the current thread allocates from, handing each thread its own group the first time it asks
+uint32_t fs_getPreferredGroup()
+{
+    if(preferredGroup == ~0U)
+        preferredGroup = __atomic_fetch_add(&nextPreferredGroup, 1, __ATOMIC_RELAXED);
+    return preferredGroup % allocationGroups.size();
+}
+
+//Returns the number of allocation groups on the mounted disk
+uint32_t fs_getAllocationGroupCount()
+{
+    return allocationGroups.size();
+}
+
+//Returns the extent and fill of an allocation group
+AllocationGroupInfo fs_getAllocationGroupInfo(uint32_t group)
+{
+    AllocationGroupInfo info;
+    info.firstCluster = group * ALLOCATION_GROUP_SIZE;
+    info.clusterCount = CLUSTER_COUNT - info.firstCluster < ALLOCATION_GROUP_SIZE ? CLUSTER_COUNT - info.firstCluster : ALLOCATION_GROUP_SIZE;
+    info.freeClusters = __atomic_load_n(&allocationGroups[group].freeCount, __ATOMIC_RELAXED);
+    return info;
+}
+
+//Returns the cluster the next allocation in a group should start searching from
+static inline uint32_t fs_getGroupCursor(uint32_t group)
+{
+    return __atomic_load_n(&allocationGroups[group].cursor, __ATOMIC_RELAXED);
+}
+
+//Measures the runs of free clusters in a group, clearing its changed flag first so any change made during the scan is picked up next time
+static void fs_measureGroupRuns(uint32_t group)
+{
+    AllocationGroup *info = &allocationGroups[group];
+    __atomic_store_n(&info->runsChanged, 0, __ATOMIC_SEQ_CST);
+
+    uint32_t firstWord = group * ALLOCATION_GROUP_WORDS;
+    uint32_t endWord = firstWord + ALLOCATION_GROUP_WORDS < superblock.allocationWordCount ? firstWord + ALLOCATION_GROUP_WORDS : superblock.allocationWordCount;
+    uint32_t runLength = 0;
+    uint32_t leading = 0;
+    uint32_t largest = 0;
+    uint8_t atStart = 1;
+    for(uint32_t word = firstWord; word < endWord; word++)
+    {
+        uint64_t value = fs_readAllocationWord(word);
+        if(value == 0)
+        {
+            runLength += 64;
+            continue;
+        }
+        for(uint32_t bit = 0; bit < 64; bit++)
+        {
+            if(!((value >> bit) & 1))
+            {
+                runLength++;
+                continue;
+            }
+            if(atStart)
+                leading = runLength;
+            atStart = 0;
+            largest = runLength > largest ? runLength : largest;
+            runLength = 0;
+        }
+    }
+
+    //A group with nothing in use is one run from start to end
+    info->leadingFree = atStart ? runLength : leading;
+    info->trailingFree = runLength;
+    info->largestFree = runLength > largest ? runLength : largest;
+}
+
+//Returns how full the disk is. Everything but the largest free run is kept up to date as clusters are claimed and
+//released. The free runs of each group are measured again only if something in it has changed since the last call
+FilesystemStats fs_statfs()
+{
+    FilesystemStats stats;
+    stats.clusterSize = CLUSTER_SIZE;
+    stats.totalClusters = CLUSTER_COUNT - superblock.firstDataCluster;
+    stats.freeClusters = __atomic_load_n(&freeClusterCount, __ATOMIC_RELAXED);
+    stats.usedClusters = stats.totalClusters - stats.freeClusters;
+    stats.objectCount = __atomic_load_n(&objectCount, __ATOMIC_RELAXED);
+
+    //Runs can carry on from the end of one group into the next
+    std::lock_guard<std::mutex> guard(statsLock);
+    uint32_t runLength = 0;
+    stats.largestFreeRun = 0;
+    for(uint32_t a = 0; a < allocationGroups.size(); a++)
+    {
+        if(__atomic_load_n(&allocationGroups[a].runsChanged, __ATOMIC_SEQ_CST))
+            fs_measureGroupRuns(a);
+        AllocationGroup *group = &allocationGroups[a];
+        if(group->largestFree > stats.largestFreeRun)
+            stats.largestFreeRun = group->largestFree;
+
+        //Unless the whole group is free, the run carried in ends here and a new one starts at the end of the group
+        runLength += group->leadingFree;
+        if(group->leadingFree != fs_getAllocationGroupInfo(a).clusterCount)
+        {
+            if(runLength > stats.largestFreeRun)
+                stats.largestFreeRun = runLength;
+            runLength = group->trailingFree;
+        }
+    }
+    if(runLength > stats.largestFreeRun)
+        stats.largestFreeRun = runLength;
+    return stats;
+}
+
+//Takes a free cluster from a group, searching from goal to the end of the group and then from the start. Returns 0 if the group is full
+static uint32_t fs_allocateInGroup(uint32_t group, uint32_t goal)
+{
+    if(__atomic_load_n(&allocationGroups[group].freeCount, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    uint32_t firstWord = group * ALLOCATION_GROUP_WORDS;
+    uint32_t endWord = firstWord + ALLOCATION_GROUP_WORDS < superblock.allocationWordCount ? firstWord + ALLOCATION_GROUP_WORDS : superblock.allocationWordCount;
+    uint32_t goalWord = goal / 64;
+    for(uint32_t pass = 0; pass < 2; pass++)
+    {
+        uint32_t word = pass == 0 ? goalWord : firstWord;
+        uint32_t passEnd = pass == 0 ? endWord : goalWord;
+        while((word = fs_findFreeAllocationWord(word, passEnd)) != passEnd)
+        {
+            //Take the lowest free cluster in the word. Another thread may have filled it since the summary was checked, so move on if so
+            uint32_t bit = fs_claimFreeAllocationBit(word);
+            if(bit != 64)
+            {
+                //Store this cluster position for future allocations
+                __atomic_store_n(&allocationGroups[group].cursor, (word * 64) + bit, __ATOMIC_RELAXED);
+                return (word * 64) + bit;
+            }
+            word++;
+        }
+    }
+    return 0;
+}
+
+//Find a new cluster to use, as close after goal as possible. Returns 0 if the disk is full
+uint32_t fs_allocateClusterNear(uint32_t goal)
+{
+    //Don't bother searching a full disk
+    if(__atomic_load_n(&freeClusterCount, __ATOMIC_RELAXED) == 0)
+        return 0;
+    if(goal >= CLUSTER_COUNT)
+        goal = superblock.firstDataCluster;
+
+    //Try the goal's group first, then move on through the others
+    uint32_t group = goal / ALLOCATION_GROUP_SIZE;
+    for(uint32_t a = 0; a < allocationGroups.size(); a++)
+    {
+        uint32_t cluster = fs_allocateInGroup(group, a == 0 ? goal : fs_getGroupCursor(group));
+        if(cluster != 0)
+            return cluster;
+        if(++group == allocationGroups.size())
+            group = 0;
+    }
+
+    //Uh oh, no free clusters found. Return 0 to indicate failure.
+    return 0;
+}
+
+//Find a new cluster to use in the current thread's group
+uint32_t fs_allocateCluster()
+{
+    return fs_allocateClusterNear(fs_getGroupCursor(fs_getPreferredGroup()));
+}
+
+//Sets or clears the allocation bits for count clusters starting at first. Clusters are only marked as used if they're
+//all free, otherwise nothing is changed and 0 is returned
+static uint8_t fs_markClusterRange(uint32_t first, uint32_t count, uint8_t state)
+{
+    uint32_t marked = 0;
+    while(marked < count)
+    {
+        uint32_t bit = (first + marked) % 64;
+        uint32_t bits = 64 - bit < count - marked ? 64 - bit : count - marked;
+        uint64_t mask = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << bit;
+
+        if(state == CLUSTER_FREE)
+            fs_releaseAllocationBits((first + marked) / 64, mask);
+        else if(!fs_claimAllocationBits((first + marked) / 64, mask))
+        {
+            //Another thread got part of the range first, so give back the part that was claimed
+            fs_markClusterRange(first, marked, CLUSTER_FREE);
+            return 0;
+        }
+        marked += bits;
+    }
+    return 1;
+}
+
+//Finds a run of up to count free clusters in a sweep of the allocation table starting from goal, without reserving it. Once
+//FREE_RUN_SEARCH_WORDS words with free clusters have been looked at without finding count in a row, the longest run seen so far
+//is settled for, so a fragmented disk costs a bounded search rather than a sweep of the whole table. Returns the run length
+static uint32_t fs_findFreeRun(uint32_t count, uint32_t *first, uint32_t goal)
+{
+    uint32_t runStart = 0, runLength = 0; //Free run which reaches the end of the previous word
+    uint32_t bestStart = 0, bestLength = 0;
+    uint32_t startWord = goal / 64;
+    uint32_t searched = 0; //Words with free clusters looked at so far
+
+    //Sweep from the goal to the end of the table, then wrap around to cover the beginning
+    for(uint32_t pass = 0; pass < 2 && bestLength < count && (searched < FREE_RUN_SEARCH_WORDS || bestLength == 0); pass++)
+    {
+        uint32_t word = pass == 0 ? startWord : 0;
+        uint32_t endWord = pass == 0 ? superblock.allocationWordCount : startWord + 1;
+        runLength = 0; //Runs can't wrap around the end of the disk
+
+        while(word < endWord)
+        {
+            //Skip over full words using the summary, as they can only break a run
+            uint64_t summary = __atomic_load_n(&allocationSummary[word / 64], __ATOMIC_RELAXED);
+            if((summary >> (word % 64)) & 1)
+            {
+                runLength = 0;
+                word = summary == ~0ULL ? (word / 64 + 1) * 64 : word + 1;
+                continue;
+            }
+
+            //Clusters before the goal are left for the second pass, so a run can carry straight on from it
+            uint64_t freeBits = ~fs_readAllocationWord(word);
+            if(pass == 0 && word == startWord)
+                freeBits &= ~0ULL << (goal % 64);
+            uint32_t bit = 0;
+            while(bit < 64)
+            {
+                uint64_t remaining = freeBits >> bit;
+                if(remaining == 0) //No more free clusters in this word
+                {
+                    runLength = 0;
+                    break;
+                }
+
+                //Skip used clusters, which ends any run in progress
+                uint32_t skip = __builtin_ctzll(remaining);
+                if(skip != 0)
+                {
+                    runLength = 0;
+                    bit += skip;
+                    remaining >>= skip;
+                }
+
+                //Measure the free clusters from here
+                uint32_t length = ~remaining == 0 ? 64 : __builtin_ctzll(~remaining);
+                if(runLength == 0)
+                    runStart = (word * 64) + bit;
+                runLength += length;
+                bit += length;
+
+                if(runLength > bestLength)
+                {
+                    bestStart = runStart;
+                    bestLength = runLength;
+                    if(bestLength >= count)
+                        break;
+                }
+            }
+
+            if(bestLength >= count || (++searched >= FREE_RUN_SEARCH_WORDS && bestLength != 0))
+                break;
+            word++;
+        }
+    }
+
+    *first = bestStart;
+    return bestLength < count ? bestLength : count;
+}
+
+//Finds and reserves a run of up to count physically contiguous clusters in the current thread's group
+uint32_t fs_allocateRun(uint32_t count, uint32_t *first)
+{
+    return fs_allocateRunNear(count, first, fs_getGroupCursor(fs_getPreferredGroup()));
+}
+
+//Finds and reserves a run of up to count physically contiguous clusters, searching the allocation table from goal. If no run of
+//count clusters turns up, the longest run found is reserved instead. Returns the run length, or 0 if the disk is full
+uint32_t fs_allocateRunNear(uint32_t count, uint32_t *first, uint32_t goal)
+{
+    if(count == 0 || __atomic_load_n(&freeClusterCount, __ATOMIC_RELAXED) == 0)
+        return 0;
+    if(goal >= CLUSTER_COUNT)
+        goal = superblock.firstDataCluster;
+
+    //If another thread takes part of the run before it can be reserved, search again
+    while(true)
+    {
+        uint32_t length = fs_findFreeRun(count, first, goal);
+
+        //Uh oh, no free clusters found. Return 0 to indicate failure.
+        if(length == 0)
+            return 0;
+
+        if(fs_markClusterRange(*first, length, CLUSTER_USED))
+        {
+            //Store this cluster position for future allocations
+            uint32_t last = *first + length - 1;
+            __atomic_store_n(&allocationGroups[last / ALLOCATION_GROUP_SIZE].cursor, last, __ATOMIC_RELAXED);
+            return length;
+        }
+    }
+}
+
+//Creates an object in the current thread's allocation group
+uint32_t fs_createObject(uint8_t type, uint32_t permissions, uint16_t nameLength, uint8_t *name)
+{
+    return fs_createObjectNear(fs_getGroupCursor(fs_getPreferredGroup()), type, permissions, nameLength, name);
+}
+
+//Creates an object in the same allocation group as another, usually the directory it's going to be added to. A file can be
+//created with NODE_COMPRESSED added to its type on disks formatted with FEATURE_COMPRESSION
+uint32_t fs_createObjectNear(uint32_t nearIndex, uint8_t type, uint32_t permissions, uint16_t nameLength, uint8_t *name)
+{
+    //The name is stored with a null terminator, and has to fit in the longest node header
+    if(nameLength == 0)
+        return 0;
+    uint32_t storedLength = name[nameLength - 1] == '\0' ? nameLength : nameLength + 1;
+    if(NODE_NAME_OFFSET + storedLength > HEADER_SIZE)
+        return 0;
+    uint8_t flags = type & ~NODE_TYPE_MASK;
+    type &= NODE_TYPE_MASK;
+    if(flags != 0 && (flags != NODE_COMPRESSED || type != NODE_FILE || !(superblock.features & FEATURE_COMPRESSION)))
+        return 0;
+
+    //Allocate a cluster for the object, carrying on from the last allocation in the group
+    fs_beginOperation();
+    uint32_t group = nearIndex < CLUSTER_COUNT ? nearIndex / ALLOCATION_GROUP_SIZE : 0;
+    uint32_t cluster = fs_allocateClusterNear(fs_getGroupCursor(group));
+
+    //If we failed to allocate a new cluster, return 0
+    if(cluster == 0)
+    {
+        fs_endOperation();
+        return 0;
+    }
+
+    //Prepare cluster header for the new object, its data starts straight after the name, or after a compressed file's sizes
+    ClusterHeader clusterHeader;
+    clusterHeader.clusterLength = superblock.version < PACKED_HEADER_VERSION ? HEADER_SIZE : fs_getPackedHeaderSize(storedLength);
+    if(flags & NODE_COMPRESSED)
+        clusterHeader.clusterLength += NODE_COMPRESSION_INFO_LENGTH;
+    clusterHeader.next = 0;
+
+    //Convert function arguments into a structure
+    NodeHeader nodeHeader;
+    nodeHeader.type = type;
+    nodeHeader.flags = flags;
+    nodeHeader.permissions = permissions;
+    nodeHeader.nameLength = nameLength;
+    nodeHeader.size = 0;
+    nodeHeader.tailCluster = cluster;
+    nodeHeader.indexCluster = 0;
+    nodeHeader.nameData = name;
+
+    //Write the cluster header and node header to disk
+    fs_writeClusterHeader(cluster, &clusterHeader);
+    fs_writeNodeHeader(cluster, &nodeHeader);
+    if(flags & NODE_COMPRESSED)
+    {
+        fs_write64(fs_getWritePosition(cluster) + clusterHeader.clusterLength - NODE_COMPRESSION_INFO_LENGTH, 0);
+        fs_write64(fs_getWritePosition(cluster) + clusterHeader.clusterLength - NODE_COMPRESSION_INFO_LENGTH + 8, 0);
+    }
+    __atomic_fetch_add(&objectCount, 1, __ATOMIC_RELAXED);
+    fs_endOperation();
+
+    return cluster; //Return the index of the newly created cluster
+}
+
+uint8_t fs_getDirectoryClusterFromObjectIndex(uint32_t *directoryIndex, uint32_t *objectIndex, uint32_t *clusterSize) //These long names are killing me
+{
+    //Find the cluster which the object index is stored in within the directory
+    *clusterSize = fs_getHeaderSize(*directoryIndex);
+    ClusterHeader directoryHeader = fs_getClusterHeader(*directoryIndex);
+    while(*clusterSize + (*objectIndex * DIRECTORY_ENTRY_SIZE) >= directoryHeader.clusterLength) //Keep going until the index is within the current cluster
+    {
+        if(directoryHeader.next == 0) //If there's no next cluster, index out of range, return 0.
+            return 0;
+
+        //Else move onto next cluster within the directory
+        *directoryIndex = directoryHeader.next;
+
+        //Reduce the objectIndex by the total storable within a directory as that's how many we've skipepd over
+        *objectIndex -= (directoryHeader.clusterLength - *clusterSize) / DIRECTORY_ENTRY_SIZE;
+        *clusterSize = CLUSTER_HEADER_SIZE;
+
+        directoryHeader = fs_getClusterHeader(*directoryIndex);
+    }
+    return 1;
+}
+
+
+//Returns cluster location of an object, the index is relative to the directory NOT the disk
+uint32_t fs_getDirectoryObject(uint32_t directoryIndex, uint32_t objectIndex)
+{
+    fs_lockObject(directoryIndex, 0);
+    uint32_t object = fs_readDirectoryEntry(directoryIndex, objectIndex);
+    fs_unlockObject(directoryIndex, 0);
+    return object;
+}
+
+//Returns an entry of a directory, which the caller must hold the lock for
+static uint32_t fs_readDirectoryEntry(uint32_t directoryIndex, uint32_t objectIndex)
+{
+    //Get which cluster of the directory the object is in
+    uint32_t clusterHeaderSize;
+    if(fs_getDirectoryClusterFromObjectIndex(&directoryIndex, &objectIndex, &clusterHeaderSize) == 0)
+        return 0;
+
+    //Get the file index of the directory and combine the bytes into a single uint32_t
+    uint64_t writePos = fs_getWritePosition(directoryIndex);
+    return fs_read32(writePos + clusterHeaderSize + (objectIndex * DIRECTORY_ENTRY_SIZE));
+}
+
+
+//Extend an object with another cluster
+uint32_t fs_extendCluster(uint32_t objectIndex)
+{
+    return fs_extendClusterRun(objectIndex, 1);
+}
+
+//Extend an object with count more clusters, taken from contiguous runs where possible. Returns the first new cluster, or 0 on failure
+uint32_t fs_extendClusterRun(uint32_t objectIndex, uint32_t count)
+{
+    fs_beginOperation();
+    fs_lockObject(objectIndex, 1);
+    uint32_t firstNew = 0;
+    if(fs_unshareClusters(objectIndex, ~0U, ~0U, NULL))
+        firstNew = fs_appendClusters(objectIndex, count);
+    fs_unlockObject(objectIndex, 1);
+    fs_endOperation();
+    return firstNew;
+}
+
+//Adds count clusters onto the end of an object, which the caller must hold the lock for. The new clusters are linked together,
+//and on from the last cluster unless the object is a mapped file, which lists them in its map instead.
+//Returns the first new cluster, or 0 on failure
+static uint32_t fs_appendClusters(uint32_t objectIndex, uint32_t count)
+{
+    uint32_t firstNew = 0;
+    uint8_t mapped = fs_isMapped(objectIndex);
+    uint32_t originalEnd = fs_getTailCluster(objectIndex);
+    uint32_t clusterIndex = originalEnd;
+    ClusterHeader clusterHeader;
+    while(count > 0)
+    {
+        //Reserve as much of the remaining length in one run as possible
+        uint32_t first;
+        //Carry straight on from the end of the object if there's space
+        uint32_t length = fs_allocateRunNear(count, &first, clusterIndex + 1);
+        if(length == 0)
+        {
+            //Out of space, give back anything reserved so far so the object is left as it was
+            if(firstNew != 0)
+            {
+                fs_freeClusterChain(firstNew);
+                if(!mapped)
+                {
+                    clusterHeader.clusterLength = fs_read32(fs_getWritePosition(originalEnd));
+                    clusterHeader.next = 0;
+                    fs_writeClusterHeader(originalEnd, &clusterHeader);
+                }
+            }
+            return 0;
+        }
+
+        //Point the end of the object at the start of the run
+        if(clusterIndex != originalEnd || !mapped)
+        {
+            clusterHeader.clusterLength = fs_read32(fs_getWritePosition(clusterIndex));
+            clusterHeader.next = first;
+            fs_writeClusterHeader(clusterIndex, &clusterHeader);
+        }
+        if(firstNew == 0)
+            firstNew = first;
+
+        //Chain the clusters of the run together, each one starting out empty
+        clusterHeader.clusterLength = CLUSTER_HEADER_SIZE;
+        for(uint32_t a = 0; a < length; a++)
+        {
+            clusterHeader.next = a + 1 < length ? first + a + 1 : 0;
+            fs_writeClusterHeader(first + a, &clusterHeader);
+        }
+
+        clusterIndex = first + length - 1;
+        count -= length;
+    }
+    if(mapped && !fs_extendClusterMap(objectIndex, firstNew))
+    {
+        fs_freeClusterChain(firstNew);
+        return 0;
+    }
+
+    //Record the new last cluster in the object's header
+    fs_write32(fs_getWritePosition(objectIndex) + NODE_TAIL_OFFSET, clusterIndex);
+
+    //Return the first newly allocated cluster index
+    return firstNew;
+}
+
+//Add an object to a directory
+void fs_addObjectToDirectory(uint32_t directoryIndex, uint32_t objectIndex)
+{
+    fs_beginOperation();
+    fs_lockObject(directoryIndex, 1);
+    fs_appendDirectoryEntry(directoryIndex, objectIndex);
+    fs_unlockObject(directoryIndex, 1);
+    fs_endOperation();
+}
+
+//Adds an entry onto the end of a directory, which the caller must hold the lock for
+static void fs_appendDirectoryEntry(uint32_t directoryIndex, uint32_t objectIndex)
+{
+    //Entries are always added to the end of the directory, extending it if the last cluster is full
+    uint32_t clusterIndex = fs_getTailCluster(directoryIndex);
+    uint32_t clusterLength = fs_read32(fs_getWritePosition(clusterIndex));
+    if(clusterLength == CLUSTER_SIZE)
+    {
+        clusterIndex = fs_appendClusters(directoryIndex, 1);
+        if(clusterIndex == 0)
+            return;
+        clusterLength = CLUSTER_HEADER_SIZE;
+    }
+
+    //Add the object in and update the cluster size on disk
+    uint64_t writePos = fs_getWritePosition(clusterIndex);
+    fs_write32(writePos + clusterLength, objectIndex);
+    fs_write32(writePos, clusterLength + DIRECTORY_ENTRY_SIZE);
+
+    //Update the directory size
+    uint64_t headerPos = fs_getWritePosition(directoryIndex);
+    uint64_t directorySize = fs_read64(headerPos + NODE_SIZE_OFFSET);
+    fs_write64(headerPos + NODE_SIZE_OFFSET, directorySize + DIRECTORY_ENTRY_SIZE);
+
+    //Forget any cached miss for the name
+    const char *name = (const char*)fs_getDataPointer(fs_getWritePosition(objectIndex) + NODE_NAME_OFFSET);
+    fs_invalidateDentry(directoryIndex, name, strlen(name));
+
+    //Add it to the directory's index, the parent entry is never indexed
+    uint32_t relativeIndex = directorySize / DIRECTORY_ENTRY_SIZE;
+    if(relativeIndex != 0)
+        fs_addIndexEntry(directoryIndex, objectIndex, relativeIndex);
+}
+
+//Remove an object from a directory. Note: Wont free object, will just unlist from THIS directory.
+//The directory's last entry is moved into its place, and the parent entry at index 0 can't be removed
+uint8_t fs_removeObjectFromDirectory(uint32_t directoryIndex, uint32_t objectIndex)
+{
+    fs_beginOperation();
+    fs_lockObject(directoryIndex, 1);
+    uint8_t removed = fs_removeDirectoryEntry(directoryIndex, objectIndex);
+    fs_unlockObject(directoryIndex, 1);
+    fs_endOperation();
+    return removed;
 }
 
-//Reads a cluster header
-ClusterHeader *fs_readClusterHeader(uint32_t index)
+//Removes an object from a directory by what it is rather than where it's listed, as removing other entries moves entries
+//around. Won't free the object. Returns 0 if it isn't listed there
+uint8_t fs_unlistObject(uint32_t directoryIndex, uint32_t objectIndex)
 {
-    //Create new object to store data
-    ClusterHeader *header = new ClusterHeader;
+    fs_beginOperation();
+    fs_lockObject(directoryIndex, 1);
+    uint8_t removed = 0;
+    uint32_t entries = fs_getDirectorySize(directoryIndex);
+    for(uint32_t a = 1; a < entries && !removed; a++)
+        if(fs_readDirectoryEntry(directoryIndex, a) == objectIndex)
+            removed = fs_removeDirectoryEntry(directoryIndex, a);
+    fs_unlockObject(directoryIndex, 1);
+    fs_endOperation();
+    return removed;
+}
 
-    //Read data from disk into structure
-    uint64_t writePos = fs_getWritePosition(index);
-    header->clusterLength = fs_read32(writePos);
-    header->next = fs_read32(writePos + 4);
-    return header;
+//Frees any empty clusters at the end of a directory, which the caller must hold the lock for
+static void fs_trimDirectoryTail(uint32_t directoryIndex)
+{
+    //Find the last cluster which still holds entries
+    uint32_t lastUsed = directoryIndex;
+    for(uint32_t clusterIndex = fs_read32(fs_getWritePosition(directoryIndex) + 4); clusterIndex != 0; clusterIndex = fs_read32(fs_getWritePosition(clusterIndex) + 4))
+        if(fs_read32(fs_getWritePosition(clusterIndex)) > CLUSTER_HEADER_SIZE)
+            lastUsed = clusterIndex;
+
+    uint64_t lastPos = fs_getWritePosition(lastUsed);
+    uint32_t trailing = fs_read32(lastPos + 4);
+    if(trailing == 0)
+        return;
+    fs_write32(lastPos + 4, 0);
+    fs_write32(fs_getWritePosition(directoryIndex) + NODE_TAIL_OFFSET, lastUsed);
+    fs_freeClusterChain(trailing);
 }
 
-//Reads a node header
-NodeHeader *fs_readNodeHeader(uint32_t index)
+//Removes an entry from a directory by moving the last entry into its place, which the caller must hold the lock for
+static uint8_t fs_removeDirectoryEntry(uint32_t directoryIndex, uint32_t objectIndex)
 {
-    //Create new object to store data
-    NodeHeader *header = new NodeHeader;
+    uint64_t headerPos = fs_getWritePosition(directoryIndex);
+    uint64_t directorySize = fs_read64(headerPos + NODE_SIZE_OFFSET);
+    if(objectIndex == 0 || (uint64_t)objectIndex * DIRECTORY_ENTRY_SIZE >= directorySize)
+        return 0;
 
-    //Read node header into structure
-    uint64_t writePos = fs_getWritePosition(index);
-    header->type = fs_read8(writePos + 8); //Skip over cluster header
-    header->permissions = fs_read32(writePos + 9);
-    header->nameLength = fs_read16(writePos + 13);
-    header->nameData = new uint8_t[header->nameLength];
-    for(uint16_t a = 0; a < header->nameLength; a++)
-        header->nameData[a] = fs_read8(writePos + 15 + a);
+    //Directories written before removal freed emptied clusters may end in empty ones, which would hide the last entry
+    uint32_t tailCluster = fs_getTailCluster(directoryIndex);
+    if(tailCluster != directoryIndex && fs_read32(fs_getWritePosition(tailCluster)) == CLUSTER_HEADER_SIZE)
+    {
+        fs_trimDirectoryTail(directoryIndex);
+        tailCluster = fs_getTailCluster(directoryIndex);
+    }
 
-    return header;
+    //Every entry after the last cluster with space in it is in the tail cluster, so the last entry is at its end
+    uint32_t removedObject = fs_readDirectoryEntry(directoryIndex, objectIndex);
+    uint64_t tailPos = fs_getWritePosition(tailCluster);
+    uint32_t tailLength = fs_read32(tailPos) - DIRECTORY_ENTRY_SIZE;
+    uint32_t lastObject = fs_read32(tailPos + tailLength);
+    uint32_t lastIndex = (directorySize / DIRECTORY_ENTRY_SIZE) - 1;
+
+    const char *name = (const char*)fs_getDataPointer(fs_getWritePosition(removedObject) + NODE_NAME_OFFSET);
+    fs_invalidateDentry(directoryIndex, name, strlen(name));
+    fs_removeIndexEntry(directoryIndex, removedObject, objectIndex);
+
+    //Fill the hole with the last entry, so only the moved entry changes its index
+    if(objectIndex != lastIndex)
+    {
+        uint32_t clusterIndex = directoryIndex;
+        uint32_t relativeIndex = objectIndex;
+        uint32_t clusterHeaderSize;
+        if(fs_getDirectoryClusterFromObjectIndex(&clusterIndex, &relativeIndex, &clusterHeaderSize) == 0)
+            return 0;
+        fs_write32(fs_getWritePosition(clusterIndex) + clusterHeaderSize + (relativeIndex * DIRECTORY_ENTRY_SIZE), lastObject);
+
+        name = (const char*)fs_getDataPointer(fs_getWritePosition(lastObject) + NODE_NAME_OFFSET);
+        fs_invalidateDentry(directoryIndex, name, strlen(name));
+        fs_moveIndexEntry(directoryIndex, lastObject, lastIndex, objectIndex);
+    }
+
+    //Shrink the directory, freeing the tail cluster if it's been emptied
+    fs_write32(tailPos, tailLength);
+    fs_write64(headerPos + NODE_SIZE_OFFSET, directorySize - DIRECTORY_ENTRY_SIZE);
+    if(tailLength == CLUSTER_HEADER_SIZE && tailCluster != directoryIndex)
+        fs_trimDirectoryTail(directoryIndex);
+    return 1;
+}
+
+//Get the number of bytes in an object, which for a compressed file is the size of its data uncompressed
+uint64_t fs_getFileSize(uint32_t index)
+{
+    fs_lockObject(index, 0);
+    uint64_t writePos = fs_getWritePosition(index);
+    uint64_t size = fs_read64(fs_isCompressed(index) ? writePos + fs_getHeaderSize(index) - NODE_COMPRESSION_INFO_LENGTH : writePos + NODE_SIZE_OFFSET);
+    fs_unlockObject(index, 0);
+    return size;
 }
 
-//Installs the filesystem on the disk
-void fs_formatDisk()
+//Follows a cluster list until we reach the final one
+uint32_t fs_getClusterHead(uint32_t clusterIndex)
 {
-    //Set cluster index
-    for(uint32_t a = 0; a < CLUSTER_COUNT; a++)
+    ClusterHeader current = fs_getClusterHeader(clusterIndex);
+    while(current.next != 0)
     {
-        disk[a] = CLUSTER_FREE;
+        clusterIndex = current.next;
+        current = fs_getClusterHeader(clusterIndex);
     }
+    return clusterIndex;
 }
 
-//Find a new cluster to use
-uint32_t fs_allocateCluster()
+//Write a lump of data to an object, the object is automatically extended if space runs out
+void fs_write(uint32_t clusterIndex, uint8_t *data, uint64_t dataLength)
 {
-    //If fs_allocateCluster is searching all available spots, and not from last allocation position
-    uint8_t isFirstSweep = 0;
-    if(lastAllocationPosition == FIRST_ALLOCATION_POSITION)
-        isFirstSweep = 1;
+    struct iovec vector;
+    vector.iov_base = data;
+    vector.iov_len = dataLength;
+    fs_writev(clusterIndex, &vector, 1);
+}
 
-    //Go through disk index to find a free one
-    for(uint32_t a = lastAllocationPosition; a < CLUSTER_COUNT; a++)
+//Append several scattered buffers to an object in one go, the object is automatically extended if space runs out. With the
+//journal running, more than fs_getOperationLimit bytes are appended a piece at a time, each in an operation of its own so a big
+//write doesn't overflow the journal. Returns 0 if the disk is full
+uint8_t fs_writev(uint32_t objectIndex, const struct iovec *vectors, uint32_t vectorCount)
+{
+    uint64_t limit = fs_getOperationLimit();
+    std::vector<struct iovec> piece;
+    uint32_t vector = 0;
+    uint64_t vectorOffset = 0;
+    uint8_t written = 1;
+    do
     {
-        if(disk[a] == CLUSTER_FREE)
+        //Take up to the limit from the buffers left, splitting one if need be
+        piece.clear();
+        uint64_t pieceLength = 0;
+        while(vector < vectorCount && pieceLength < limit)
         {
-            //Store this cluster position for future allocations
-            lastAllocationPosition = a;
+            uint64_t length = vectors[vector].iov_len - vectorOffset < limit - pieceLength ? vectors[vector].iov_len - vectorOffset : limit - pieceLength;
+            struct iovec part;
+            part.iov_base = (uint8_t*)vectors[vector].iov_base + vectorOffset;
+            part.iov_len = length;
+            piece.push_back(part);
+            pieceLength += length;
+            vectorOffset += length;
+            if(vectorOffset == vectors[vector].iov_len)
+            {
+                vector++;
+                vectorOffset = 0;
+            }
+        }
+
+        fs_beginOperation();
+        fs_lockObject(objectIndex, 1);
+        written = fs_isCompressed(objectIndex) ? fs_appendCompressed(objectIndex, piece.data(), piece.size()) : fs_appendData(objectIndex, piece.data(), piece.size(), NULL);
+        fs_unlockObject(objectIndex, 1);
+        fs_endOperation();
+    } while(written && vector < vectorCount);
+    return written;
+}
 
-            //Mark found cluster as used
-            disk[a] = CLUSTER_USED;
+//Appends buffers to an object, which the caller must hold the lock for. If firstNew isn't NULL it's set to the first cluster
+//added, or 0 if the data fitted in the last one. Returns 0 if the disk is full
+static uint8_t fs_appendData(uint32_t objectIndex, const struct iovec *vectors, uint32_t vectorCount, uint32_t *firstNew)
+{
+    uint64_t dataLength = 0;
+    for(uint32_t a = 0; a < vectorCount; a++)
+        dataLength += vectors[a].iov_len;
 
-            //Return its cluster index in the disk
-            return a;
-        }
+    //The last cluster is changed, so the file needs its own copy if it's shared
+    if(!fs_unshareClusters(objectIndex, ~0U, ~0U, NULL))
+        return 0;
+
+    //Start writing at the end of the last cluster
+    uint32_t clusterIndex = fs_getTailCluster(objectIndex);
+    uint64_t writePos = fs_getWritePosition(clusterIndex);
+    uint32_t clusterLength = fs_read32(writePos);
+
+    //Reserve every cluster the data will need up front, so that they can be taken from a contiguous run
+    uint32_t space = CLUSTER_SIZE - clusterLength;
+    uint32_t next = 0;
+    if(dataLength > space)
+    {
+        uint32_t clusterCapacity = CLUSTER_SIZE - CLUSTER_HEADER_SIZE;
+        next = fs_appendClusters(objectIndex, (dataLength - space + clusterCapacity - 1) / clusterCapacity);
+        if(next == 0)
+            return 0;
     }
+    if(firstNew != NULL)
+        *firstNew = next;
 
-    if(!isFirstSweep) //If this was a search from last allocation position and not from the start, do a search from the first available position
+    //Fill each cluster with as much data as it can take in one copy, moving onto the next reserved cluster when it's full.
+    //The reserved clusters are linked together, though a mapped file's last cluster doesn't link on to them
+    for(uint32_t a = 0; a < vectorCount; a++)
     {
-        lastAllocationPosition = FIRST_ALLOCATION_POSITION;
-        return fs_allocateCluster();
+        const uint8_t *data = (const uint8_t*)vectors[a].iov_base;
+        uint64_t remaining = vectors[a].iov_len;
+        while(remaining > 0)
+        {
+            if(clusterLength == CLUSTER_SIZE)
+            {
+                //Update saved size for the full cluster, then move on
+                fs_write32(writePos, clusterLength);
+                clusterIndex = next;
+                writePos = fs_getWritePosition(clusterIndex);
+                next = fs_read32(writePos + 4);
+                clusterLength = CLUSTER_HEADER_SIZE;
+            }
+
+            uint32_t copyLength = remaining < CLUSTER_SIZE - clusterLength ? remaining : CLUSTER_SIZE - clusterLength;
+            fs_writeBytes(writePos + clusterLength, data, copyLength);
+            clusterLength += copyLength;
+            data += copyLength;
+            remaining -= copyLength;
+        }
     }
 
-    //Uh oh, no free clusters found. Return 0 to indicate failure.
-    return 0;
+    //Update the cluster we've written to with its new size, and the object with its new size
+    fs_write32(writePos, clusterLength);
+    uint64_t headerPos = fs_getWritePosition(objectIndex);
+    fs_write64(headerPos + NODE_SIZE_OFFSET, fs_read64(headerPos + NODE_SIZE_OFFSET) + dataLength);
+    return 1;
 }
 
-uint32_t fs_createObject(uint8_t type, uint32_t permissions, uint16_t nameLength, uint8_t *name)
+//Keeps track of the clusters last read ahead while walking along a chain
+struct ReadAhead
 {
-    //Allocate a cluster for the object
-    uint32_t cluster = fs_allocateCluster();
+    uint32_t window; //Clusters asked for last time
+    uint32_t untilNext; //Clusters left to walk before asking for more
+};
+
+//Reads ahead through the block cache while a walk along a chain, with remaining bytes left to go, goes through clusterIndex.
+//Once the walk is half way through the clusters last asked for, twice as many are asked for from where it is, so the cache
+//reads them in the background while the walk carries on, and long walks keep ever more of the chain on its way
+static inline void fs_readAhead(ReadAhead *readAhead, uint32_t clusterIndex, uint64_t remaining)
+{
+    if(disk != NULL || clusterIndex == 0)
+        return;
+    if(readAhead->untilNext > 0)
+    {
+        readAhead->untilNext--;
+        return;
+    }
 
-    //If we failed to allocate a new cluster, return 0
-    if(cluster == 0)
-        return 0;
+    //A single cluster is left to an ordinary miss
+    uint64_t count = 1 + (remaining / (CLUSTER_SIZE - CLUSTER_HEADER_SIZE));
+    if(count < 2)
+        return;
+    uint64_t window = readAhead->window == 0 ? BLOCK_CACHE_READAHEAD_START : (uint64_t)readAhead->window * 2;
+    uint32_t accepted = fs_cachePrefetch(clusterIndex, window < count ? window : count);
+
+    //If the request was dropped, try again further along
+    if(accepted != 0)
+        readAhead->window = accepted;
+    readAhead->untilNext = (accepted != 0 ? accepted : window) / 2;
+}
 
-    //Prepare cluster header for the new object
-    ClusterHeader clusterHeader;
-    clusterHeader.clusterLength = HEADER_SIZE;
-    clusterHeader.next = 0;
+//Read a lump of data from an object
+uint8_t *fs_read(uint32_t clusterIndex, uint32_t length)
+{
+    //Allocate a buffer for the data
+    uint8_t *buffer = new uint8_t[length];
+    fs_readInto(clusterIndex, 0, buffer, length);
+    return buffer;
+}
 
-    //Convert function arguments into a structure
-    NodeHeader nodeHeader;
-    nodeHeader.type = type;
-    nodeHeader.permissions = permissions;
-    nodeHeader.nameLength = nameLength;
-    nodeHeader.nameData = name;
+//Read up to length bytes from offset into an object into a caller supplied buffer. Returns the number of bytes read
+uint64_t fs_readInto(uint32_t clusterIndex, uint64_t offset, uint8_t *buffer, uint64_t length)
+{
+    fs_lockObject(clusterIndex, 0);
 
-    //Write the cluster header and node header to disk
-    fs_writeClusterHeader(cluster, &clusterHeader);
-    fs_writeNodeHeader(cluster, &nodeHeader);
+    //Compressed data has to be found a chunk at a time, which a handle keeps track of
+    if(fs_isCompressed(clusterIndex))
+    {
+        FileHandle *handle = fs_open(clusterIndex);
+        uint64_t readLength = fs_readCompressed(handle, offset, buffer, length);
+        fs_close(handle);
+        fs_unlockObject(clusterIndex, 0);
+        return readLength;
+    }
 
-    return cluster; //Return the index of the newly created cluster
-}
+    ClusterSpanIterator iterator;
+    fs_beginSpans(clusterIndex, &iterator);
 
-uint8_t fs_getDirectoryClusterFromObjectIndex(uint32_t *directoryIndex, uint32_t *objectIndex, uint32_t *clusterSize) //These long names are killing me
-{
-    //Find the cluster which the object index is stored in within the directory
-    *clusterSize = HEADER_SIZE;
-    ClusterHeader *directoryHeader = fs_readClusterHeader(*directoryIndex);
-    while(*clusterSize + (*objectIndex * DIRECTORY_ENTRY_SIZE) >= directoryHeader->clusterLength) //Keep going until the index is within the current cluster
+    const uint8_t *span;
+    uint32_t spanLength;
+    uint64_t bufferOffset = 0;
+    ReadAhead readAhead = {0, 0};
+    while(bufferOffset < length)
     {
-        if(directoryHeader->next == 0) //If there's no next cluster, index out of range, return 0.
+        fs_readAhead(&readAhead, iterator.clusterIndex, offset + length - bufferOffset);
+        if(!fs_nextSpan(&iterator, &span, &spanLength))
+            break;
+
+        //Skip over whole clusters which are before the offset
+        if(offset >= spanLength)
         {
-            delete directoryHeader;
-            return 0;
+            offset -= spanLength;
+            continue;
         }
-        //Else move onto next cluster within the directory
-        *directoryIndex = directoryHeader->next;
 
-        //Reduce the objectIndex by the total storable within a directory as that's how many we've skipepd over
-        *objectIndex -= (directoryHeader->clusterLength - *clusterSize) / DIRECTORY_ENTRY_SIZE;
-        *clusterSize = CLUSTER_HEADER_SIZE;
-
-        delete directoryHeader;
-        directoryHeader = fs_readClusterHeader(*directoryIndex);
+        //Copy as much of this cluster as is needed
+        uint64_t copyLength = spanLength - offset < length - bufferOffset ? spanLength - offset : length - bufferOffset;
+        memcpy(buffer + bufferOffset, span + offset, copyLength);
+        bufferOffset += copyLength;
+        offset = 0;
     }
-    delete directoryHeader;
-    return 1;
+    fs_unlockObject(clusterIndex, 0);
+    return bufferOffset;
 }
 
+//Prepares an iterator over the data held in each cluster of an object
+void fs_beginSpans(uint32_t clusterIndex, ClusterSpanIterator *iterator)
+{
+    iterator->clusterIndex = clusterIndex;
+    iterator->headerSize = fs_getHeaderSize(clusterIndex);
+    iterator->mapCluster = fs_isMapped(clusterIndex) ? fs_read32(fs_getWritePosition(clusterIndex) + 4) : 0;
+    iterator->mapOffset = CLUSTER_HEADER_SIZE;
+}
 
-//Returns cluster location of an object, the index is relative to the directory NOT the disk
-uint32_t fs_getDirectoryObject(uint32_t directoryIndex, uint32_t objectIndex)
+//Gets a view of the data in the next cluster of an object, pointing directly into the disk. Returns 0 once there are no more
+//clusters, or if the next one can't be read, which a cluster too short to hold its own header must be
+uint8_t fs_nextSpan(ClusterSpanIterator *iterator, const uint8_t **data, uint32_t *length)
 {
-    //Get which cluster of the directory the object is in
-    uint32_t clusterHeaderSize;
-    if(fs_getDirectoryClusterFromObjectIndex(&directoryIndex, &objectIndex, &clusterHeaderSize) == 0)
+    if(iterator->clusterIndex == 0)
         return 0;
 
-    //Get the file index of the directory and combine the bytes into a single uint32_t
-    uint64_t writePos = fs_getWritePosition(directoryIndex);
-    return fs_read32(writePos + clusterHeaderSize + (objectIndex * DIRECTORY_ENTRY_SIZE));
+    uint64_t writePos = fs_getWritePosition(iterator->clusterIndex);
+    uint32_t clusterLength = fs_read32(writePos);
+    if(clusterLength < iterator->headerSize || clusterLength > CLUSTER_SIZE)
+    {
+        iterator->clusterIndex = 0;
+        return 0;
+    }
+    *data = fs_getDataPointer(writePos + iterator->headerSize);
+    *length = clusterLength - iterator->headerSize;
+
+    //Move onto the next cluster, which a mapped file lists in its map rather than linking to
+    iterator->clusterIndex = iterator->mapCluster != 0 ? fs_nextMapEntry(&iterator->mapCluster, &iterator->mapOffset) : fs_read32(writePos + 4);
+    iterator->headerSize = CLUSTER_HEADER_SIZE;
+    return 1;
 }
 
+//Returns the number of data bytes held in a cluster of a file
+static inline uint32_t fs_getClusterDataLength(FileHandle *handle, uint32_t clusterIndex)
+{
+    return fs_read32(fs_getWritePosition(clusterIndex)) - (clusterIndex == handle->objectIndex ? handle->headerSize : CLUSTER_HEADER_SIZE);
+}
 
-//Extend an object with another cluster
-uint32_t fs_extendCluster(uint32_t clusterIndex)
+//Fills in the handle's offset to cluster table by walking the whole object once, or reading a mapped file's map. The table
+//stops short at a cluster which can't be read, as its next cluster is read as 0
+static void fs_buildClusterTable(FileHandle *handle)
+{
+    handle->clusterTable.assign(1, handle->objectIndex);
+    if(fs_isMapped(handle->objectIndex))
+        fs_readClusterMap(handle->objectIndex, &handle->clusterTable);
+    else
+        for(uint32_t cluster = fs_read32(fs_getWritePosition(handle->objectIndex) + 4); cluster != 0; cluster = fs_read32(fs_getWritePosition(cluster) + 4))
+            handle->clusterTable.push_back(cluster);
+    handle->hasClusterTable = 1;
+}
+
+//Throws away the handle's cursor and tables if clusters have been replaced in or cut from the file's chain since they were
+//found, starting again from the head. The caller must hold the file's lock
+void fs_refreshHandle(FileHandle *handle)
 {
-    //Get cluster to extend
-    ClusterHeader *header = fs_readClusterHeader(clusterIndex);
+    uint32_t generation = fs_getChainGeneration(handle->objectIndex);
+    if(handle->generation == generation)
+        return;
+    handle->generation = generation;
+    handle->cursorCluster = handle->objectIndex;
+    handle->cursorOffset = 0;
+    handle->hasClusterTable = 0;
+    handle->clusterTable.clear();
+    handle->chunkTable.clear();
+    handle->chunkScan = 0;
+    handle->freeFrames.clear();
+    handle->cachedChunk = ~0ULL;
+}
 
-    //Set it's 'next' to a newly allocated cluster
-    header->next = fs_allocateCluster();
+//Makes sure a file has its own copy of every cluster of its chain from position first to last through a handle, like
+//fs_unshareClusters. Copying clusters changes none of the data stored in them, so the handle's cluster table is kept in step
+//and only its cursor is thrown away, while anything it knows about what's stored where, like the chunks of a compressed
+//file, is kept. The caller must hold the file's lock for writing. Returns 0 if the disk is full
+uint8_t fs_unshareHandle(FileHandle *handle, uint32_t first, uint32_t last)
+{
+    fs_refreshHandle(handle);
 
-    //If we failed to allocate a new cluster, return 0
-    if(header->next == 0)
+    //The map only needs searching if the table, where there is one, shows a cluster in range is still shared
+    if(handle->hasClusterTable && last < handle->clusterTable.size())
     {
-        delete header;
+        uint32_t position = first;
+        while(position <= last && fs_getSharedReferences(handle->clusterTable[position]) == 0)
+            position++;
+        if(position > last)
+            return 1;
+    }
+    uint32_t generation = handle->generation;
+    if(!fs_unshareClusters(handle->objectIndex, first, last, handle->hasClusterTable ? &handle->clusterTable : NULL))
         return 0;
+    if(fs_getChainGeneration(handle->objectIndex) != generation)
+    {
+        handle->generation = fs_getChainGeneration(handle->objectIndex);
+        handle->cursorCluster = handle->objectIndex;
+        handle->cursorOffset = 0;
     }
-
-    //Update the cluster on disk
-    fs_writeClusterHeader(clusterIndex, header);
-
-    //Setup the newly allocated cluster
-    ClusterHeader clusterHeader;
-    clusterHeader.clusterLength = CLUSTER_HEADER_SIZE;
-    clusterHeader.next = 0;
-    fs_writeClusterHeader(header->next, &clusterHeader);
-
-    //Cleanup
-    uint32_t next = header->next;
-    delete header;
-
-    //Return newly allocated cluster index
-    return next;
+    return 1;
 }
 
-//Add an object to a directory
-void fs_addObjectToDirectory(uint32_t directoryIndex, uint32_t objectIndex)
+//Moves the handle's cursor onto the cluster holding offset, which must be less than the stored size. Returns 0 if a cluster
+//on the way can't be read, which leaves the cursor on a cluster before offset
+static uint8_t fs_seekCursor(FileHandle *handle, uint64_t offset)
 {
-    //Fetch the directories' cluster header
-    ClusterHeader *directoryClusterHeader = fs_readClusterHeader(directoryIndex);
-    if(directoryClusterHeader->clusterLength == CLUSTER_SIZE)
+    fs_refreshHandle(handle);
+
+    //Every cluster of a file but the last is full, so with the table built the cluster can be calculated directly
+    if(handle->hasClusterTable)
     {
-        //Cluster full, expand the directory!
-        if(directoryClusterHeader->next == 0)
+        uint32_t headCapacity = CLUSTER_SIZE - handle->headerSize;
+        uint32_t clusterCapacity = CLUSTER_SIZE - CLUSTER_HEADER_SIZE;
+        if(offset < headCapacity)
         {
-            uint32_t newCluster = fs_extendCluster(directoryIndex);
-            fs_addObjectToDirectory(newCluster, objectIndex);
+            handle->cursorCluster = handle->objectIndex;
+            handle->cursorOffset = 0;
         }
-        else //Else there's another section of the directory, add it to that instead and let it deal with allocation
+        else
         {
-            fs_addObjectToDirectory(directoryClusterHeader->next, objectIndex);
+            //The file may have been extended through another handle since the table was built
+            uint64_t clusterNumber = (offset - headCapacity) / clusterCapacity;
+            if(clusterNumber + 1 >= handle->clusterTable.size())
+                fs_buildClusterTable(handle);
+            if(clusterNumber + 1 >= handle->clusterTable.size())
+            {
+                handle->cursorCluster = handle->objectIndex;
+                handle->cursorOffset = 0;
+                return 0;
+            }
+            handle->cursorCluster = handle->clusterTable[clusterNumber + 1];
+            handle->cursorOffset = headCapacity + (clusterNumber * clusterCapacity);
         }
+        return 1;
     }
-    else
+
+    //Going backwards means starting again from the head, so build the table instead to make any later access constant time.
+    //A mapped file's clusters don't link to each other, so it's always found through the table
+    if(offset < handle->cursorOffset || fs_isMapped(handle->objectIndex))
     {
-        //There's space remaining in this cluster so add the object in
-        uint64_t writePos = fs_getWritePosition(directoryIndex);
-        fs_write32(writePos + directoryClusterHeader->clusterLength, objectIndex);
+        fs_buildClusterTable(handle);
+        return fs_seekCursor(handle, offset);
+    }
 
-        //Update the cluster size on disk
-        directoryClusterHeader->clusterLength += DIRECTORY_ENTRY_SIZE;
-        fs_writeClusterHeader(directoryIndex, directoryClusterHeader);
+    //Otherwise walk forwards from the cursor
+    uint32_t dataLength = fs_getClusterDataLength(handle, handle->cursorCluster);
+    while(offset >= handle->cursorOffset + dataLength)
+    {
+        uint32_t next = fs_read32(fs_getWritePosition(handle->cursorCluster) + 4);
+        if(fs_takeCacheError() || next == 0)
+            return 0;
+        handle->cursorOffset += dataLength;
+        handle->cursorCluster = next;
+        dataLength = fs_getClusterDataLength(handle, handle->cursorCluster);
     }
+    return !fs_takeCacheError();
+}
 
-    //Cleanup
-    delete directoryClusterHeader;
+//Opens a file for positional access. The handle must be closed with fs_close
+FileHandle *fs_open(uint32_t objectIndex)
+{
+    FileHandle *handle = new FileHandle;
+    handle->objectIndex = objectIndex;
+    handle->position = 0;
+    handle->cursorCluster = objectIndex;
+    handle->cursorOffset = 0;
+    handle->headerSize = fs_getHeaderSize(objectIndex);
+    handle->hasClusterTable = 0;
+    handle->compressed = fs_isCompressed(objectIndex);
+    handle->generation = fs_getChainGeneration(objectIndex);
+    handle->chunkScan = 0;
+    handle->cachedChunk = ~0ULL;
+    return handle;
 }
 
-//Remove an object from a directory. Note: Wont free object, will just unlist from THIS directory
-uint8_t fs_removeObjectFromDirectory(uint32_t directoryIndex, uint32_t objectIndex)
+//Closes a handle returned by fs_open
+void fs_close(FileHandle *handle)
 {
-    //Get which cluster of the directory the object is in
-    uint32_t clusterHeaderSize;
-    if(fs_getDirectoryClusterFromObjectIndex(&directoryIndex, &objectIndex, &clusterHeaderSize) == 0)
-        return 0;
+    delete handle;
+}
 
-    //Calculate name offset in current cluster
-    uint32_t relativeObjectIndex = clusterHeaderSize + (objectIndex*DIRECTORY_ENTRY_SIZE);
-    uint64_t writePos = fs_getWritePosition(directoryIndex);
+//Moves the position of a handle used by fs_readHandle and fs_writeHandle. Whence is SEEK_SET, SEEK_CUR or SEEK_END. Returns the new position
+uint64_t fs_seek(FileHandle *handle, int64_t offset, uint8_t whence)
+{
+    int64_t base = 0;
+    if(whence == SEEK_CUR)
+        base = handle->position;
+    else if(whence == SEEK_END)
+        base = fs_getFileSize(handle->objectIndex);
+
+    //Don't allow seeking to before the start of the file
+    if(base + offset < 0)
+        return handle->position;
+    handle->position = base + offset;
+    return handle->position;
+}
 
-    //Shift all entries in the rest of the cluster down so as not to leave empty space in the cluster
-    for(; relativeObjectIndex < CLUSTER_SIZE; relativeObjectIndex+=DIRECTORY_ENTRY_SIZE)
-    {
-        for(uint32_t a = 0; a < DIRECTORY_ENTRY_SIZE; a++) //Shift each byte in the entry
-        {
-            fs_write8(writePos + relativeObjectIndex + a, fs_read8(writePos + relativeObjectIndex + DIRECTORY_ENTRY_SIZE + a));
-        }
-    }
+//Read up to length bytes from offset within a file. Returns the number of bytes read
+uint64_t fs_pread(FileHandle *handle, uint64_t offset, uint8_t *buffer, uint64_t length)
+{
+    fs_lockObject(handle->objectIndex, 0);
+    uint64_t readLength = handle->compressed ? fs_readCompressed(handle, offset, buffer, length) : fs_readAt(handle, offset, buffer, length);
+    fs_unlockObject(handle->objectIndex, 0);
+    return readLength;
+}
 
-    //Reduce header size and update on disk
-    ClusterHeader *directoryClusterHeader = fs_readClusterHeader(directoryIndex);
-    directoryClusterHeader->clusterLength -= DIRECTORY_ENTRY_SIZE;
-    fs_writeClusterHeader(directoryIndex, directoryClusterHeader);
+//Reads the data stored in a file through a handle, which for a compressed file is its compressed chunks. The caller must hold
+//the file's lock
+uint64_t fs_readAt(FileHandle *handle, uint64_t offset, uint8_t *buffer, uint64_t length)
+{
+    //Anything which couldn't be read in before now is none of this read's business
+    fs_takeCacheError();
+    uint64_t size = fs_read64(fs_getWritePosition(handle->objectIndex) + NODE_SIZE_OFFSET);
+    if(offset >= size)
+        return 0;
+    if(length > size - offset)
+        length = size - offset;
 
-    //Cleanup and return success
-    delete directoryClusterHeader;
-    return 1;
+    //Copy out of each cluster in turn, starting from the one holding offset. The read stops short at a cluster which can't be read
+    uint64_t bufferOffset = 0;
+    ReadAhead readAhead = {0, 0};
+    if(!fs_seekCursor(handle, offset))
+        return 0;
+    while(true)
+    {
+        fs_readAhead(&readAhead, handle->cursorCluster, length - bufferOffset);
+        uint32_t dataLength = fs_getClusterDataLength(handle, handle->cursorCluster);
+        if(fs_takeCacheError())
+            break;
+        uint32_t clusterOffset = offset - handle->cursorOffset;
+        uint64_t copyLength = dataLength - clusterOffset < length - bufferOffset ? dataLength - clusterOffset : length - bufferOffset;
+        uint64_t writePos = fs_getWritePosition(handle->cursorCluster) + (handle->cursorCluster == handle->objectIndex ? handle->headerSize : CLUSTER_HEADER_SIZE);
+        fs_readBytes(writePos + clusterOffset, buffer + bufferOffset, copyLength);
+        if(fs_takeCacheError())
+            break;
+        bufferOffset += copyLength;
+        offset += copyLength;
+
+        //Only move the cursor on if there's more to read, so it stays valid for the next access
+        if(bufferOffset == length || !fs_seekCursor(handle, offset))
+            break;
+    }
+    return bufferOffset;
 }
 
-//Get the number of bytes in a file (NOT a directory!)
-uint64_t fs_getFileSize(uint32_t index)
+//Write length bytes at offset within a file, overwriting existing data and extending the file as needed.
+//Any gap between the end of the file and offset is filled with zeros. With the journal running, more than fs_getOperationLimit
+//bytes, gap included, are written a piece at a time, each in an operation of its own so a big write doesn't overflow the
+//journal. Returns the number of bytes written
+uint64_t fs_pwrite(FileHandle *handle, uint64_t offset, const uint8_t *data, uint64_t length)
 {
-    uint64_t objSize = 0;
-    uint32_t headerSize = HEADER_SIZE;
-    ClusterHeader *header;
+    uint64_t limit = fs_getOperationLimit();
+    uint64_t written = 0;
+    uint8_t stopped = 0;
     do
     {
-        header = fs_readClusterHeader(index);
-        objSize += header->clusterLength - headerSize;
-        index = header->next;
-        delete header;
-        headerSize = CLUSTER_HEADER_SIZE;
-    } while(index != 0);
-    return objSize;
+        fs_beginOperation();
+        fs_lockObject(handle->objectIndex, 1);
+        uint64_t sizePos = fs_getWritePosition(handle->objectIndex) + NODE_SIZE_OFFSET;
+        uint64_t size = fs_read64(sizePos);
+        if(!handle->compressed && offset > size && offset - size > limit)
+        {
+            //Extend the file towards offset with zeros, writing nothing
+            fs_writeAt(handle, size + limit, NULL, 0);
+            stopped = fs_read64(sizePos) != size + limit;
+        }
+        else
+        {
+            uint64_t pieceLength = length - written < limit ? length - written : limit;
+            uint64_t pieceWritten = handle->compressed ? fs_writeCompressed(handle, offset + written, data + written, pieceLength) :
+                                                         fs_writeAt(handle, offset + written, data + written, pieceLength);
+            written += pieceWritten;
+            stopped = pieceWritten != pieceLength;
+        }
+        fs_unlockObject(handle->objectIndex, 1);
+        fs_endOperation();
+    } while(!stopped && written < length);
+    return written;
 }
 
-//Follows a cluster list until we reach the final one
-uint32_t fs_getClusterHead(uint32_t clusterIndex)
+//Writes the data stored in a file through a handle, which for a compressed file is its compressed chunks. The caller must hold
+//the file's lock for writing
+uint64_t fs_writeAt(FileHandle *handle, uint64_t offset, const uint8_t *data, uint64_t length)
 {
-    ClusterHeader *current = fs_readClusterHeader(clusterIndex);
-    while(true)
+    //Fill any gap past the end of the file with zeros first
+    static const uint8_t zeros[4096] = {0};
+    uint64_t size = fs_read64(fs_getWritePosition(handle->objectIndex) + NODE_SIZE_OFFSET);
+    while(offset > size)
     {
-        if(current->next == 0)
+        uint64_t gap = offset - size < sizeof(zeros) ? offset - size : sizeof(zeros);
+        if(fs_writeAt(handle, size, zeros, gap) != gap)
+            return 0;
+        size += gap;
+    }
+
+    //Any shared cluster the data lands on is copied first, including the last cluster if the data goes past the end
+    if(length > 0)
+    {
+        uint32_t tailPosition = size == 0 ? 0 : fs_getClusterPosition(handle, size - 1);
+        uint32_t firstPosition = fs_getClusterPosition(handle, offset);
+        uint32_t lastPosition = fs_getClusterPosition(handle, offset + length - 1);
+        if(!fs_unshareHandle(handle, firstPosition < tailPosition ? firstPosition : tailPosition, lastPosition < tailPosition ? lastPosition : tailPosition))
+            return 0;
+    }
+
+    //Overwrite whatever part of the data lands on existing clusters
+    uint64_t dataOffset = 0;
+    if(offset < size && length > 0)
+    {
+        //Writing stops short at a cluster which can't be read, as it can't be written without losing the rest of it
+        uint64_t overwriteLength = size - offset < length ? size - offset : length;
+        fs_takeCacheError();
+        if(!fs_seekCursor(handle, offset))
+            return 0;
+        while(true)
         {
-            delete current;
-            return clusterIndex;
+            uint32_t dataLength = fs_getClusterDataLength(handle, handle->cursorCluster);
+            uint32_t clusterOffset = offset - handle->cursorOffset;
+            uint64_t copyLength = dataLength - clusterOffset < overwriteLength - dataOffset ? dataLength - clusterOffset : overwriteLength - dataOffset;
+            uint64_t writePos = fs_getWritePosition(handle->cursorCluster) + (handle->cursorCluster == handle->objectIndex ? handle->headerSize : CLUSTER_HEADER_SIZE);
+            if(fs_takeCacheError())
+                return dataOffset;
+            fs_writeBytes(writePos + clusterOffset, data + dataOffset, copyLength);
+            if(fs_takeCacheError())
+                return dataOffset;
+            dataOffset += copyLength;
+            offset += copyLength;
+
+            if(dataOffset == overwriteLength)
+                break;
+            if(!fs_seekCursor(handle, offset))
+                return dataOffset;
         }
-        clusterIndex = current->next;
-        delete current;
-        current = fs_readClusterHeader(clusterIndex);
     }
-    return 0;
+
+    //Append the rest after the last cluster
+    if(dataOffset < length)
+    {
+        struct iovec vector;
+        vector.iov_base = (void*)(data + dataOffset);
+        vector.iov_len = length - dataOffset;
+        uint32_t firstNew;
+        if(fs_appendData(handle->objectIndex, &vector, 1, &firstNew) == 0)
+            return dataOffset;
+
+        //Add any new clusters onto the end of the table
+        if(handle->hasClusterTable)
+            for(uint32_t cluster = firstNew; cluster != 0; cluster = fs_read32(fs_getWritePosition(cluster) + 4))
+                handle->clusterTable.push_back(cluster);
+    }
+    return length;
 }
 
-//Write a lump of data to an object, the object is automatically extended if space runs out
-void fs_write(uint32_t clusterIndex, uint8_t *data, uint32_t dataLength)
+//Cuts the data stored in a file down to size bytes through a handle, freeing the clusters past the new end and keeping the
+//handle's cursor and cluster table in step, though not its chunks. The caller must hold the file's lock for writing.
+//Returns 0 if the disk is full, as any shared cluster the new end falls in has to be copied first, or if the cluster the new
+//end falls in can't be read, in which case nothing is cut
+uint8_t fs_truncateAt(FileHandle *handle, uint64_t size)
 {
-    //Get cluster head
-    clusterIndex = fs_getClusterHead(clusterIndex);
-    ClusterHeader *cluster = fs_readClusterHeader(clusterIndex);
+    uint64_t headerPos = fs_getWritePosition(handle->objectIndex);
+    if(size >= fs_read64(headerPos + NODE_SIZE_OFFSET))
+        return 1;
 
-    //Write data
-    uint64_t writePos = fs_getWritePosition(clusterIndex);
-    for(uint32_t a = 0; a < dataLength; a++)
+    //The new last cluster has its length changed, so the file needs its own copy of it
+    uint32_t position = size == 0 ? 0 : fs_getClusterPosition(handle, size - 1);
+    if(!fs_unshareHandle(handle, position, position))
+        return 0;
+    if(size == 0)
     {
-        //TODO: Optimise so that an if isn't needed every byte, calculate how many we can write in one go then use a for loop to that point and THEN allocate more if needed
-        if(cluster->clusterLength == CLUSTER_SIZE) //If this cluster is full, create a new one
-        {
-            //Update saved size for cluster first
-            fs_writeClusterHeader(clusterIndex, cluster);
-
-            //Allocate new cluster for more data
-            delete cluster;
-            clusterIndex = fs_extendCluster(clusterIndex);
-            cluster = fs_readClusterHeader(clusterIndex);
-            writePos = fs_getWritePosition(clusterIndex);
-        }
+        fs_refreshHandle(handle);
+        handle->cursorCluster = handle->objectIndex;
+        handle->cursorOffset = 0;
+    }
+    else
+    {
+        fs_takeCacheError();
+        if(!fs_seekCursor(handle, size - 1))
+            return 0;
+    }
 
-        //Write data to disk
-        fs_write8(writePos + cluster->clusterLength++, data[a]);
+    //End the chain at the cursor's cluster, then let go of everything after it. A mapped file's chain ends where its map does
+    uint32_t clusterIndex = handle->cursorCluster;
+    ClusterHeader clusterHeader;
+    clusterHeader.clusterLength = (clusterIndex == handle->objectIndex ? handle->headerSize : CLUSTER_HEADER_SIZE) + (size - handle->cursorOffset);
+    if(fs_isMapped(handle->objectIndex))
+    {
+        fs_write32(fs_getWritePosition(clusterIndex), clusterHeader.clusterLength);
+        fs_truncateClusterMap(handle->objectIndex, position);
+    }
+    else
+    {
+        clusterHeader.next = 0;
+        uint32_t next = fs_read32(fs_getWritePosition(clusterIndex) + 4);
+        fs_writeClusterHeader(clusterIndex, &clusterHeader);
+        fs_freeClusterChain(next);
     }
+    fs_write32(headerPos + NODE_TAIL_OFFSET, clusterIndex);
+    fs_write64(headerPos + NODE_SIZE_OFFSET, size);
 
-    //Update the cluster we've written to with its new size
-    fs_writeClusterHeader(clusterIndex, cluster);
-    delete cluster;
+    //Other handles may be anywhere in what's been cut off, but this one has been kept in step
+    if(handle->hasClusterTable && handle->clusterTable.size() > position + 1)
+        handle->clusterTable.resize(position + 1);
+    handle->generation = fs_moveChainGeneration(handle->objectIndex);
+    return 1;
 }
 
-//Read a lump of data from an object
-uint8_t *fs_read(uint32_t clusterIndex, uint32_t length)
+//Read from the handle's position, moving it forwards. Returns the number of bytes read
+uint64_t fs_readHandle(FileHandle *handle, uint8_t *buffer, uint64_t length)
 {
-    //Allocate a buffer for the data
-    uint8_t *buffer = new uint8_t[length];
-    uint32_t bufferOffset = 0;
+    uint64_t readLength = fs_pread(handle, handle->position, buffer, length);
+    handle->position += readLength;
+    return readLength;
+}
 
-    //Get cluster to start reading from
-    uint32_t headerSize = HEADER_SIZE;
-    uint64_t writePos = fs_getWritePosition(clusterIndex);
-    ClusterHeader *cluster = fs_readClusterHeader(clusterIndex);
+//Write at the handle's position, moving it forwards. Returns the number of bytes written
+uint64_t fs_writeHandle(FileHandle *handle, const uint8_t *data, uint64_t length)
+{
+    uint64_t writeLength = fs_pwrite(handle, handle->position, data, length);
+    handle->position += writeLength;
+    return writeLength;
+}
 
-    //Keep reading until we've read length bytes
-    while(bufferOffset < length)
+//Marks an object as free, along with its directory index if it has one
+void fs_freeObject(uint32_t index)
+{
+    //The object's clusters may be reused by something else
+    fs_invalidateDentries();
+
+    fs_beginOperation();
+    fs_lockObject(index, 1);
+    if(fs_read8(fs_getWritePosition(index) + 8) == NODE_DIRECTORY)
+        fs_freeDirectoryIndex(index);
+    if(fs_isMapped(index))
+        fs_truncateClusterMap(index, 0);
+    fs_freeClusterChain(index);
+    fs_unlockObject(index, 1);
+    __atomic_fetch_sub(&objectCount, 1, __ATOMIC_RELAXED);
+    fs_endOperation();
+}
+
+//Visits an object and, if it's a directory, everything below it, adding every cluster to clusters unless it's NULL. A directory
+//is only descended into from the directory its parent entry points back to, so links to directories elsewhere and cycles are
+//skipped. Returns the number of objects visited
+static uint32_t fs_walkTree(uint32_t objectIndex, std::vector<uint32_t> *clusters)
+{
+    uint32_t objects = 0;
+    std::vector<uint32_t> pending(1, objectIndex);
+    std::unordered_set<uint32_t> visited;
+    visited.insert(objectIndex);
+    while(!pending.empty())
     {
-        //Read from cluster until either we've read enough bytes or we've finished this cluster
-        for(uint32_t a = headerSize; a < cluster->clusterLength && bufferOffset < length; a++)
+        uint32_t object = pending.back();
+        pending.pop_back();
+        objects++;
+
+        fs_lockObject(object, 0);
+        //A mapped file's chain is its first cluster and map, and the clusters listed in the map are only gathered once no
+        //other file lists them
+        if(clusters != NULL)
         {
-            buffer[bufferOffset++] = fs_read8(writePos + a);
+            if(fs_isMapped(object))
+                fs_releaseClusterMap(object, clusters);
+            for(uint32_t clusterIndex = object; clusterIndex != 0; clusterIndex = fs_read32(fs_getWritePosition(clusterIndex) + 4))
+                clusters->push_back(clusterIndex);
         }
-
-        //If we've finished this cluster and still haven't read enough bytes, get the next cluster
-        if(bufferOffset < length)
+        if(fs_read8(fs_getWritePosition(object) + 8) == NODE_DIRECTORY)
         {
-            if(cluster->next == 0) //No more clusters to read, just return what we've got so far
-                return buffer;
-
-            clusterIndex = cluster->next;
-            writePos = fs_getWritePosition(clusterIndex);
-            delete cluster;
-            cluster = fs_readClusterHeader(clusterIndex);
-            headerSize = CLUSTER_HEADER_SIZE;
+            if(clusters != NULL)
+                fs_collectIndexClusters(object, clusters);
+
+            //Queue up every entry but the parent
+            ClusterSpanIterator iterator;
+            fs_beginSpans(object, &iterator);
+            const uint8_t *span;
+            uint32_t spanLength;
+            uint32_t relativeIndex = 0;
+            while(fs_nextSpan(&iterator, &span, &spanLength))
+            {
+                for(uint32_t a = 0; a < spanLength; a += DIRECTORY_ENTRY_SIZE, relativeIndex++)
+                {
+                    uint32_t child = intConcatL(span[a], span[a + 1], span[a + 2], span[a + 3]);
+                    if(relativeIndex == 0 || child == 0 || child >= CLUSTER_COUNT)
+                        continue;
+
+                    //The type and parent entry never change, so they can be read without locking the child
+                    uint64_t childPos = fs_getWritePosition(child);
+                    if(fs_read8(childPos + 8) == NODE_DIRECTORY && fs_read32(childPos + fs_getHeaderSize(child)) != object)
+                        continue;
+                    if(visited.insert(child).second)
+                        pending.push_back(child);
+                }
+            }
         }
+        fs_unlockObject(object, 0);
     }
+    return objects;
+}
 
-    //Cleanup
-    delete cluster;
-    //Return read data
-    return buffer;
+//Frees an object and, if it's a directory, everything below it. The object should already have been removed from its directory.
+//Every cluster in the tree is gathered first and then released in order, a run of the allocation table at a time.
+//Returns the number of clusters freed
+uint64_t fs_removeTree(uint32_t objectIndex)
+{
+    //The tree's clusters may be reused by something else
+    fs_invalidateDentries();
+
+    std::vector<uint32_t> clusters;
+    fs_beginOperation();
+    __atomic_fetch_sub(&objectCount, fs_walkTree(objectIndex, &clusters), __ATOMIC_RELAXED);
+
+    //Release the clusters in order, so each word of the allocation table is only updated once per run
+    std::sort(clusters.begin(), clusters.end());
+    clusters.erase(std::unique(clusters.begin(), clusters.end()), clusters.end());
+    for(uint32_t a = 0; a < clusters.size();)
+    {
+        uint32_t runLength = 1;
+        while(a + runLength < clusters.size() && clusters[a + runLength] == clusters[a] + runLength)
+            runLength++;
+        fs_markClusterRange(clusters[a], runLength, CLUSTER_FREE);
+        a += runLength;
+    }
+    fs_endOperation();
+    return clusters.size();
+}
+
+//Marks count clusters starting at first as free
+void fs_freeRun(uint32_t first, uint32_t count)
+{
+    fs_markClusterRange(first, count, CLUSTER_FREE);
 }
 
 //Marks a cluster tree as free
-void fs_freeObject(uint32_t index)
+static void fs_freeClusterChain(uint32_t index)
 {
-    //Go through each cluster in the object and mark as free
-    ClusterHeader *current = fs_readClusterHeader(index);
-    while(true) //Keep going until we run out of connected headers
+    //Go through each cluster in the object and mark as free, until we run out of connected headers
+    while(index != 0)
     {
-        //Mark cluster space as free
-        disk[index] = CLUSTER_FREE;
+        uint32_t next = fs_getClusterHeader(index).next;
+        fs_freeCluster(index);
+        index = next;
+    }
+}
 
-        if(current->next == 0)
+//Finds an object by name within a directory, using its index if it has one. Returns 0 if there's no match
+static uint8_t fs_findDirectoryEntry(uint32_t directoryIndex, const char *name, uint32_t nameLength, uint32_t *objectIndex, uint32_t *relativeIndex)
+{
+    //Repeated lookups are answered from the cache, including names which are known not to exist
+    if(fs_lookupDentry(directoryIndex, name, nameLength, objectIndex, relativeIndex))
+        return *objectIndex != 0;
+
+    //The result is cached before the lock is released, so a change to the directory can't be overtaken by a stale entry
+    fs_lockObject(directoryIndex, 0);
+    uint8_t found = 0;
+    if(fs_getIndexCluster(directoryIndex) != 0)
+    {
+        found = fs_findIndexEntry(directoryIndex, name, nameLength, objectIndex, relativeIndex);
+    }
+    else
+    {
+        //Older and smaller directories are searched entry by entry, skipping the parent entry
+        uint32_t dirSize = fs_getDirectorySize(directoryIndex);
+        for(uint32_t a = 1; a < dirSize && !found; a++)
         {
-            delete current;
-            return;
+            uint32_t node = fs_readDirectoryEntry(directoryIndex, a);
+            if(fs_isNamed(node, name, nameLength))
+            {
+                *objectIndex = node;
+                *relativeIndex = a;
+                found = 1;
+            }
         }
-        index = current->next;
-        delete current;
-        current = fs_readClusterHeader(index);
     }
-    delete current;
+
+    fs_insertDentry(directoryIndex, name, nameLength, found ? *objectIndex : 0, found ? *relativeIndex : 0);
+    fs_unlockObject(directoryIndex, 0);
+    return found;
 }
 
-//Converts a string filepath to a cluster index
+//Converts a string filepath to a cluster index. The path isn't modified
 FilepathClusterInfo fs_getClusterFromFilepath(uint32_t rootDirectory, uint32_t currentDirectory, uint8_t *path, uint32_t pathLength)
 {
     //Reset to root directory if filepath is preceded with a '/'
-    if(path[0] == '/')
+    if(pathLength > 0 && path[0] == '/')
     {
         currentDirectory = rootDirectory;
     }
 
     FilepathClusterInfo info;
+    info.relativeIndex = 0;
     uint32_t oldDirInfo = currentDirectory;
 
-    char *token = strtok((char*)path, "/");
-    while(token)
+    uint32_t position = 0;
+    while(position < pathLength && path[position] != '\0')
     {
-        if(strcmp(token, "..") == 0)
+        //Split off the next name in the path
+        if(path[position] == '/')
+        {
+            position++;
+            continue;
+        }
+        const char *name = (const char*)&path[position];
+        uint32_t nameLength = 0;
+        while(position < pathLength && path[position] != '/' && path[position] != '\0')
+        {
+            position++;
+            nameLength++;
+        }
+
+        if(nameLength == 2 && name[0] == '.' && name[1] == '.')
         {
             info.relativeIndex = 0;
             oldDirInfo = currentDirectory;
             currentDirectory = fs_getDirectoryObject(currentDirectory, 0);
-            token = strtok(NULL, "/");
             continue;
         }
 
-        //Get list of files in current directory and check if this name matches any of them
-        uint32_t dirSize = fs_getDirectorySize(currentDirectory);
-        for(uint32_t a = 1; a < dirSize; a++)
+        //Check if this name matches anything in the current directory
+        uint32_t node, relativeIndex;
+        if(fs_findDirectoryEntry(currentDirectory, name, nameLength, &node, &relativeIndex))
         {
-            uint32_t node = fs_getDirectoryObject(currentDirectory, a);
-            NodeHeader *nodeData = fs_readNodeHeader(node);
-            //If we've found a file match
-            if(strcmp((char*)nodeData->nameData, token) == 0)
+            info.relativeIndex = relativeIndex;
+            oldDirInfo = currentDirectory;
+            currentDirectory = node;
+
+            //If 'currentDirectory' is a file, return. The type never changes, so it can be read without locking
+            if((fs_read8(fs_getWritePosition(currentDirectory) + 8) & NODE_TYPE_MASK) == NODE_FILE)
             {
-                info.relativeIndex = a;
-                oldDirInfo = currentDirectory;
-                currentDirectory = node;
-                //If 'currentDirectory' is a file, return
-                NodeHeader *h = fs_readNodeHeader(currentDirectory);
-                if(h->type == NODE_FILE)
-                {
-                    fs_freeNodeHeader(h);
-                    info.objectIndex = currentDirectory;
-                    info.ownerIndex = oldDirInfo;
-                    return info;
-                }
-                fs_freeNodeHeader(h);
+                info.objectIndex = currentDirectory;
+                info.ownerIndex = oldDirInfo;
+                return info;
             }
-            fs_freeNodeHeader(nodeData);
         }
-        token = strtok(NULL, "/");
     }
     info.objectIndex = currentDirectory;
     info.ownerIndex = oldDirInfo;
@@ -0,0 +1,620 @@
+#include "filesystem.h"
+#include <string.h>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <unordered_map>
+
+//Write-ahead journal. On disks formatted with FEATURE_JOURNAL and accessed through the block cache, changes are grouped into
+//transactions: everything changed between fs_beginOperation and fs_endOperation belongs to the running transaction, which
+//fs_commit closes once the operations in it have finished. A copy of every cluster the transaction changed, including those of
+//the allocation, checksum and reference tables, goes into the journal behind a descriptor listing where they belong and a
+//checksum of the lot, so the whole transaction reaches stable storage with a single sync, and one which didn't get there in full
+//fails its checksum and is ignored. Threads committing at the same time share a commit, so under load each sync covers many operations.
+//A transaction which can't be written stays pending, with its clusters held in the cache as they can't be written back until
+//it's durable, and the next commit tries it again before closing another.
+//Transactions are written one after another from the start of the journal, as a run which opens with an empty transaction.
+//Every transaction in a run carries its tag, so those left over further into the journal from earlier runs aren't taken as part
+//of it. Committed clusters reach their homes as the cache evicts them, and otherwise stay in the journal until it fills up, when
+//everything in the run is written back from it and synced and a new run starts. So a commit costs a single sequential write and
+//a sync, and a cluster changed by many transactions is only written back once. Mounting replays the run, putting the last copy
+//of each cluster in place. Clusters are journaled whole, as every cluster mixes its header in with data, except that a cluster
+//allocated since the last commit may be written straight to its home when the cache needs the room, as nothing committed depends
+//on what it held, unless it's in the run and would be replayed over it. The commit syncs those before writing the journal.
+//Transactions are kept to what fits in half the journal: writes to files are split into operations of at most
+//fs_getOperationLimit bytes, an operation starting once the transaction is big enough commits it first, and if a transaction
+//still comes out too big, the clusters allocated in it go straight to their homes before it like those written back early.
+//One which doesn't fit even then fails to commit rather than being written in place, where a crash could tear it.
+//Mapped disks are written in place as they're changed, so they can't be journaled, but their journal is still replayed at mount.
+//The shell mounts disks with a journal through the cache for that reason.
+#define JOURNAL_MAGIC 0x4C4E524A //Starts the descriptor of each transaction, "JRNL"
+#define JOURNAL_HEADER_SIZE 24 //Bytes of a descriptor before its list of clusters
+
+//A transaction on its way to the journal
+struct JournalTransaction
+{
+    std::vector<uint32_t> clusters; //Home of each cluster in the transaction
+    std::vector<uint8_t> images; //Contents of those clusters, one after the other
+    std::vector<uint32_t> homeClusters; //Clusters allocated in the transaction, written to their homes first to make it fit
+    std::vector<uint8_t> homeImages;
+};
+
+static BlockDevice *journalDevice = NULL;
+static uint8_t journalActive = 0;
+static std::mutex journalLock;
+static std::condition_variable journalChanged;
+static uint32_t activeOperations = 0; //Operations under way in the running transaction
+static uint8_t closingTransaction = 0; //Set while a commit waits for the running transaction's operations, holding back new ones
+static uint8_t committing = 0; //Set while a transaction is being committed
+static uint8_t lastCommitSucceeded = 1;
+static uint64_t runningSequence = 1; //Transaction new changes belong to
+static uint64_t durableSequence = 0; //Last transaction to have reached stable storage
+static uint64_t nextSequence = 1; //First transaction after those replayed at mount
+static uint32_t commitThreshold = 0; //Changed clusters in the cache at which the operation ending commits the transaction
+static uint8_t earlyWrites = 0; //Set once a cluster of the running transaction has been written back before being committed
+static JournalTransaction pendingTransaction; //Transaction closed by a commit which failed to write it, to be tried again
+static uint64_t pendingSequence = 0; //Sequence of the pending transaction, or 0 if there isn't one
+static uint8_t pendingSyncFirst = 0;
+static std::vector<uint64_t> allocatedClusters; //One bit per cluster, set once it's allocated in the running transaction
+static std::vector<uint64_t> releasedClusters; //One bit per cluster, set once it's freed in the running transaction
+static std::vector<uint64_t> journaledClusters; //One bit per cluster, set for those in the journal's current run
+static std::vector<uint32_t> lastClusters; //Clusters of the last transaction committed
+static uint32_t journalHead = 0; //Clusters of the journal taken by the current run, or 0 if the next commit starts a new one
+static uint32_t journalRun = 0; //Tag of the current run
+static uint8_t journalRestarted = 0; //Set once a commit has started a new run, leaving only its own clusters in the journal
+static thread_local uint32_t operationDepth = 0; //Operations the current thread is inside, as they can be nested
+
+//Stores a 32bit value in little endian order
+static inline void fs_encode32(uint8_t *data, uint32_t value)
+{
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+}
+
+//Returns the number of clusters taken by the descriptor of a transaction holding count clusters
+static inline uint64_t fs_getDescriptorLength(uint64_t count, uint32_t clusterShift)
+{
+    return (JOURNAL_HEADER_SIZE + (count * 4) + (1ULL << clusterShift) - 1) >> clusterShift;
+}
+
+//Returns the position of the cluster offset clusters into a journal
+static inline uint64_t fs_getJournalPosition(const Superblock *header, uint64_t offset)
+{
+    return (uint64_t)(header->journalCluster + offset) << header->clusterShift;
+}
+
+//Picks the tag of a new run. It only has to differ from the runs before, as their transactions may still be further into the journal
+static uint32_t fs_newJournalRun()
+{
+    static std::random_device source;
+    return source();
+}
+
+//Builds the descriptor of a transaction in run holding clusters, whose images follow it in the journal
+static std::vector<uint8_t> fs_buildDescriptor(const std::vector<uint32_t> &clusters, const std::vector<uint8_t> &images, uint64_t sequence,
+                                               uint32_t run, uint32_t clusterShift)
+{
+    uint32_t count = clusters.size();
+    std::vector<uint8_t> descriptor(fs_getDescriptorLength(count, clusterShift) << clusterShift, 0);
+    fs_encode32(&descriptor[0], JOURNAL_MAGIC);
+    fs_encode32(&descriptor[4], count);
+    fs_encode32(&descriptor[8], sequence);
+    fs_encode32(&descriptor[12], sequence >> 32);
+    fs_encode32(&descriptor[20], run);
+    for(uint32_t a = 0; a < count; a++)
+        fs_encode32(&descriptor[JOURNAL_HEADER_SIZE + (a * 4)], clusters[a]);
+
+    //The checksum covers the descriptor, with the checksum itself zeroed, and every cluster image after it
+    uint32_t checksum = fs_crc32c(0, &descriptor[0], descriptor.size());
+    if(count > 0)
+        checksum = fs_crc32c(checksum, &images[0], images.size());
+    fs_encode32(&descriptor[16], checksum);
+    return descriptor;
+}
+
+//Adds a write of each cluster image to its home onto a batch. Vectors must have room reserved for them all, as requests point into it
+static void fs_addClusterWrites(const std::vector<uint32_t> &clusters, uint8_t *images, uint32_t clusterShift,
+                                std::vector<struct iovec> *vectors, std::vector<BlockRequest> *requests)
+{
+    for(uint32_t a = 0; a < clusters.size(); a++)
+    {
+        struct iovec vector;
+        vector.iov_base = images + ((uint64_t)a << clusterShift);
+        vector.iov_len = 1ULL << clusterShift;
+        vectors->push_back(vector);
+        BlockRequest request;
+        request.position = (uint64_t)clusters[a] << clusterShift;
+        request.vectors = &vectors->back();
+        request.vectorCount = 1;
+        requests->push_back(request);
+    }
+}
+
+//Writes cluster images to their homes as one batch and syncs them. Returns 0 on failure
+static uint8_t fs_writeClustersInPlace(BlockDevice *device, uint32_t clusterShift, const std::vector<uint32_t> &clusters, uint8_t *images)
+{
+    std::vector<struct iovec> vectors;
+    std::vector<BlockRequest> requests;
+    vectors.reserve(clusters.size());
+    fs_addClusterWrites(clusters, images, clusterShift, &vectors, &requests);
+    uint8_t success = requests.empty() || device->writeBatch(&requests[0], requests.size());
+    return device->sync() && success;
+}
+
+//Starts a new run in a journal holding nothing, so nothing in it is replayed. Returns 0 on failure
+static uint8_t fs_clearJournal(BlockDevice *device, const Superblock *header)
+{
+    std::vector<uint8_t> descriptor = fs_buildDescriptor(std::vector<uint32_t>(), std::vector<uint8_t>(), 0, fs_newJournalRun(), header->clusterShift);
+    uint8_t success = device->write(fs_getJournalPosition(header, 0), &descriptor[0], descriptor.size());
+    return device->sync() && success;
+}
+
+//Reads the transaction offset clusters into a journal, returning the number of clusters it takes up, or 0 if there isn't a
+//complete transaction there. Returns ~0 if the device couldn't be read
+static uint64_t fs_readJournalTransaction(BlockDevice *device, const Superblock *header, uint64_t offset, JournalTransaction *transaction,
+                                          uint64_t *sequence, uint32_t *run)
+{
+    if(offset >= header->journalLength)
+        return 0;
+    uint64_t position = fs_getJournalPosition(header, offset);
+    uint64_t room = header->journalLength - offset;
+    std::vector<uint8_t> descriptor(header->clusterSize);
+    if(!device->read(position, &descriptor[0], descriptor.size()))
+        return ~0ULL;
+
+    //Check the descriptor makes sense before trusting its length
+    const uint8_t *data = &descriptor[0];
+    if(intConcatL(data[0], data[1], data[2], data[3]) != JOURNAL_MAGIC)
+        return 0;
+    uint32_t count = intConcatL(data[4], data[5], data[6], data[7]);
+    uint32_t checksum = intConcatL(data[16], data[17], data[18], data[19]);
+    uint64_t descriptorLength = fs_getDescriptorLength(count, header->clusterShift);
+    if(count > room || descriptorLength + count > room)
+        return 0;
+    *sequence = intConcatL(data[8], data[9], data[10], data[11]) | ((uint64_t)intConcatL(data[12], data[13], data[14], data[15]) << 32);
+    *run = intConcatL(data[20], data[21], data[22], data[23]);
+
+    //The checksum covers the descriptor, with the checksum itself zeroed, and every cluster image after it
+    descriptor.resize(descriptorLength << header->clusterShift);
+    transaction->images.resize((uint64_t)count << header->clusterShift);
+    if(!device->read(position, &descriptor[0], descriptor.size()) || (count > 0 && !device->read(position + descriptor.size(), &transaction->images[0], transaction->images.size())))
+        return ~0ULL;
+    memset(&descriptor[16], 0, 4);
+    uint32_t actual = fs_crc32c(0, &descriptor[0], descriptor.size());
+    if(count > 0)
+        actual = fs_crc32c(actual, &transaction->images[0], transaction->images.size());
+    if(actual != checksum)
+        return 0;
+
+    transaction->clusters.resize(count);
+    for(uint32_t a = 0; a < count; a++)
+    {
+        data = &descriptor[JOURNAL_HEADER_SIZE + (a * 4)];
+        transaction->clusters[a] = intConcatL(data[0], data[1], data[2], data[3]);
+        if(transaction->clusters[a] >= header->clusterCount)
+            return 0;
+    }
+    return descriptorLength + count;
+}
+
+//Reads the run at the start of a journal, leaving the last copy of each cluster in it in contents, and the sequence of its last
+//transaction in lastSequence. Returns 0 if the device couldn't be read
+static uint8_t fs_readJournal(BlockDevice *device, const Superblock *header, JournalTransaction *contents, uint64_t *lastSequence)
+{
+    std::unordered_map<uint32_t, uint64_t> copies; //Cluster to the index of its copy in contents
+    uint64_t offset = 0;
+    uint32_t firstRun = 0;
+    *lastSequence = 0;
+    while(true)
+    {
+        JournalTransaction transaction;
+        uint64_t sequence;
+        uint32_t run;
+        uint64_t length = fs_readJournalTransaction(device, header, offset, &transaction, &sequence, &run);
+        if(length == ~0ULL)
+            return 0;
+
+        //The run ends at the first transaction which isn't complete or doesn't follow on from the one before
+        if(length == 0 || (offset != 0 && (run != firstRun || sequence != *lastSequence + 1)))
+            return 1;
+        firstRun = run;
+        *lastSequence = sequence;
+        offset += length;
+        for(uint32_t a = 0; a < transaction.clusters.size(); a++)
+        {
+            std::pair<std::unordered_map<uint32_t, uint64_t>::iterator, bool> added = copies.insert(std::make_pair(transaction.clusters[a], contents->clusters.size()));
+            if(added.second)
+            {
+                contents->clusters.push_back(transaction.clusters[a]);
+                contents->images.resize(contents->images.size() + header->clusterSize);
+            }
+            memcpy(&contents->images[added.first->second << header->clusterShift], &transaction.images[(uint64_t)a << header->clusterShift], header->clusterSize);
+        }
+    }
+}
+
+//Puts whatever the journal of a disk being mounted holds in place, then empties it. Returns 0 if the device can't be used
+uint8_t fs_replayJournal(BlockDevice *device, const Superblock *header)
+{
+    JournalTransaction contents;
+    uint64_t lastSequence;
+    if(!fs_readJournal(device, header, &contents, &lastSequence))
+        return 0;
+    if(contents.clusters.empty())
+        return 1;
+    uint8_t success = fs_writeClustersInPlace(device, header->clusterShift, contents.clusters, contents.images.data());
+    nextSequence = lastSequence + 1;
+    return success && fs_clearJournal(device, header);
+}
+
+//Gets the journal of a newly attached device ready. Journaling only runs without a mapping, and must be started once the cache is open
+void fs_openJournal(BlockDevice *device)
+{
+    journalDevice = device;
+    journalActive = disk == NULL && (superblock.features & FEATURE_JOURNAL);
+    activeOperations = 0;
+    closingTransaction = 0;
+    committing = 0;
+    lastCommitSucceeded = 1;
+    runningSequence = nextSequence;
+    durableSequence = nextSequence - 1;
+    nextSequence = 1;
+    earlyWrites = 0;
+    pendingTransaction = JournalTransaction();
+    pendingSequence = 0;
+    pendingSyncFirst = 0;
+    allocatedClusters.clear();
+    releasedClusters.clear();
+    journaledClusters.clear();
+    lastClusters.clear();
+    journalHead = 0;
+    journalRestarted = 0;
+    if(!journalActive)
+        return;
+
+    allocatedClusters.assign(superblock.allocationWordCount, 0);
+    releasedClusters.assign(superblock.allocationWordCount, 0);
+    journaledClusters.assign(superblock.allocationWordCount, 0);
+
+    //Leave room in both the journal and the cache for the operation which crosses the threshold
+    uint32_t capacity = fs_getCacheStats().capacity;
+    uint32_t halfLength = superblock.journalLength / 2;
+    commitThreshold = (capacity < halfLength ? capacity : halfLength) / 2;
+}
+
+//Empties the journal of the mounted disk, if it has one. Returns 0 on failure
+uint8_t fs_emptyJournal()
+{
+    if(!(superblock.features & FEATURE_JOURNAL))
+        return 1;
+    return fs_clearJournal(journalDevice, &superblock);
+}
+
+//Stops journaling on unmount, once everything has been checkpointed, emptying the journal so there's nothing to replay
+void fs_stopJournal()
+{
+    if(!journalActive)
+        return;
+    fs_emptyJournal();
+    journalActive = 0;
+    allocatedClusters.clear();
+    releasedClusters.clear();
+    journaledClusters.clear();
+}
+
+//Returns 1 if changes to the mounted disk are going through the journal
+uint8_t fs_isJournalActive()
+{
+    return journalActive;
+}
+
+//Returns the last transaction to have reached stable storage
+uint64_t fs_getDurableSequence()
+{
+    return __atomic_load_n(&durableSequence, __ATOMIC_ACQUIRE);
+}
+
+//Drops out of the running transaction, waking a commit waiting for it to empty
+static void fs_leaveTransaction()
+{
+    if(__atomic_sub_fetch(&activeOperations, 1, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&closingTransaction, __ATOMIC_SEQ_CST))
+    {
+        std::lock_guard<std::mutex> guard(journalLock);
+        journalChanged.notify_all();
+    }
+}
+
+//Starts an operation, whose changes are committed together or not at all. Operations can be nested, only the outermost counts.
+//Must be called before taking any object locks, as it waits for a commit closing the running transaction, and commits the
+//running transaction itself if it's already big enough, so operations can't keep piling into it
+void fs_beginOperation()
+{
+    if(!journalActive)
+        return;
+    if(operationDepth == 0 && fs_getCacheModifiedCount() >= commitThreshold)
+        fs_commit();
+    if(operationDepth++ != 0)
+        return;
+    while(true)
+    {
+        __atomic_fetch_add(&activeOperations, 1, __ATOMIC_SEQ_CST);
+        if(!__atomic_load_n(&closingTransaction, __ATOMIC_SEQ_CST))
+            return;
+
+        //A commit is closing the running transaction, so back out until the next one opens
+        fs_leaveTransaction();
+        std::unique_lock<std::mutex> guard(journalLock);
+        while(closingTransaction)
+            journalChanged.wait(guard);
+    }
+}
+
+//Ends an operation started with fs_beginOperation, after releasing any object locks. The outermost operation commits the
+//running transaction once it's big enough, so it fits in the journal and doesn't fill the cache with clusters which can't be written back
+void fs_endOperation()
+{
+    if(!journalActive || --operationDepth != 0)
+        return;
+    fs_leaveTransaction();
+    if(fs_getCacheModifiedCount() >= commitThreshold)
+        fs_commit();
+}
+
+//Returns the most bytes a single operation should write to a file. With the journal running, writes to files are split into
+//operations of this size, so however much is written at once, each piece leaves room for the others in the transaction
+uint64_t fs_getOperationLimit()
+{
+    if(!journalActive)
+        return ~0ULL;
+
+    //Compressed files are written a chunk at a time, so whole chunks are kept together where there's room
+    uint64_t limit = (uint64_t)(commitThreshold / 4 == 0 ? 1 : commitThreshold / 4) * (CLUSTER_SIZE - CLUSTER_HEADER_SIZE);
+    return limit < COMPRESSION_CHUNK_SIZE ? limit : limit - (limit % COMPRESSION_CHUNK_SIZE);
+}
+
+//Notes clusters allocated in the running transaction, the clusters in mask counting from firstCluster
+void fs_journalClaimed(uint32_t firstCluster, uint64_t mask)
+{
+    if(journalActive)
+        __atomic_fetch_or(&allocatedClusters[firstCluster / 64], mask, __ATOMIC_RELAXED);
+}
+
+//Notes clusters freed in the running transaction, the clusters in mask counting from firstCluster
+void fs_journalReleased(uint32_t firstCluster, uint64_t mask)
+{
+    if(journalActive)
+        __atomic_fetch_or(&releasedClusters[firstCluster / 64], mask, __ATOMIC_RELAXED);
+}
+
+//Returns 1 if a cluster changed in the running transaction can be written back before it's committed, noting that the commit
+//must sync it first. That's only safe for a cluster which was free as of the last commit and isn't in the journal's run,
+//which would be replayed over it, and not while a commit is under way, as it may be freeing the cluster, or while
+//a transaction is pending, as the cluster may be in use as of the last one which is durable. The block cache lock must be held
+uint8_t fs_claimEarlyWrite(uint32_t clusterIndex)
+{
+    if(__atomic_load_n(&committing, __ATOMIC_ACQUIRE) || __atomic_load_n(&pendingSequence, __ATOMIC_ACQUIRE) != 0)
+        return 0;
+    uint32_t word = clusterIndex / 64;
+    uint64_t bit = 1ULL << (clusterIndex % 64);
+    if(!(__atomic_load_n(&allocatedClusters[word], __ATOMIC_RELAXED) & bit) || (__atomic_load_n(&releasedClusters[word], __ATOMIC_RELAXED) & bit) ||
+       (journaledClusters[word] & bit))
+        return 0;
+    __atomic_store_n(&earlyWrites, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+//Returns 1 if a transaction holding count clusters fits in half the journal, which leaves room for others in its run
+static inline uint8_t fs_fitsJournal(uint64_t count)
+{
+    return fs_getDescriptorLength(count, superblock.clusterShift) + count <= superblock.journalLength / 2;
+}
+
+//Shrinks a transaction too big for the journal by moving the clusters allocated in it, out of the first count taken from the
+//cache, to be written straight to their homes before it. That's safe for the same clusters fs_claimEarlyWrite lets through
+static void fs_moveAllocatedHome(JournalTransaction *transaction, uint32_t count)
+{
+    std::vector<uint32_t> clusters;
+    std::vector<uint8_t> images;
+    for(uint32_t a = 0; a < transaction->clusters.size(); a++)
+    {
+        uint32_t cluster = transaction->clusters[a];
+        uint32_t word = cluster / 64;
+        uint64_t bit = 1ULL << (cluster % 64);
+        uint8_t allocated = a < count && (allocatedClusters[word] & bit) && !(releasedClusters[word] & bit) && !(journaledClusters[word] & bit);
+        std::vector<uint32_t> *toClusters = allocated ? &transaction->homeClusters : &clusters;
+        std::vector<uint8_t> *toImages = allocated ? &transaction->homeImages : &images;
+        toClusters->push_back(cluster);
+        toImages->insert(toImages->end(), transaction->images.begin() + fs_getWritePosition(a), transaction->images.begin() + fs_getWritePosition(a + 1));
+    }
+    transaction->clusters.swap(clusters);
+    transaction->images.swap(images);
+}
+
+//Takes a copy of everything the closing transaction changed, with no operations under way. The journal lock must be held
+static void fs_collectTransaction(uint64_t sequence, JournalTransaction *transaction)
+{
+    fs_recordCounts();
+    fs_collectCacheChanges(sequence, &transaction->clusters, &transaction->images);
+    uint32_t cached = transaction->clusters.size();
+    fs_collectAllocationChanges(&transaction->clusters, &transaction->images);
+    fs_collectChecksumChanges(&transaction->clusters, &transaction->images);
+    fs_collectReferenceChanges(&transaction->clusters, &transaction->images);
+    if(!fs_fitsJournal(transaction->clusters.size()))
+        fs_moveAllocatedHome(transaction, cached);
+
+    //Clusters in the journal's run will be replayed, so they mustn't be written back early. Once a new run has started, the
+    //only ones left in the journal are those of the transaction which started it
+    if(journalRestarted)
+    {
+        memset(&journaledClusters[0], 0, journaledClusters.size() * 8);
+        for(uint32_t a = 0; a < lastClusters.size(); a++)
+            journaledClusters[lastClusters[a] / 64] |= 1ULL << (lastClusters[a] % 64);
+        journalRestarted = 0;
+    }
+    lastClusters = transaction->clusters;
+    for(uint32_t a = 0; a < lastClusters.size(); a++)
+        journaledClusters[lastClusters[a] / 64] |= 1ULL << (lastClusters[a] % 64);
+    memset(&allocatedClusters[0], 0, allocatedClusters.size() * 8);
+    memset(&releasedClusters[0], 0, releasedClusters.size() * 8);
+}
+
+//Writes everything in the journal's run back to its home and syncs it, so the journal can start over. Returns 0 on failure
+static uint8_t fs_checkpointJournal()
+{
+    if(journalHead == 0)
+        return 1;
+    JournalTransaction contents;
+    uint64_t lastSequence;
+    if(!fs_readJournal(journalDevice, &superblock, &contents, &lastSequence) ||
+       !fs_writeClustersInPlace(journalDevice, superblock.clusterShift, contents.clusters, contents.images.data()))
+        return 0;
+    fs_finishCacheCheckpoint(lastSequence + 1, contents.clusters);
+    journalHead = 0;
+    return 1;
+}
+
+//Writes a transaction into the journal after the rest of its run, starting a new run if there's no room left, and syncs.
+//Returns 0 on failure, or if the transaction doesn't fit
+static uint8_t fs_writeTransaction(uint64_t sequence, JournalTransaction *transaction, uint8_t syncFirst)
+{
+    uint32_t count = transaction->clusters.size();
+    uint64_t length = fs_getDescriptorLength(count, superblock.clusterShift) + count;
+    if(!fs_fitsJournal(count))
+        return 0;
+
+    //Clusters written back early, or sent home to make the transaction fit, have to be on the device before a transaction which refers to them
+    uint8_t success = 1;
+    if(!transaction->homeClusters.empty())
+        success &= fs_writeClustersInPlace(journalDevice, superblock.clusterShift, transaction->homeClusters, transaction->homeImages.data());
+    else if(syncFirst)
+        success &= journalDevice->sync();
+    if(!success)
+        return 0;
+
+    //Once the journal is full, everything in it has to be in place before it starts over
+    if(journalHead + length > superblock.journalLength && !fs_checkpointJournal())
+        return 0;
+
+    //A new run opens with an empty transaction, written in the same transfer as the first one in it
+    uint32_t run = journalHead == 0 ? fs_newJournalRun() : journalRun;
+    std::vector<uint8_t> start;
+    if(journalHead == 0)
+        start = fs_buildDescriptor(std::vector<uint32_t>(), std::vector<uint8_t>(), sequence - 1, run, superblock.clusterShift);
+    std::vector<uint8_t> descriptor = fs_buildDescriptor(transaction->clusters, transaction->images, sequence, run, superblock.clusterShift);
+    struct iovec vectors[3];
+    uint32_t vectorCount = 0;
+    if(!start.empty())
+    {
+        vectors[vectorCount].iov_base = &start[0];
+        vectors[vectorCount++].iov_len = start.size();
+    }
+    vectors[vectorCount].iov_base = &descriptor[0];
+    vectors[vectorCount++].iov_len = descriptor.size();
+    if(count > 0)
+    {
+        vectors[vectorCount].iov_base = &transaction->images[0];
+        vectors[vectorCount++].iov_len = transaction->images.size();
+    }
+    BlockRequest request;
+    request.position = fs_getJournalPosition(&superblock, journalHead);
+    request.vectors = vectors;
+    request.vectorCount = vectorCount;
+    success = journalDevice->writeBatch(&request, 1);
+    if(!journalDevice->sync() || !success)
+        return 0;
+
+    if(journalHead == 0)
+    {
+        journalHead = 1;
+        journalRestarted = 1;
+    }
+    journalHead += length;
+    journalRun = run;
+    return 1;
+}
+
+//Makes every operation finished so far durable. Threads committing while a commit is under way wait for it, then share the next
+//one, so each sync covers everything finished in the meantime. Must be called outside any operation. Returns 0 on failure
+uint8_t fs_commit()
+{
+    if(!journalActive)
+        return fs_sync();
+    if(operationDepth != 0)
+        return 0;
+
+    //Everything this thread has finished belongs to the running transaction, or one already being committed
+    std::unique_lock<std::mutex> guard(journalLock);
+    uint64_t target = runningSequence;
+    while(committing && durableSequence < target)
+        journalChanged.wait(guard);
+    if(durableSequence >= target)
+        return lastCommitSucceeded;
+
+    //A transaction which failed to be written has to get there before any other can
+    __atomic_store_n(&committing, 1, __ATOMIC_RELEASE);
+    if(pendingSequence != 0)
+    {
+        guard.unlock();
+        uint8_t success = fs_writeTransaction(pendingSequence, &pendingTransaction, pendingSyncFirst);
+
+        guard.lock();
+        lastCommitSucceeded = success;
+        if(success)
+        {
+            __atomic_store_n(&durableSequence, pendingSequence, __ATOMIC_RELEASE);
+            pendingTransaction = JournalTransaction();
+            __atomic_store_n(&pendingSequence, 0, __ATOMIC_RELEASE);
+        }
+        if(!success || durableSequence >= target)
+        {
+            __atomic_store_n(&committing, 0, __ATOMIC_RELEASE);
+            journalChanged.notify_all();
+            return success;
+        }
+    }
+
+    //Close the running transaction, waiting for the operations in it to finish while holding back new ones
+    __atomic_store_n(&closingTransaction, 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&activeOperations, __ATOMIC_SEQ_CST) != 0)
+        journalChanged.wait(guard);
+    uint64_t sequence = runningSequence;
+    JournalTransaction transaction;
+    fs_collectTransaction(sequence, &transaction);
+    uint8_t syncFirst = __atomic_exchange_n(&earlyWrites, 0, __ATOMIC_RELAXED);
+    runningSequence++;
+    __atomic_store_n(&closingTransaction, 0, __ATOMIC_SEQ_CST);
+    journalChanged.notify_all();
+
+    //Operations carry on in the next transaction while this one is written
+    guard.unlock();
+    uint8_t success = fs_writeTransaction(sequence, &transaction, syncFirst);
+
+    //Only a transaction which got there counts as durable, otherwise its clusters stay in the cache and it's tried again
+    guard.lock();
+    if(success)
+        __atomic_store_n(&durableSequence, sequence, __ATOMIC_RELEASE);
+    else
+    {
+        pendingTransaction = std::move(transaction);
+        pendingSyncFirst = syncFirst;
+        __atomic_store_n(&pendingSequence, sequence, __ATOMIC_RELEASE);
+    }
+    lastCommitSucceeded = success;
+    __atomic_store_n(&committing, 0, __ATOMIC_RELEASE);
+    journalChanged.notify_all();
+    return success;
+}
+
+//Commits everything and writes it all back to its home, so the device can be read directly.
+//Mustn't overlap with anything else. Returns 0 on failure
+uint8_t fs_checkpoint()
+{
+    uint8_t success = fs_sync();
+    if(!journalActive)
+        return success;
+    success &= fs_checkpointJournal();
+    success &= fs_flushCache();
+    return success;
+}
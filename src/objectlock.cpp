@@ -0,0 +1,58 @@
+#include "filesystem.h"
+#include <shared_mutex>
+
+//Object locks. Every object is guarded by a reader/writer lock, so any number of threads can read an object while a
+//single thread changes it. Rather than storing a lock in each object, objects are hashed onto a fixed table of locks.
+//Two objects sharing a lock can't deadlock as a thread never holds more than one object lock at a time, and readers
+//of different objects which happen to share a lock still don't block each other. Alongside each lock is a generation, moved
+//on whenever clusters are replaced in or cut from the chain of an object using it, so file handles can tell when what they
+//remember about where the data is has gone out of date.
+#define OBJECT_LOCK_BITS 12
+#define OBJECT_LOCK_COUNT (1 << OBJECT_LOCK_BITS)
+
+static std::shared_mutex objectLocks[OBJECT_LOCK_COUNT];
+static uint32_t chainGenerations[OBJECT_LOCK_COUNT];
+
+//Returns the slot of the lock guarding an object
+static inline uint32_t fs_getObjectLockSlot(uint32_t objectIndex)
+{
+    return (objectIndex * 2654435761u) >> (32 - OBJECT_LOCK_BITS);
+}
+
+//Returns the lock guarding an object
+static inline std::shared_mutex &fs_getObjectLock(uint32_t objectIndex)
+{
+    return objectLocks[fs_getObjectLockSlot(objectIndex)];
+}
+
+//Locks an object, for writing if exclusive is set or reading otherwise. Blocks until the lock is available
+void fs_lockObject(uint32_t objectIndex, uint8_t exclusive)
+{
+    if(exclusive)
+        fs_getObjectLock(objectIndex).lock();
+    else
+        fs_getObjectLock(objectIndex).lock_shared();
+}
+
+//Releases a lock taken with fs_lockObject, exclusive must match
+void fs_unlockObject(uint32_t objectIndex, uint8_t exclusive)
+{
+    if(exclusive)
+        fs_getObjectLock(objectIndex).unlock();
+    else
+        fs_getObjectLock(objectIndex).unlock_shared();
+}
+
+//Returns the chain generation of an object. Objects sharing a lock share a generation, so it can also move on when another
+//object's chain changes, which only costs handles having to find their place again
+uint32_t fs_getChainGeneration(uint32_t objectIndex)
+{
+    return __atomic_load_n(&chainGenerations[fs_getObjectLockSlot(objectIndex)], __ATOMIC_ACQUIRE);
+}
+
+//Notes that clusters have been replaced in or cut from an object's chain, which the caller must hold the lock of for writing.
+//Returns the new generation
+uint32_t fs_moveChainGeneration(uint32_t objectIndex)
+{
+    return __atomic_add_fetch(&chainGenerations[fs_getObjectLockSlot(objectIndex)], 1, __ATOMIC_ACQ_REL);
+}
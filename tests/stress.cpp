@@ -0,0 +1,396 @@
+//Concurrency stress test. A number of threads create, write, read, look up, clone and remove objects and allocate raw
+//clusters all at once, first on a mapped RAM disk and then on an image file mounted through the block cache with the
+//journal running. Each thread checks what it reads back, a compressed file and a big file are cloned and written to once
+//they're done, and the disk is scrubbed after every run. It's meant to be built with ThreadSanitizer, which reports any data race, from the top
+//of the repository:
+//
+//    g++ -std=c++17 -O1 -g -fsanitize=thread -Iinclude tests/stress.cpp src/*.cpp -o stress -lpthread && ./stress [image]
+//
+//The image defaults to stress.ffs in the current directory, and is deleted afterwards. Exits with 1 if anything was wrong
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "filesystem.h"
+#include "blockdevice.h"
+
+#define STRESS_THREADS 8 //Threads running at once
+#define STRESS_ROUNDS 150 //Objects each thread creates in a run
+#define STRESS_SHARED_DIRECTORIES 4 //Directories every thread adds files to
+#define STRESS_MAX_FILE_SIZE 20000 //Largest file written, so files span several clusters
+#define STRESS_DISK_SIZE (64ULL << 20)
+#define STRESS_CACHE_BUDGET (256 * 512) //Small enough that the cache has to evict while the threads run
+
+//Work shared between the threads of a run
+struct StressState
+{
+    uint32_t rootDirectory;
+    uint32_t shared[STRESS_SHARED_DIRECTORIES];
+    std::vector<uint64_t> handedOut; //Clusters allocated directly by a thread and not yet freed, one bit each
+    uint32_t failures = 0;
+};
+
+//A file a thread left in one of the shared directories, checked again once every thread is done
+struct StressFile
+{
+    std::string path;
+    uint32_t objectIndex;
+    uint32_t seed;
+    uint64_t size;
+};
+
+//Contents a file written with seed has at offset
+static inline uint8_t patternByte(uint32_t seed, uint64_t offset)
+{
+    return (uint8_t)(seed * 31 + offset * 7 + (offset >> 8));
+}
+
+//Counts a failure and says what it was
+static void fail(StressState *state, const std::string &what)
+{
+    __atomic_fetch_add(&state->failures, 1, __ATOMIC_RELAXED);
+    std::cout << "Failed: " << what << std::endl;
+}
+
+//Fills a file with the pattern for seed, then overwrites a stretch in the middle with the pattern for seed + 1. The expected
+//contents are left in expected. Returns 0 if any write came up short
+static uint8_t writePattern(uint32_t objectIndex, uint32_t seed, uint64_t size, std::vector<uint8_t> *expected)
+{
+    expected->resize(size);
+    for(uint64_t a = 0; a < size; a++)
+        (*expected)[a] = patternByte(seed, a);
+    uint64_t middle = size / 3, middleLength = size / 4;
+    for(uint64_t a = middle; a < middle + middleLength; a++)
+        (*expected)[a] = patternByte(seed + 1, a);
+
+    FileHandle *handle = fs_open(objectIndex);
+    uint8_t success = fs_pwrite(handle, 0, &(*expected)[0], size) == size;
+    success &= fs_pwrite(handle, middle, &(*expected)[middle], middleLength) == middleLength;
+    fs_close(handle);
+    return success;
+}
+
+//Reads a whole file back and compares it with expected. Returns 0 if it differs
+static uint8_t checkContents(uint32_t objectIndex, const std::vector<uint8_t> &expected)
+{
+    std::vector<uint8_t> buffer(expected.size() + 1);
+    FileHandle *handle = fs_open(objectIndex);
+    uint64_t got = fs_pread(handle, 0, &buffer[0], buffer.size());
+    fs_close(handle);
+    return got == expected.size() && memcmp(&buffer[0], &expected[0], got) == 0;
+}
+
+//Creates a file called name in a directory, through a single operation. Returns the file, or 0 if the disk is full
+static uint32_t createFile(uint32_t directoryIndex, const std::string &name, uint8_t compressed)
+{
+    uint8_t type = compressed && (superblock.features & FEATURE_COMPRESSION) ? NODE_FILE | NODE_COMPRESSED : NODE_FILE;
+    fs_beginOperation();
+    uint32_t file = fs_createObjectNear(directoryIndex, type, 0, name.size(), (uint8_t*)name.c_str());
+    if(file != 0)
+        fs_addObjectToDirectory(directoryIndex, file);
+    fs_endOperation();
+    return file;
+}
+
+//Unlists an object from a directory only the calling thread changes, then frees it. Returns 0 if it isn't listed there
+static uint8_t removeFile(uint32_t directoryIndex, uint32_t objectIndex)
+{
+    uint32_t entries = fs_getDirectorySize(directoryIndex);
+    for(uint32_t a = 1; a < entries; a++)
+    {
+        if(fs_getDirectoryObject(directoryIndex, a) != objectIndex)
+            continue;
+        fs_beginOperation();
+        uint8_t removed = fs_removeObjectFromDirectory(directoryIndex, a);
+        if(removed)
+            fs_removeTree(objectIndex);
+        fs_endOperation();
+        return removed;
+    }
+    return 0;
+}
+
+//Allocates some clusters directly, making sure no other thread holds any of them, then frees them again
+static void allocateRaw(StressState *state, uint32_t count)
+{
+    std::vector<uint32_t> clusters;
+    fs_beginOperation();
+    uint32_t first;
+    uint32_t length = fs_allocateRun(count, &first);
+    for(uint32_t a = 0; a < length; a++)
+        clusters.push_back(first + a);
+    uint32_t single = fs_allocateCluster();
+    if(single != 0)
+        clusters.push_back(single);
+
+    for(uint32_t a = 0; a < clusters.size(); a++)
+    {
+        uint64_t bit = 1ULL << (clusters[a] % 64);
+        if(__atomic_fetch_or(&state->handedOut[clusters[a] / 64], bit, __ATOMIC_RELAXED) & bit)
+            fail(state, "cluster " + std::to_string(clusters[a]) + " allocated twice");
+    }
+    for(uint32_t a = 0; a < clusters.size(); a++)
+    {
+        __atomic_fetch_and(&state->handedOut[clusters[a] / 64], ~(1ULL << (clusters[a] % 64)), __ATOMIC_RELAXED);
+        fs_freeRun(clusters[a], 1);
+    }
+    fs_endOperation();
+}
+
+//Thread body. Each round leaves a file in a shared directory, reads files other threads are writing, and creates, clones
+//and removes files in a directory of its own
+static void stressThread(StressState *state, uint32_t id, std::vector<StressFile> *kept)
+{
+    std::string own = "thread" + std::to_string(id);
+    fs_beginOperation();
+    uint32_t ownDirectory = fs_createDirectory(state->rootDirectory, 0, own.size(), (uint8_t*)own.c_str());
+    if(ownDirectory != 0)
+        fs_addObjectToDirectory(state->rootDirectory, ownDirectory);
+    fs_endOperation();
+    if(ownDirectory == 0)
+    {
+        fail(state, "creating " + own);
+        return;
+    }
+
+    std::vector<uint8_t> expected, cloneExpected, buffer(STRESS_MAX_FILE_SIZE);
+    for(uint32_t round = 0; round < STRESS_ROUNDS; round++)
+    {
+        uint32_t seed = id * STRESS_ROUNDS + round;
+        uint64_t size = (seed * 7919ULL) % STRESS_MAX_FILE_SIZE + 1;
+        uint32_t sharedIndex = (id + round) % STRESS_SHARED_DIRECTORIES;
+        std::string name = "t" + std::to_string(id) + "-" + std::to_string(round);
+
+        //A file in a shared directory, written in two overlapping pieces and read straight back
+        uint32_t file = createFile(state->shared[sharedIndex], name, round % 2);
+        if(file == 0 || !writePattern(file, seed, size, &expected) || !checkContents(file, expected))
+        {
+            fail(state, "writing " + name);
+            continue;
+        }
+        std::string path = "shared" + std::to_string(sharedIndex) + "/" + name;
+        if(fs_getClusterFromFilepath(state->rootDirectory, state->rootDirectory, (uint8_t*)path.c_str(), path.size()).objectIndex != file)
+            fail(state, "looking up " + path);
+        StressFile keep = {path, file, seed, size};
+        kept->push_back(keep);
+
+        //Read whatever another thread last added to the next shared directory, which it may still be writing
+        uint32_t neighbour = state->shared[(sharedIndex + 1) % STRESS_SHARED_DIRECTORIES];
+        fs_lockObject(neighbour, 0);
+        uint32_t entries = fs_getDirectorySize(neighbour);
+        fs_unlockObject(neighbour, 0);
+        if(entries > 1)
+        {
+            uint32_t other = fs_getDirectoryObject(neighbour, entries - 1);
+            if(other != 0)
+                fs_readInto(other, 0, &buffer[0], buffer.size());
+        }
+
+        //A file of its own, cloned if the disk can, where the clone is changed and neither may see the other's data
+        std::string scratch = "scratch" + std::to_string(round);
+        uint32_t scratchFile = createFile(ownDirectory, scratch, round % 3 == 0);
+        if(scratchFile == 0 || !writePattern(scratchFile, seed + 7, size, &expected))
+        {
+            fail(state, "writing " + own + "/" + scratch);
+            continue;
+        }
+        uint32_t clone = fs_clone(scratchFile);
+        if(clone != 0)
+        {
+            fs_addObjectToDirectory(ownDirectory, clone);
+            if(!writePattern(clone, seed + 13, size / 2 + 1, &cloneExpected))
+                fail(state, "writing the clone of " + scratch);
+            cloneExpected.resize(size > cloneExpected.size() ? size : cloneExpected.size());
+            for(uint64_t a = size / 2 + 1; a < size; a++)
+                cloneExpected[a] = expected[a];
+            if(!checkContents(clone, cloneExpected) || !checkContents(scratchFile, expected))
+                fail(state, "checking the clone of " + scratch);
+            if(!removeFile(ownDirectory, clone))
+                fail(state, "removing the clone of " + scratch);
+        }
+        else if(superblock.features & FEATURE_CLONES)
+            fail(state, "cloning " + scratch);
+        if(!removeFile(ownDirectory, scratchFile))
+            fail(state, "removing " + scratch);
+
+        allocateRaw(state, round % 17 + 1);
+    }
+}
+
+//Writes length bytes at offset within a file, keeping expected in step. The bytes are random if noisy is set, which leaves them
+//as they are when compressed, and repeat otherwise. Returns 0 if the write came up short
+static uint8_t writeBlock(uint32_t objectIndex, uint64_t offset, uint64_t length, uint8_t noisy, uint32_t *seed, std::vector<uint8_t> *expected)
+{
+    if(expected->size() < offset + length)
+        expected->resize(offset + length);
+    for(uint64_t a = 0; a < length; a++)
+    {
+        *seed = *seed * 1103515245 + 12345;
+        (*expected)[offset + a] = noisy ? *seed >> 16 : (uint8_t)((a / 100) % 8);
+    }
+    FileHandle *handle = fs_open(objectIndex);
+    uint8_t success = fs_pwrite(handle, offset, &(*expected)[offset], length) == length;
+    fs_close(handle);
+    return success;
+}
+
+//Clones a compressed file whose chunks have moved around, then writes to the original. The chunks the write lands in move again,
+//which means copying the clusters they were in first, and neither file may see the other's data afterwards
+static void cloneCompressed(StressState *state)
+{
+    if(!(superblock.features & FEATURE_CLONES) || !(superblock.features & FEATURE_COMPRESSION))
+        return;
+    uint32_t file = createFile(state->rootDirectory, "compressed", 1);
+    std::vector<uint8_t> expected;
+    uint32_t seed = 1;
+    if(file == 0 || !writeBlock(file, 834856, 36402, 1, &seed, &expected) || !writeBlock(file, 94566, 12492, 0, &seed, &expected))
+    {
+        fail(state, "writing compressed");
+        return;
+    }
+    uint32_t clone = fs_clone(file);
+    if(clone == 0)
+    {
+        fail(state, "cloning compressed");
+        return;
+    }
+    fs_addObjectToDirectory(state->rootDirectory, clone);
+    std::vector<uint8_t> cloneExpected = expected;
+    if(!writeBlock(file, 872053, 1116, 1, &seed, &expected))
+        fail(state, "writing compressed after cloning it");
+    if(!checkContents(file, expected) || !checkContents(clone, cloneExpected))
+        fail(state, "checking compressed and its clone");
+}
+
+//Clones a file spanning a few thousand clusters, then appends a byte to the clone and overwrites one in the middle of each.
+//Only the clusters written to may be copied, not the rest of the file
+static void cloneLarge(StressState *state)
+{
+    if(!(superblock.features & FEATURE_CLONES))
+        return;
+    uint32_t file = createFile(state->rootDirectory, "large", 0);
+    std::vector<uint8_t> expected;
+    uint32_t seed = 2;
+    if(file == 0 || !writeBlock(file, 0, 2 << 20, 1, &seed, &expected))
+    {
+        fail(state, "writing large");
+        return;
+    }
+    uint32_t clone = fs_clone(file);
+    if(clone == 0)
+    {
+        fail(state, "cloning large");
+        return;
+    }
+    fs_addObjectToDirectory(state->rootDirectory, clone);
+    std::vector<uint8_t> cloneExpected = expected;
+    uint32_t usedBefore = fs_statfs().usedClusters;
+    if(!writeBlock(clone, cloneExpected.size(), 1, 1, &seed, &cloneExpected) || !writeBlock(clone, 1 << 20, 1, 1, &seed, &cloneExpected) ||
+       !writeBlock(file, 1 << 19, 1, 1, &seed, &expected))
+        fail(state, "writing large after cloning it");
+    uint32_t copied = fs_statfs().usedClusters - usedBefore;
+    if(copied > 4)
+        fail(state, "copying " + std::to_string(copied) + " clusters of large for three bytes");
+    if(!checkContents(file, expected) || !checkContents(clone, cloneExpected))
+        fail(state, "checking large and its clone");
+}
+
+//Runs the threads on the mounted disk, then checks every file left in the shared directories and scrubs the disk
+static void runStress(StressState *state)
+{
+    state->rootDirectory = fs_getRootDirectory();
+    state->handedOut.assign(superblock.allocationWordCount, 0);
+    for(uint32_t a = 0; a < STRESS_SHARED_DIRECTORIES; a++)
+    {
+        std::string name = "shared" + std::to_string(a);
+        state->shared[a] = fs_createDirectory(state->rootDirectory, 0, name.size(), (uint8_t*)name.c_str());
+        fs_addObjectToDirectory(state->rootDirectory, state->shared[a]);
+    }
+
+    std::vector<std::vector<StressFile>> kept(STRESS_THREADS);
+    std::vector<std::thread> threads;
+    for(uint32_t a = 0; a < STRESS_THREADS; a++)
+        threads.push_back(std::thread(stressThread, state, a, &kept[a]));
+    for(uint32_t a = 0; a < STRESS_THREADS; a++)
+        threads[a].join();
+
+    //Every file left behind has to still be where it was put, holding what was written
+    std::vector<uint8_t> expected;
+    for(uint32_t a = 0; a < STRESS_THREADS; a++)
+    {
+        for(const StressFile &file : kept[a])
+        {
+            expected.resize(file.size);
+            for(uint64_t b = 0; b < file.size; b++)
+                expected[b] = patternByte(b >= file.size / 3 && b < file.size / 3 + file.size / 4 ? file.seed + 1 : file.seed, b);
+            FilepathClusterInfo info = fs_getClusterFromFilepath(state->rootDirectory, state->rootDirectory, (uint8_t*)file.path.c_str(), file.path.size());
+            if(info.objectIndex != file.objectIndex || !checkContents(file.objectIndex, expected))
+                fail(state, "checking " + file.path + " afterwards");
+        }
+    }
+
+    cloneCompressed(state);
+    cloneLarge(state);
+
+    ScrubReport report;
+    if(!fs_scrub(4, &report))
+        fail(state, "scrub found " + std::to_string(report.brokenObjects) + " broken objects, " + std::to_string(report.checksumErrors) +
+                    " checksum errors and " + std::to_string(report.leakedClusters + report.unallocatedClusters) + " misallocated clusters");
+}
+
+int main(int argc, char **argv)
+{
+    std::string image = argc > 1 ? argv[1] : "stress.ffs";
+    uint32_t failures = 0;
+
+    //A mapped disk, where every thread works on the same memory
+    std::cout << "Mapped disk... " << std::flush;
+    BlockDevice *device = fs_createRamDevice(STRESS_DISK_SIZE);
+    if(device == NULL || !fs_formatDiskWithFeatures(device, 512, 0, FEATURE_CHECKSUMS | FEATURE_CLONES | FEATURE_COMPRESSION))
+    {
+        std::cout << "Failed to create RAM disk" << std::endl;
+        return 1;
+    }
+    StressState mapped;
+    runStress(&mapped);
+    delete fs_unmount();
+    failures += mapped.failures;
+    std::cout << (mapped.failures == 0 ? "Done." : "Failed.") << std::endl;
+
+    //An image through a cache too small to hold it, so clusters are evicted, written back and journaled underneath the threads
+    std::cout << "Cached disk... " << std::flush;
+    fs_setCacheBudget(STRESS_CACHE_BUDGET);
+    unlink(image.c_str());
+    device = fs_openFileDevice(image.c_str(), STRESS_DISK_SIZE);
+    if(device == NULL || !fs_formatDiskWithFeatures(device, 512, 0, FEATURE_CHECKSUMS | FEATURE_JOURNAL | FEATURE_CLONES | FEATURE_COMPRESSION))
+    {
+        std::cout << "Failed to create " << image << std::endl;
+        return 1;
+    }
+    StressState cached;
+    runStress(&cached);
+    delete fs_unmount();
+
+    //Everything has to be there again after mounting it afresh
+    ScrubReport report;
+    device = fs_openFileDevice(image.c_str(), 0);
+    if(device != NULL && fs_mount(device))
+    {
+        if(!fs_scrub(4, &report))
+            fail(&cached, "scrubbing " + image + " after mounting it again");
+        delete fs_unmount();
+    }
+    else
+    {
+        fail(&cached, "mounting " + image + " again");
+        delete device;
+    }
+    unlink(image.c_str());
+    failures += cached.failures;
+    std::cout << (cached.failures == 0 ? "Done." : "Failed.") << std::endl;
+
+    return failures == 0 ? 0 : 1;
+}